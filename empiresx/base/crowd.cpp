@@ -0,0 +1,34 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "crowd.hpp"
+
+#include <algorithm>
+
+namespace genie {
+
+namespace game {
+
+void UnitCells::build(const fixed *x, const fixed *y, size_t n) {
+	std::fill(start.begin(), start.end(), 0);
+	cell.resize(n);
+	items.resize(n);
+
+	for (size_t i = 0; i < n; ++i) {
+		int tx = std::clamp<int>(x[i] >> fixed_bits, 0, w - 1);
+		int ty = std::clamp<int>(y[i] >> fixed_bits, 0, h - 1);
+		cell[i] = (uint32_t)ty * w + tx;
+		++start[cell[i]];
+	}
+
+	// turn counts into offsets just past the end of each tile, and fill the tiles back to front
+	uint32_t sum = 0;
+	for (uint32_t &s : start)
+		s = sum += s;
+
+	for (size_t i = n; i-- > 0;)
+		items[--start[cell[i]]] = (uint32_t)i;
+}
+
+}
+
+}
@@ -0,0 +1,90 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Local collision avoidance. Every tick all units are bucketed by tile with a counting sort, so
+ * finding the neighbours of all units costs O(n) rather than comparing all pairs. The buckets are
+ * filled in unit order and only depend on the exact positions, so every peer visits the same
+ * neighbours in the same order. Combat looks up the enemies in sight of a unit the same way.
+ */
+
+#include "math.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+/** Units closer than this push each other away. Must not exceed one tile, see UnitCells::near. */
+static constexpr fixed unit_spacing = fixed_one / 2;
+/** Maximum number of neighbours that push a unit in one tick. */
+static constexpr unsigned push_neighbours = 8;
+/** Maximum distance along either axis a unit is pushed in one tick. */
+static constexpr fixed push_max = fixed_one / 16;
+
+/** Dense unit indices grouped by the tile they are on. */
+class UnitCells final {
+	unsigned w, h;
+	std::vector<uint32_t> start; /**< offset in items of each tile, followed by the number of items */
+	std::vector<uint32_t> items;
+	std::vector<uint32_t> cell; /**< tile of each unit */
+public:
+	UnitCells(unsigned w, unsigned h) : w(w), h(h), start((size_t)w * h + 1), items(), cell() {}
+
+	/** Sort units [0, n) at positions \a x, \a y into their tiles. Units off the map are put on the nearest tile. */
+	void build(const fixed *x, const fixed *y, size_t n);
+
+	/**
+	 * Invoke \a f for each unit on tiles [x0, x1] x [y0, y1], clipped to the map. Units are
+	 * visited by tile and then in unit order.
+	 */
+	template<typename F> void each(int x0, int y0, int x1, int y1, F f) const {
+		x0 = std::max(x0, 0);
+		y0 = std::max(y0, 0);
+		x1 = std::min(x1, (int)w - 1);
+		y1 = std::min(y1, (int)h - 1);
+
+		for (int cy = y0; cy <= y1; ++cy)
+			for (int cx = x0; cx <= x1; ++cx) {
+				size_t c = (size_t)cy * w + cx;
+
+				for (uint32_t k = start[c], end = start[c + 1]; k < end; ++k)
+					f(items[k]);
+			}
+	}
+
+	/**
+	 * Invoke \a f for each unit on the 3x3 tiles around position \a x, \a y, which includes all
+	 * units closer than one tile, until it returns false. Units are visited by tile and then in
+	 * unit order.
+	 */
+	template<typename F> void near(fixed x, fixed y, F f) const {
+		int tx = x >> fixed_bits, ty = y >> fixed_bits;
+
+		for (int cy = ty - 1; cy <= ty + 1; ++cy) {
+			if (cy < 0 || (unsigned)cy >= h)
+				continue;
+
+			for (int cx = tx - 1; cx <= tx + 1; ++cx) {
+				if (cx < 0 || (unsigned)cx >= w)
+					continue;
+
+				size_t c = (size_t)cy * w + cx;
+
+				for (uint32_t k = start[c], end = start[c + 1]; k < end; ++k)
+					if (!f(items[k]))
+						return;
+			}
+		}
+	}
+};
+
+}
+
+}
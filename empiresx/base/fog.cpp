@@ -0,0 +1,151 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "fog.hpp"
+
+#include <algorithm>
+
+namespace genie {
+
+namespace game {
+
+Fog::Fog(unsigned w, unsigned h)
+	: w(w), h(h), players(0), words(((size_t)w * h + 63) / 64), count(), vis(), known(), lifted(), stencils() {}
+
+void Fog::reserve(unsigned n) {
+	if (n <= players)
+		return;
+
+	players = n;
+	count.resize((size_t)n * w * h);
+	vis.resize(n * words);
+	known.resize(n * words);
+	lifted.resize(n);
+}
+
+void Fog::clear() noexcept {
+	players = 0;
+	count.clear();
+	vis.clear();
+	known.clear();
+	lifted.clear();
+}
+
+const std::vector<uint8_t> &Fog::stencil(unsigned radius) {
+	if (radius >= stencils.size())
+		stencils.resize(radius + 1);
+
+	std::vector<uint8_t> &s = stencils[radius];
+
+	// tiles whose center is within radius + 1/2, which makes for rounder circles
+	if (s.empty())
+		for (int dy = -(int)radius; dy <= (int)radius; ++dy) {
+			int dx = radius, limit = radius * (radius + 1);
+			while (dx * dx + dy * dy > limit)
+				--dx;
+			s.emplace_back((uint8_t)dx);
+		}
+
+	return s;
+}
+
+/** Tiles [begin, end) of a player with counts \a c, visible tiles \a v and explored tiles \a k are seen by one more unit. */
+static void show(uint16_t *c, uint64_t *v, uint64_t *k, size_t begin, size_t end) noexcept {
+	for (size_t t = begin; t < end; ++t)
+		if (!c[t]++) {
+			v[t / 64] |= (uint64_t)1 << (t % 64);
+			k[t / 64] |= (uint64_t)1 << (t % 64);
+		}
+}
+
+/** Tiles [begin, end) of a player with counts \a c and visible tiles \a v are seen by one unit less. */
+static void hide(uint16_t *c, uint64_t *v, size_t begin, size_t end) noexcept {
+	for (size_t t = begin; t < end; ++t) {
+		assert(c[t]);
+		if (!--c[t])
+			v[t / 64] &= ~((uint64_t)1 << (t % 64));
+	}
+}
+
+bool Fog::span(const std::vector<uint8_t> &s, int x, int y, int row, int &begin, int &end) const noexcept {
+	int radius = (int)s.size() / 2, dy = row - y;
+	if (dy < -radius || dy > radius)
+		return false;
+
+	begin = std::max(0, x - s[dy + radius]);
+	end = std::min<int>(w - 1, x + s[dy + radius]) + 1;
+	return true;
+}
+
+void Fog::add(unsigned player, int x, int y, unsigned radius) {
+	assert(player < players);
+	const std::vector<uint8_t> &s = stencil(radius);
+	uint16_t *c = &count[(size_t)player * w * h];
+	uint64_t *v = &vis[player * words], *k = &known[player * words];
+
+	for (int row = std::max(0, y - (int)radius), last = std::min<int>(h - 1, y + radius); row <= last; ++row) {
+		int begin = 0, end = 0;
+		span(s, x, y, row, begin, end);
+		show(c, v, k, (size_t)row * w + begin, (size_t)row * w + end);
+	}
+}
+
+void Fog::remove(unsigned player, int x, int y, unsigned radius) {
+	assert(player < players);
+	const std::vector<uint8_t> &s = stencil(radius);
+	uint16_t *c = &count[(size_t)player * w * h];
+	uint64_t *v = &vis[player * words];
+
+	for (int row = std::max(0, y - (int)radius), last = std::min<int>(h - 1, y + radius); row <= last; ++row) {
+		int begin = 0, end = 0;
+		span(s, x, y, row, begin, end);
+		hide(c, v, (size_t)row * w + begin, (size_t)row * w + end);
+	}
+}
+
+void Fog::move(unsigned player, int from_x, int from_y, int to_x, int to_y, unsigned radius) {
+	assert(player < players);
+	const std::vector<uint8_t> &s = stencil(radius);
+	uint16_t *c = &count[(size_t)player * w * h];
+	uint64_t *v = &vis[player * words], *k = &known[player * words];
+	int first = std::max(0, std::min(from_y, to_y) - (int)radius), last = std::min<int>(h - 1, std::max(from_y, to_y) + radius);
+
+	// units mostly move to a neighbouring tile, so only touch the tiles that are not covered before and after
+	for (int row = first; row <= last; ++row) {
+		int a0, a1, b0, b1;
+		bool was = span(s, from_x, from_y, row, a0, a1), is = span(s, to_x, to_y, row, b0, b1);
+		size_t base = (size_t)row * w;
+
+		if (was && is) {
+			show(c, v, k, base + b0, base + std::max(b0, std::min(b1, a0)));
+			show(c, v, k, base + std::max(b0, a1), base + b1);
+			hide(c, v, base + a0, base + std::max(a0, std::min(a1, b0)));
+			hide(c, v, base + std::max(a0, b1), base + a1);
+		} else if (is) {
+			show(c, v, k, base + b0, base + b1);
+		} else if (was) {
+			hide(c, v, base + a0, base + a1);
+		}
+	}
+}
+
+void Fog::reveal(unsigned player) {
+	assert(player < players);
+	size_t tiles = (size_t)w * h;
+	uint64_t *k = &known[player * words];
+
+	std::fill(k, k + tiles / 64, ~(uint64_t)0);
+	if (tiles % 64)
+		k[tiles / 64] = ((uint64_t)1 << (tiles % 64)) - 1;
+}
+
+bool Fog::explored(const uint64_t *bits, size_t n) {
+	if (n != known.size())
+		return false;
+
+	std::copy(bits, bits + n, known.begin());
+	return true;
+}
+
+}
+
+}
@@ -0,0 +1,79 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Fog of war. For every player and tile we count how many of its units see the tile, so a unit
+ * can stop seeing its surroundings in O(radius^2) without looking at any other unit. Visible
+ * and explored tiles are kept as bitsets as well, so drawing and the AI can check any tile with
+ * a single load. Units only update the fog when they enter another tile.
+ */
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+class Fog final {
+	unsigned w, h, players;
+	size_t words; /**< number of bitset words per player */
+	std::vector<uint16_t> count; /**< units of each player that see each tile, player by player */
+	std::vector<uint64_t> vis, known; /**< visible and explored tiles, player by player */
+	std::vector<uint8_t> lifted; /**< players that see everything */
+	std::vector<std::vector<uint8_t>> stencils; /**< half width of each row of the circle with each radius */
+public:
+	Fog(unsigned w, unsigned h);
+
+	unsigned size() const noexcept { return players; }
+
+	/** Make room for at least \a n players. New players have not explored anything yet. */
+	void reserve(unsigned n);
+	/** Forget all players and what they have seen and explored. */
+	void clear() noexcept;
+
+	/** A unit of \a player starts to see all tiles within \a radius of tile \a x, \a y. */
+	void add(unsigned player, int x, int y, unsigned radius);
+	/** Undo add with the same arguments. */
+	void remove(unsigned player, int x, int y, unsigned radius);
+
+	/** Same as remove followed by add, but only touches the tiles that the unit starts or stops to see. */
+	void move(unsigned player, int from_x, int from_y, int to_x, int to_y, unsigned radius);
+
+	/** Mark the whole map explored for \a player. */
+	void reveal(unsigned player);
+	/** Let \a player see the whole map or put the fog back. */
+	void lift(unsigned player, bool all) noexcept {
+		assert(player < players);
+		lifted[player] = all;
+	}
+
+	bool visible(unsigned player, unsigned x, unsigned y) const noexcept {
+		assert(player < players && x < w && y < h);
+		size_t t = (size_t)y * w + x;
+		return lifted[player] || (vis[player * words + t / 64] >> (t % 64) & 1);
+	}
+
+	bool explored(unsigned player, unsigned x, unsigned y) const noexcept {
+		assert(player < players && x < w && y < h);
+		size_t t = (size_t)y * w + x;
+		return known[player * words + t / 64] >> (t % 64) & 1;
+	}
+
+	/** Explored tiles of all players, for snapshots. */
+	const std::vector<uint64_t> &explored() const noexcept { return known; }
+	/** Restore explored tiles of all players. Returns false if \a bits does not fit. */
+	bool explored(const uint64_t *bits, size_t n);
+private:
+	const std::vector<uint8_t> &stencil(unsigned radius);
+	/** Columns [begin, end) of \a row within stencil \a s around tile \a x, \a y. Returns false if the row is out of reach. */
+	bool span(const std::vector<uint8_t> &s, int x, int y, int row, int &begin, int &end) const noexcept;
+};
+
+}
+
+}
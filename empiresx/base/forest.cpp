@@ -0,0 +1,60 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "forest.hpp"
+
+#include <algorithm>
+
+namespace genie {
+
+namespace game {
+
+static bool before(const TileResource &a, const TileResource &b) noexcept {
+	return a.y != b.y ? a.y < b.y : a.x < b.x;
+}
+
+bool Forest::assign(std::vector<TileResource> list) {
+	std::sort(list.begin(), list.end(), before);
+
+	for (size_t i = 0; i < list.size(); ++i)
+		if (list[i].x >= w || list[i].y >= h || (i && !before(list[i - 1], list[i])))
+			return false;
+
+	cells = std::move(list);
+	std::fill(rows.begin(), rows.end(), 0);
+
+	// count cells per row and turn the counts into starting indices
+	for (const TileResource &c : cells)
+		++rows[c.y + 1];
+
+	for (unsigned y = 0; y < h; ++y)
+		rows[y + 1] += rows[y];
+
+	return true;
+}
+
+TileResource *Forest::find(unsigned x, unsigned y) noexcept {
+	if (x >= w || y >= h)
+		return NULL;
+
+	auto first = cells.begin() + rows[y], last = cells.begin() + rows[y + 1];
+	auto it = std::lower_bound(first, last, x, [](const TileResource &c, unsigned x) { return c.x < x; });
+
+	return it != last && it->x == x ? &*it : NULL;
+}
+
+bool Forest::erase(unsigned x, unsigned y) {
+	TileResource *c = find(x, y);
+	if (!c)
+		return false;
+
+	cells.erase(cells.begin() + (c - cells.data()));
+
+	for (unsigned r = y + 1; r <= h; ++r)
+		--rows[r];
+
+	return true;
+}
+
+}
+
+}
@@ -0,0 +1,62 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Resources that take up a single tile and are plentiful, i.e. trees. Rather than a full
+ * particle each, they are kept as small cells sorted by row and column, with the index of
+ * the first cell of every row. Finding the cell of a tile is a binary search within its row
+ * and visiting an area only touches the rows it spans. Particles for drawing are made by the
+ * world when the cells become visible.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+/** Also used as snapshot record. */
+struct TileResource final {
+	uint16_t x, y;
+	uint8_t type; /**< ResourceType */
+	uint8_t variant; /**< sprite */
+	uint16_t amount; /**< what is left */
+};
+
+class Forest final {
+	unsigned w, h;
+	std::vector<TileResource> cells; /**< sorted by row, then column */
+	std::vector<uint32_t> rows; /**< index of the first cell of each row, plus the end */
+public:
+	Forest(unsigned w, unsigned h) : w(w), h(h), cells(), rows(h + 1, 0) {}
+
+	size_t size() const noexcept { return cells.size(); }
+	const std::vector<TileResource> &all() const noexcept { return cells; }
+
+	/** Replace all cells by \a list. Returns false if any cell is off the map or shares its tile with another one. */
+	bool assign(std::vector<TileResource> list);
+
+	TileResource *find(unsigned x, unsigned y) noexcept;
+	const TileResource *find(unsigned x, unsigned y) const noexcept {
+		return const_cast<Forest*>(this)->find(x, y);
+	}
+
+	/** Remove cell at tile \a x, \a y. Returns false if there is none. */
+	bool erase(unsigned x, unsigned y);
+
+	/** Invoke \a f for all cells within columns [x0, x1] and rows [y0, y1], which have to be on the map. */
+	template<typename F> void each(unsigned x0, unsigned y0, unsigned x1, unsigned y1, F f) const {
+		for (unsigned y = y0; y <= y1; ++y)
+			for (uint32_t i = rows[y], end = rows[y + 1]; i < end && cells[i].x <= x1; ++i)
+				if (cells[i].x >= x0)
+					f(cells[i]);
+	}
+};
+
+}
+
+}
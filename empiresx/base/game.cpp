@@ -13,6 +13,7 @@
 
 #include <string>
 #include <map>
+#include <algorithm>
 
 namespace genie {
 
@@ -35,9 +36,9 @@ bool operator<(const Peer &lhs, const Peer &rhs) {
 	return lhs.id < rhs.id;
 }
 
-Slave::Slave(sockfd fd) : fd(fd), id(0), pid(0), name() {}
-Slave::Slave(sockfd fd, user_id id) : fd(fd), id(id), pid(0), name() {}
-Slave::Slave(const std::string &name) : fd(INVALID_SOCKET), id(0), name(name) {}
+Slave::Slave(sockfd fd) : fd(fd), id(0), pid(0), name(), player(false), done(0), rtt(0) {}
+Slave::Slave(sockfd fd, user_id id) : fd(fd), id(id), pid(0), name(), player(false), done(0), rtt(0) {}
+Slave::Slave(const std::string &name) : fd(INVALID_SOCKET), id(0), pid(0), name(name), player(false), done(0), rtt(0) {}
 
 Multiplayer::Multiplayer(MultiplayerCallback &cb, const std::string &name, uint16_t port)
 	: net(), name(name), port(port), t_worker(), mut(), cb(cb), gcb(nullptr), invalidated(false), self(0) {}
@@ -47,11 +48,14 @@ void MultiplayerClient::set_gcb(game::GameCallback *gcb, uint16_t slave_count, u
 	this->gcb = gcb;
 
 	Command cmd = Command::ready(slave_count, prng_next);
+	std::lock_guard<std::mutex> send_lock(send_mut);
 	sock.send(cmd, false);
 }
 
 MultiplayerHost::MultiplayerHost(MultiplayerCallback &cb, const std::string &name, uint16_t port, bool dedicated)
 	: Multiplayer(cb, name, port), sock(port), slaves(), idmod(1), ready_confirms(0), dedicated(dedicated)
+	, running(false), closing(false), orders(), closed(0), delay(game::turn_delay_initial), epoch(std::chrono::steady_clock::now())
+	, sums(), reports(), desynced(false), dumped(false)
 {
 	puts("start host");
 	srand((unsigned)time(NULL));
@@ -142,7 +146,158 @@ void MultiplayerHost::event_process(sockfd fd, Command &cmd) {
 		}
 		--ready_confirms;
 		break;
+	case CmdType::order:
+		{
+			// never trust the client to tell us which player it controls
+			Order o = cmd.data.order;
+			o.player = slave(fd).pid;
+			orders.emplace_back(o);
+		}
+		break;
+	case CmdType::turn_end:
+		{
+			Slave &s = slave(fd);
+			s.done = std::max(s.done, cmd.data.turn_end.turn);
+			try_close();
+		}
+		break;
+	case CmdType::ping:
+		{
+			Slave &s = slave(fd);
+			unsigned rtt = now() - cmd.data.ping;
+			// smooth out any spikes
+			s.rtt = s.rtt ? (7 * s.rtt + rtt) / 8 : rtt;
+		}
+		break;
+	case CmdType::checksum:
+		{
+			const Checksum &c = cmd.data.checksum;
+			uint64_t hash = (uint64_t)c.hash[1] << 32 | c.hash[0];
+			user_id id = slave(fd).id;
+			auto search = sums.find(c.tick);
+
+			if (search != sums.end())
+				verify(id, c.tick, hash, search->second);
+			else if (sums.empty() || c.tick > sums.rbegin()->first)
+				reports[c.tick].emplace_back(id, hash); // we have not got there yet
+		}
+		break;
+	}
+}
+
+uint32_t MultiplayerHost::now() const {
+	return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void MultiplayerHost::send_order(const Order &o) {
+	std::lock_guard<std::recursive_mutex> lock(mut);
+	orders.emplace_back(o);
+}
+
+void MultiplayerHost::end_turn(uint32_t turn) {
+	std::lock_guard<std::recursive_mutex> lock(mut);
+	Slave &s = slave(INVALID_SOCKET);
+	s.done = std::max(s.done, turn);
+	try_close();
+}
+
+void MultiplayerHost::checksum(uint32_t tick, uint64_t hash) {
+	std::lock_guard<std::recursive_mutex> lock(mut);
+	sums[tick] = hash;
+
+	auto search = reports.find(tick);
+	if (search != reports.end()) {
+		for (auto &r : search->second)
+			verify(r.first, tick, r.second, hash);
+		reports.erase(search);
 	}
+
+	// nobody can lag behind this far, so older ones are never compared again
+	while (sums.size() > game::checksum_keep)
+		sums.erase(sums.begin());
+}
+
+void MultiplayerHost::verify(user_id id, uint32_t tick, uint64_t hash, uint64_t expected) {
+	if (hash == expected)
+		return;
+
+	fprintf(stderr, "desync at tick %" PRIu32 ": slave %u has checksum %016" PRIx64 ", expected %016" PRIx64 "\n", tick, id, hash, expected);
+	desynced = true;
+}
+
+/** Measure round trip times once per second. */
+static constexpr unsigned ping_turns = 1000 / game::turn_ms;
+
+void MultiplayerHost::try_close() {
+	// broadcasting may drop slaves, which calls us again
+	if (!running || closing)
+		return;
+
+	closing = true;
+
+	while (1) {
+		uint32_t done = UINT32_MAX;
+		bool any = false;
+
+		for (auto &x : slaves)
+			if (x.player) {
+				done = std::min(done, x.done);
+				any = true;
+			}
+
+		if (!any || done <= closed)
+			break;
+
+		close_turn();
+	}
+
+	closing = false;
+}
+
+void MultiplayerHost::close_turn() {
+	uint32_t turn = closed++;
+
+	// keep orders in the order they have been received
+	auto last = std::stable_partition(orders.begin(), orders.end(), [turn](const Order &o) { return o.turn <= turn; });
+	if (last - orders.begin() > UINT16_MAX)
+		last = orders.begin() + UINT16_MAX;
+
+	for (auto it = orders.begin(); it != last; ++it) {
+		// late orders are executed as soon as possible
+		it->turn = turn;
+		gcb->receive(*it);
+
+		Command cmd = Command::order(*it);
+		sock.broadcast(*this, cmd, false, true);
+	}
+
+	uint16_t count = (uint16_t)(last - orders.begin());
+	orders.erase(orders.begin(), last);
+
+	// nobody can have started this turn yet, so all peers dump the state after the same tick
+	if (desynced && !dumped) {
+		dumped = true;
+
+		Command dump = Command::desync(turn);
+		gcb->desync(turn);
+		sock.broadcast(*this, dump, false, true);
+	}
+
+	if (turn % ping_turns == 0) {
+		Command ping = Command::ping(now());
+		sock.broadcast(*this, ping, false, true);
+
+		unsigned rtt = 0;
+		for (auto &x : slaves)
+			if (x.player)
+				rtt = std::max(rtt, x.rtt);
+
+		delay = game::turn_delay(rtt);
+	}
+
+	Command done = Command::turn_done(turn, count, delay);
+	gcb->receive(done.data.turn_done);
+	sock.broadcast(*this, done, false, true);
 }
 
 void MultiplayerHost::incoming(pollev &ev) {
@@ -167,6 +322,9 @@ void MultiplayerHost::removepeer(sockfd fd) {
 
 	Command cmd = Command::leave(leave);
 	sock.broadcast(*this, cmd, false, true);
+
+	// do not wait for players that have left
+	try_close();
 }
 
 void MultiplayerHost::shutdown() {
@@ -204,8 +362,12 @@ bool MultiplayerHost::try_start() {
 		if (x.id == 0 && dedicated)
 			continue;
 
+		Slave &s = const_cast<Slave&>(x);
+		s.player = true;
+		s.done = game::turn_delay_initial;
+
 		// announce player to slaves
-		Command create = Command::create(const_cast<Slave&>(x).pid = pid++, x.name);
+		Command create = Command::create(s.pid = pid++, x.name);
 		gcb->new_player(create.data.create);
 		sock.broadcast(*this, create);
 
@@ -223,6 +385,10 @@ bool MultiplayerHost::try_start() {
 	gcb->change_state(newstate);
 	sock.broadcast(*this, do_start);
 
+	// nobody can have any orders for the first turns
+	running = true;
+	try_close();
+
 	return true;
 }
 
@@ -311,7 +477,10 @@ void MultiplayerClient::eventloop() {
 
 	// send desired nickname
 	Command cmd = Command::join(0, name);
-	sock.send(cmd, false);
+	{
+		std::lock_guard<std::mutex> send_lock(send_mut);
+		sock.send(cmd, false);
+	}
 
 	// main loop
 	for (activated.store(true); activated.load();) {
@@ -382,6 +551,21 @@ void MultiplayerClient::eventloop() {
 		case CmdType::gamestate:
 			gcb->change_state((game::GameState)cmd.data.gamestate);
 			break;
+		case CmdType::order:
+			gcb->receive(cmd.data.order);
+			break;
+		case CmdType::turn_done:
+			gcb->receive(cmd.data.turn_done);
+			break;
+		case CmdType::desync:
+			gcb->desync(cmd.data.desync);
+			break;
+		case CmdType::ping:
+			{
+				std::lock_guard<std::mutex> send_lock(send_mut);
+				sock.send(cmd, false);
+			}
+			break;
 		}
 	}
 
@@ -409,23 +593,59 @@ bool MultiplayerClient::chat(const std::string &str, bool send) {
 	}
 
 	Command cmd = Command::text(self, str);
+	std::lock_guard<std::mutex> send_lock(send_mut);
 	sock.send(cmd, false);
 	return true;
 }
 
 #pragma warning(pop)
 
-namespace game {
+void MultiplayerClient::send_order(const Order &o) {
+	if (!activated.load())
+		return;
+
+	Command cmd = Command::order(o);
+
+	try {
+		std::lock_guard<std::mutex> lock(send_mut);
+		sock.send(cmd, false);
+	} catch (const std::runtime_error &e) {
+		fprintf(stderr, "%s: %s\n", __func__, e.what());
+	}
+}
+
+void MultiplayerClient::end_turn(uint32_t turn) {
+	if (!activated.load())
+		return;
+
+	Command cmd = Command::turn_end(turn);
 
-Map::Map(LCG &lcg, const StartMatch &settings) : w(settings.map_w), h(settings.map_h), tiles(new uint8_t[h * w]), heights(new uint8_t[h * w]) {
-	printf("create %ux%u tiles\n", w, h);
+	try {
+		std::lock_guard<std::mutex> lock(send_mut);
+		sock.send(cmd, false);
+	} catch (const std::runtime_error &e) {
+		fprintf(stderr, "%s: %s\n", __func__, e.what());
+	}
+}
+
+void MultiplayerClient::checksum(uint32_t tick, uint64_t hash) {
+	if (!activated.load())
+		return;
+
+	Command cmd = Command::checksum(tick, hash);
 
-	for (unsigned y = 0; y < h; ++y)
-		for (unsigned x = 0; x < w; ++x)
-			tiles[y * w + x] = lcg.next() % ((unsigned)TileId::FLAT9 + 1);
+	try {
+		std::lock_guard<std::mutex> lock(send_mut);
+		sock.send(cmd, false);
+	} catch (const std::runtime_error &e) {
+		fprintf(stderr, "%s: %s\n", __func__, e.what());
+	}
+}
+
+namespace game {
 
-	// TODO support heightmaps
-	memset(heights.get(), 0, w * h);
+Map::Map(const Philox &rng, const StartMatch &settings) : w(settings.map_w), h(settings.map_h), terrain(rng, w, h, (unsigned)TileId::FLAT9 + 1), forest(w, h) {
+	fprintf(stderr, "create %ux%u tiles\n", w, h);
 }
 
 Player::Player(player_id id) : Player(id, "") {}
@@ -439,18 +659,86 @@ bool operator<(const Player &lhs, const Player &rhs) {
 
 static constexpr unsigned timer_anim_ticks = 5;
 
-Game::Game(GameMode mode, MenuLobby *lobby, Multiplayer *mp, const StartMatch &settings)
-	: mp(mp), lobby(lobby), mode(mode), state(GameState::init), lcg(LCG::ansi_c(settings.seed))
-	, settings(settings), players(), usertbl(), mut(), world(lcg, settings, mode != GameMode::multiplayer_client)
-	, ticks_per_second(50), tick_interval(1.0 / ticks_per_second), tick_timer(0), timer_anim(timer_anim_ticks) {}
+Game::Game(GameMode mode, MenuLobby *lobby, Multiplayer *mp, const StartMatch &settings, unsigned threads)
+	: mp(mp), lobby(lobby), mode(mode), state(GameState::init), rng(settings.seed)
+	, settings(settings), players(), usertbl(), mut(), world(rng, settings, mode != GameMode::multiplayer_client, threads)
+	, ticks_per_second(50), tick_interval(1.0 / ticks_per_second), tick_timer(0), timer_anim(timer_anim_ticks)
+	, turns(), orders(), sums(), dump_turn(UINT32_MAX), replay() {}
 
 Game::~Game() {
 	if (lobby)
 		menu_lobby_stop_game(lobby);
 }
 
-void Game::tick(unsigned n) {
-	for (unsigned i = 0; i < n; ++i) {
+void Game::receive(const Order &o) {
+	if (replay)
+		replay->write(Command::order(o));
+
+	turns.receive(o);
+}
+
+void Game::receive(const TurnDone &done) {
+	if (replay)
+		replay->write(Command::turn_done(done.turn, done.orders, done.delay));
+
+	turns.receive(done);
+}
+
+void Game::desync(uint32_t turn) {
+	dump_turn.store(turn);
+}
+
+bool Game::record(const char *path) {
+	try {
+		replay.reset(new ReplayWriter(path, settings));
+		printf("recording replay to %s\n", path);
+		return true;
+	} catch (const std::runtime_error &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return false;
+	}
+}
+
+bool Game::self(player_id &pid) {
+	if (!mp)
+		return false;
+
+	std::lock_guard<std::recursive_mutex> lock(mut);
+	auto search = usertbl.find(mp->self);
+
+	if (search == usertbl.end())
+		return false;
+
+	pid = search->second;
+	return true;
+}
+
+void Game::issue(Order o) {
+	if (!mp) {
+		std::lock_guard<std::recursive_mutex> lock(mut);
+		orders.emplace_back(o);
+		return;
+	}
+
+	if (!self(o.player))
+		return;
+
+	// NOTE mp may take the game lock, so we must not hold it here
+	o.turn = turns.stamp();
+	mp->send_order(o);
+}
+
+unsigned Game::tick(unsigned n, uint32_t &end) {
+	unsigned i;
+
+	for (i = 0; i < n; ++i) {
+		// wait for the server if we don't have all orders for the next turn
+		if (mp && !turns.begin(orders))
+			break;
+
+		world.apply(orders);
+		orders.clear();
+
 		if (!timer_anim) {
 			timer_anim = timer_anim_ticks;
 			world.imgtick();
@@ -458,33 +746,68 @@ void Game::tick(unsigned n) {
 			--timer_anim;
 		}
 		world.tick();
+
+		if ((mp || replay) && world.ticks() % checksum_ticks == 0) {
+			uint64_t hash = world.checksum();
+
+			if (mp)
+				sums.emplace_back(world.ticks(), hash);
+			if (replay)
+				replay->write(Command::checksum(world.ticks(), hash));
+		}
+
+		if (turns.end(end) && turns.current() - 1 == dump_turn.load())
+			dump();
 	}
+
+	return i;
 }
 
-void Game::step(unsigned ms) {
-	std::lock_guard<std::recursive_mutex> lock(mut);
+void Game::dump() {
+	char name[64];
+	snprintf(name, sizeof name, "desync_%" PRIu32 "_%u.txt", world.ticks(), mp ? (unsigned)mp->self : 0u);
 
-	if (state != GameState::running)
+	FILE *f = fopen(name, "w");
+	if (!f) {
+		perror(name);
 		return;
-
-	tick_timer += ms / 1000.0;
-	if (tick_timer >= tick_interval) {
-		tick((unsigned)(tick_timer / tick_interval));
-		tick_timer = fmod(tick_timer, tick_interval);
 	}
+
+	world.dump(f);
+	fclose(f);
+	printf("world state dumped to %s\n", name);
+}
+
+/** Maximum simulation backlog in seconds. Anything beyond is dropped to prevent a burst of ticks after a stall. */
+static constexpr double tick_backlog = 1.0;
+
+void Game::step(unsigned ms) {
+	step(ms / 1000.0);
 }
 
 void Game::step(double sec) {
-	std::lock_guard<std::recursive_mutex> lock(mut);
+	uint32_t end = 0;
+	std::vector<std::pair<uint32_t, uint64_t>> done;
 
-	if (state != GameState::running)
-		return;
+	{
+		std::lock_guard<std::recursive_mutex> lock(mut);
 
-	tick_timer += sec;
-	if (tick_timer >= tick_interval) {
-		tick((unsigned)(tick_timer / tick_interval));
-		tick_timer = fmod(tick_timer, tick_interval);
+		if (state != GameState::running)
+			return;
+
+		tick_timer = std::min(tick_timer + sec, tick_backlog);
+		if (tick_timer >= tick_interval)
+			tick_timer -= tick((unsigned)(tick_timer / tick_interval), end) * tick_interval;
+
+		done.swap(sums);
 	}
+
+	// the server may take the game lock, so we must not hold it here
+	if (end && mp)
+		mp->end_turn(end);
+
+	for (auto &s : done)
+		mp->checksum(s.first, s.second);
 }
 
 }
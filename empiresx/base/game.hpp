@@ -14,6 +14,10 @@
 
 #include "random.hpp"
 #include "world.hpp"
+#include "lockstep.hpp"
+#include "replay.hpp"
+
+#include <chrono>
 
 namespace genie {
 
@@ -58,6 +62,13 @@ public:
 	virtual void eventloop() = 0;
 
 	virtual bool chat(const std::string &str, bool send=true) = 0;
+
+	/** Hand over order to the server. */
+	virtual void send_order(const Order &o) = 0;
+	/** Notify the server that all orders for turns before \a turn have been sent. */
+	virtual void end_turn(uint32_t turn) = 0;
+	/** Hand over world checksum after \a tick ticks, so the server can verify that all peers are in sync. */
+	virtual void checksum(uint32_t tick, uint64_t hash) = 0;
 };
 
 class MultiplayerHost;
@@ -68,6 +79,9 @@ public:
 	user_id id; /**< unique identifier (is equal to server's modification counter at creation) */
 	player_id pid; /**< virtual player unique identifier (also used to detect modification changes) */
 	std::string name;
+	bool player; /**< whether the slave controls a player and has to take part in the lockstep */
+	uint32_t done; /**< the slave has sent all orders for any turn before this one */
+	unsigned rtt; /**< smoothed round trip time in milliseconds */
 
 	Slave(sockfd fd);
 	Slave(sockfd fd, user_id id);
@@ -84,6 +98,16 @@ class MultiplayerHost final : public Multiplayer, protected ServerCallback {
 	Ready expected_settings; /**< data that each client has to send that must match */
 	unsigned ready_confirms; /**< pending ready messages from slaves */
 	bool dedicated; /**< whether the server is running headless (i.e. without a GUI) */
+	bool running; /**< whether the match has started */
+	bool closing; /**< whether we are broadcasting turns */
+	std::vector<Order> orders; /**< orders that have not been sent to the slaves yet */
+	uint32_t closed; /**< all orders for turns before this one have been broadcasted */
+	uint16_t delay; /**< current input delay in turns */
+	std::chrono::steady_clock::time_point epoch; /**< reference point for measuring round trip times */
+	std::map<uint32_t, uint64_t> sums; /**< our own world checksums per tick */
+	std::map<uint32_t, std::vector<std::pair<user_id, uint64_t>>> reports; /**< checksums of slaves that are ahead of us */
+	bool desynced; /**< whether any checksum did not match */
+	bool dumped; /**< whether all peers have been told to dump their state */
 public:
 	MultiplayerHost(MultiplayerCallback &cb, const std::string &name, uint16_t port, bool dedicated=false);
 	~MultiplayerHost() override;
@@ -105,6 +129,17 @@ public:
 	bool chat(const std::string &str, bool send=true) override;
 	// TODO enable user to customize map settings
 	void prepare_match();
+
+	void send_order(const Order &o) override;
+	void end_turn(uint32_t turn) override;
+	void checksum(uint32_t tick, uint64_t hash) override;
+private:
+	/** Compare checksum \a hash of slave \a id with our own checksum \a expected after \a tick ticks. */
+	void verify(user_id id, uint32_t tick, uint64_t hash, uint64_t expected);
+	/** Broadcast all turns that every player has finished. */
+	void try_close();
+	void close_turn();
+	uint32_t now() const;
 };
 
 class Peer final {
@@ -123,6 +158,7 @@ class MultiplayerClient final : public Multiplayer {
 	uint32_t addr;
 	std::atomic<bool> activated;
 	std::map<user_id, Peer> peers;
+	std::mutex send_mut; /**< allows the simulation to send without taking mut */
 public:
 	MultiplayerClient(MultiplayerCallback &cb, const std::string &name, uint32_t addr, uint16_t port);
 	~MultiplayerClient() override;
@@ -130,6 +166,10 @@ public:
 	void eventloop() override;
 	void set_gcb(game::GameCallback *gcb, uint16_t slave_count, uint16_t prng_next);
 	bool chat(const std::string &str, bool send=true) override;
+
+	void send_order(const Order &o) override;
+	void end_turn(uint32_t turn) override;
+	void checksum(uint32_t tick, uint64_t hash) override;
 };
 
 namespace game {
@@ -224,6 +264,11 @@ public:
 	virtual void new_player(const CreatePlayer&) = 0;
 	virtual void assign_player(const AssignSlave&) = 0;
 	virtual void change_state(const game::GameState&) = 0;
+	/** Orders and turns are received on the network thread. Implementations must not take the game lock. */
+	virtual void receive(const Order&) = 0;
+	virtual void receive(const TurnDone&) = 0;
+	/** Dump the world state at the end of \a turn, because some peer has run out of sync. */
+	virtual void desync(uint32_t turn) = 0;
 };
 
 class Game : public GameCallback {
@@ -232,7 +277,7 @@ protected:
 	MenuLobby *lobby;
 	GameMode mode;
 	GameState state;
-	LCG lcg;
+	Philox rng;
 	StartMatch settings;
 	std::set<Player> players;
 	std::map<user_id, player_id> usertbl; /**< Lookuptable for user id using slave player id */
@@ -241,14 +286,37 @@ protected:
 	double tick_interval;
 	double tick_timer;
 	unsigned timer_anim;
+	TurnScheduler turns;
+	std::vector<Order> orders; /**< orders for the current tick */
+	std::vector<std::pair<uint32_t, uint64_t>> sums; /**< world checksums that have not been sent yet */
+	std::atomic<uint32_t> dump_turn; /**< set by the network thread */
+	std::unique_ptr<ReplayWriter> replay;
 public:
 	World world;
 
-	Game(GameMode mode, MenuLobby *lobby, Multiplayer *mp, const StartMatch &settings);
+	Game(GameMode mode, MenuLobby *lobby, Multiplayer *mp, const StartMatch &settings, unsigned threads=0);
 	virtual ~Game();
 
+	void receive(const Order &o) override;
+	void receive(const TurnDone &done) override;
+	void desync(uint32_t turn) override;
+
+	/** Stamp order \a o and hand it over to the server. Without server, it is executed at the next tick. */
+	void issue(Order o);
+	/**
+	 * Record everything that is needed to replay this match to \a path. Orders are recorded as they are
+	 * received from the server, so this is for multiplayer games only. Must be called before the game is
+	 * handed to the network. Returns false if the replay cannot be created.
+	 */
+	bool record(const char *path);
+	/** Find player that is controlled by this client. Returns false if we don't control any player. */
+	bool self(player_id &pid);
+
 private:
-	void tick(unsigned n=1);
+	/** Run at most \a n ticks and return how many ran. Any turn markers are stored in \a end. */
+	unsigned tick(unsigned n, uint32_t &end);
+	/** Write world state to a file named after the tick and our user id. */
+	void dump();
 public:
 	void step(unsigned ms);
 	void step(double sec);
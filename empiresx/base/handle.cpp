@@ -0,0 +1,84 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "handle.hpp"
+
+#include <cassert>
+
+#include <stdexcept>
+
+namespace genie {
+
+namespace game {
+
+Handle SlotMap::add(uint32_t i) {
+	uint32_t slot;
+
+	// let freed slots rest for a while, so their generations wrap around as late as possible
+	if (freelist.size() <= handle_min_free && slots.size() < handle_slots) {
+		slot = (uint32_t)slots.size();
+		slots.emplace_back(Slot{no_index, 0});
+	} else if (!freelist.empty()) {
+		slot = freelist.front();
+		freelist.pop_front();
+	} else {
+		throw std::runtime_error("out of entity slots");
+	}
+
+	slots[slot].index = i;
+	return handle(slot);
+}
+
+void SlotMap::erase(Handle h) noexcept {
+	assert(valid(h));
+	Slot &s = slots[slot_of(h)];
+
+	// old handles wrap around after handle_gens reuses of the same slot, see handle_min_free
+	s.index = no_index;
+	s.gen = (s.gen + 1) & (handle_gens - 1);
+	freelist.emplace_back(slot_of(h));
+}
+
+void SlotMap::clear() noexcept {
+	slots.clear();
+	freelist.clear();
+}
+
+bool SlotMap::restore(const Slot *s, size_t slot_count, const uint32_t *f, size_t free_count, size_t n) {
+	if (slot_count > handle_slots || free_count > slot_count)
+		return false;
+
+	std::vector<uint8_t> seen(n), listed(slot_count);
+	size_t used = 0;
+
+	for (size_t k = 0; k < slot_count; ++k) {
+		if (s[k].gen >= handle_gens)
+			return false;
+
+		if (s[k].index == no_index)
+			continue;
+
+		if (s[k].index >= n || seen[s[k].index])
+			return false;
+
+		seen[s[k].index] = 1;
+		++used;
+	}
+
+	for (size_t k = 0; k < free_count; ++k) {
+		if (f[k] >= slot_count || s[f[k]].index != no_index || listed[f[k]])
+			return false;
+
+		listed[f[k]] = 1;
+	}
+
+	if (used != n || used + free_count != slot_count)
+		return false;
+
+	slots.assign(s, s + slot_count);
+	freelist.assign(f, f + free_count);
+	return true;
+}
+
+}
+
+}
@@ -0,0 +1,118 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Stable references to entities. A handle packs the kind of entity, a slot and the generation
+ * of that slot into 32 bits. The slot maps to the dense index at which the entity is stored
+ * and the generation is bumped whenever the slot is freed, so a handle of a removed entity
+ * never refers to whatever takes its place. Checking a handle takes a single lookup and
+ * handles are plain numbers, so selections and network orders can hold on to them safely.
+ *
+ * Generations wrap around, so freed slots are reused first in, first out and only once more
+ * than handle_min_free of them are waiting. A slot is thus reused at most once every
+ * handle_min_free frees and a stale handle can only match again after about a million of them.
+ */
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <deque>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+enum class EntityKind : uint32_t {
+	unit,
+	building,
+	resource,
+	none, /**< no_handle and anything that is not part of the simulation, e.g. effects */
+};
+
+typedef uint32_t Handle;
+
+static constexpr unsigned handle_slot_bits = 20, handle_gen_bits = 10;
+static constexpr uint32_t handle_slots = 1u << handle_slot_bits, handle_gens = 1u << handle_gen_bits;
+
+static constexpr Handle no_handle = UINT32_MAX;
+/** Number of free slots that are kept before any of them is reused. */
+static constexpr size_t handle_min_free = 1024;
+
+constexpr Handle make_handle(EntityKind kind, uint32_t gen, uint32_t slot) noexcept {
+	return (uint32_t)kind << (handle_slot_bits + handle_gen_bits) | gen << handle_slot_bits | slot;
+}
+
+constexpr EntityKind kind_of(Handle h) noexcept {
+	return (EntityKind)(h >> (handle_slot_bits + handle_gen_bits));
+}
+
+constexpr uint32_t slot_of(Handle h) noexcept {
+	return h & (handle_slots - 1);
+}
+
+constexpr uint32_t gen_of(Handle h) noexcept {
+	return h >> handle_slot_bits & (handle_gens - 1);
+}
+
+/** Also used as snapshot record. */
+struct Slot final {
+	uint32_t index; /**< dense index of the entity or no_index if the slot is free */
+	uint32_t gen; /**< generation of the current or next entity in this slot */
+};
+
+/** Maps handles of one kind of entity to dense indices. Freed slots are reused first in, first out. */
+class SlotMap final {
+	EntityKind kind;
+	std::vector<Slot> slots;
+	std::deque<uint32_t> freelist; /**< oldest first */
+public:
+	static constexpr uint32_t no_index = UINT32_MAX;
+
+	explicit SlotMap(EntityKind kind) : kind(kind), slots(), freelist() {}
+
+	bool valid(Handle h) const noexcept {
+		if (kind_of(h) != kind || slot_of(h) >= slots.size())
+			return false;
+
+		const Slot &s = slots[slot_of(h)];
+		return s.index != no_index && s.gen == gen_of(h);
+	}
+
+	/** Dense index of the entity of \a h, which must be valid. */
+	size_t index(Handle h) const noexcept {
+		assert(valid(h));
+		return slots[slot_of(h)].index;
+	}
+
+	/** Hand out a handle for the entity at dense index \a i. Throws if all slots are taken. */
+	Handle add(uint32_t i);
+	/** Free the slot of \a h, which must be valid. Handles to it become invalid. */
+	void erase(Handle h) noexcept;
+	/** The entity of \a h has moved to dense index \a i. */
+	void move(Handle h, uint32_t i) noexcept {
+		slots[slot_of(h)].index = i;
+	}
+
+	void clear() noexcept;
+
+	/** All slots and free slots, for snapshots. */
+	const std::vector<Slot> &all() const noexcept { return slots; }
+	const std::deque<uint32_t> &free() const noexcept { return freelist; }
+	/**
+	 * Restore slots and free slots as saved in a snapshot that has \a n entities. Returns false
+	 * if they do not map exactly one slot to each of the \a n dense indices.
+	 */
+	bool restore(const Slot *s, size_t slot_count, const uint32_t *f, size_t free_count, size_t n);
+
+	/** Handle of \a slot, which must be in use. */
+	Handle handle(uint32_t slot) const noexcept {
+		return make_handle(kind, slots[slot].gen, slot);
+	}
+};
+
+}
+
+}
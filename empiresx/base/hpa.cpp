@@ -0,0 +1,486 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "hpa.hpp"
+
+#include <cassert>
+#include <cstdlib>
+
+#include <algorithm>
+#include <functional>
+#include <set>
+
+namespace genie {
+
+namespace game {
+
+/** Same step costs as the flow fields. */
+static constexpr uint32_t step_cost[2] = {2, 3};
+static constexpr uint32_t no_tile = UINT32_MAX;
+
+/** Octile distance, which never overestimates the cost with the step costs above. */
+static uint32_t octile(uint32_t a, uint32_t b, unsigned w) {
+	unsigned dx = (unsigned)std::abs((int)(a % w) - (int)(b % w)), dy = (unsigned)std::abs((int)(a / w) - (int)(b / w));
+	unsigned lo = std::min(dx, dy), hi = std::max(dx, dy);
+	return step_cost[1] * lo + step_cost[0] * (hi - lo);
+}
+
+static bool can_step(const Occupancy &occ, int x, int y, unsigned d) {
+	if (!occ.passable(x + flow_dx[d], y + flow_dy[d]))
+		return false;
+
+	return !(d & 1) || (occ.passable(x + flow_dx[d], y) && occ.passable(x, y + flow_dy[d]));
+}
+
+void GridSearch::reset(size_t n) {
+	if (g.size() != n) {
+		g.assign(n, 0);
+		parent.assign(n, no_tile);
+		seen.assign(n, 0);
+		stamp = 0;
+	}
+
+	if (!++stamp) {
+		std::fill(seen.begin(), seen.end(), 0);
+		stamp = 1;
+	}
+
+	open.clear();
+}
+
+bool GridSearch::run(const Occupancy &occ, uint32_t start, uint32_t goal, const TileRect &area, PathStats *stats) {
+	unsigned w = occ.width();
+	reset((size_t)w * occ.height());
+
+	g[start] = 0;
+	parent[start] = no_tile;
+	seen[start] = stamp;
+	open.emplace_back((uint64_t)(goal == no_tile ? 0 : octile(start, goal, w)) << 32 | start);
+
+	while (!open.empty()) {
+		std::pop_heap(open.begin(), open.end(), std::greater<uint64_t>());
+		uint32_t i = (uint32_t)open.back(), f = (uint32_t)(open.back() >> 32);
+		open.pop_back();
+
+		uint32_t hi = goal == no_tile ? 0 : octile(i, goal, w);
+		if (f != g[i] + hi)
+			continue; // stale entry
+
+		if (stats)
+			++stats->expanded;
+
+		if (i == goal)
+			return true;
+
+		int x = i % w, y = i / w;
+
+		for (unsigned d = 0; d < 8; ++d) {
+			int nx = x + flow_dx[d], ny = y + flow_dy[d];
+
+			if (!area.contains(nx, ny) || !can_step(occ, x, y, d))
+				continue;
+
+			uint32_t j = (uint32_t)ny * w + nx, gj = g[i] + step_cost[d & 1];
+
+			if (gj < cost(j)) {
+				g[j] = gj;
+				parent[j] = i;
+				seen[j] = stamp;
+				open.emplace_back((uint64_t)(gj + (goal == no_tile ? 0 : octile(j, goal, w))) << 32 | j);
+				std::push_heap(open.begin(), open.end(), std::greater<uint64_t>());
+			}
+		}
+	}
+
+	return false;
+}
+
+bool GridSearch::find(const Occupancy &occ, uint32_t start, uint32_t goal, const TileRect &area, std::vector<uint32_t> &path, PathStats *stats) {
+	if (start == goal)
+		return true;
+
+	if (!run(occ, start, goal, area, stats))
+		return false;
+
+	size_t first = path.size();
+
+	for (uint32_t i = goal; i != start; i = parent[i])
+		path.emplace_back(i);
+
+	std::reverse(path.begin() + first, path.end());
+	return true;
+}
+
+void GridSearch::costs(const Occupancy &occ, uint32_t start, const TileRect &area, const std::vector<uint32_t> &targets, std::vector<uint32_t> &out, PathStats *stats) {
+	run(occ, start, no_tile, area, stats);
+
+	out.clear();
+	for (uint32_t t : targets)
+		out.emplace_back(cost(t));
+}
+
+void GridSearch::table(const Occupancy &occ, const TileRect &area, const std::vector<uint32_t> &targets, std::vector<uint32_t> &out, PathStats *stats) {
+	unsigned w = occ.width(), aw = area.right - area.left, ah = area.bottom - area.top;
+	size_t n = targets.size();
+	int stride[8];
+
+	out.assign(n * n, UINT32_MAX);
+
+	// work in area coordinates and find out once which steps are possible from each tile
+	steps.assign((size_t)aw * ah, 0);
+	slot.assign((size_t)aw * ah, UINT32_MAX);
+	local.resize((size_t)aw * ah);
+
+	for (unsigned d = 0; d < 8; ++d)
+		stride[d] = flow_dy[d] * (int)aw + flow_dx[d];
+
+	for (int y = area.top; y < area.bottom; ++y)
+		for (int x = area.left; x < area.right; ++x)
+			for (unsigned d = 0; d < 8; ++d)
+				if (area.contains(x + flow_dx[d], y + flow_dy[d]) && can_step(occ, x, y, d))
+					steps[(size_t)(y - area.top) * aw + (x - area.left)] |= 1 << d;
+
+	for (size_t k = 0; k < n; ++k)
+		slot[(targets[k] / w - area.top) * aw + (targets[k] % w - area.left)] = (uint32_t)k;
+
+	// costs are symmetric, so each search only has to find the targets after its start
+	for (size_t k = 0; k + 1 < n; ++k) {
+		uint32_t start = (targets[k] / w - area.top) * aw + (targets[k] % w - area.left);
+		size_t need = n - k - 1;
+
+		std::fill(local.begin(), local.end(), UINT32_MAX);
+		for (auto &b : buckets)
+			b.clear();
+
+		local[start] = 0;
+		buckets[0].emplace_back(start);
+
+		for (uint32_t c = 0, pending = 1; pending && need; ++c) {
+			auto &bucket = buckets[c % flow_buckets];
+
+			for (size_t q = 0; q < bucket.size() && need; ++q) {
+				uint32_t i = bucket[q];
+				--pending;
+
+				if (local[i] != c)
+					continue;
+
+				if (stats)
+					++stats->expanded;
+
+				if (slot[i] != UINT32_MAX && slot[i] > k) {
+					out[k * n + slot[i]] = out[slot[i] * n + k] = c;
+					--need;
+				}
+
+				for (unsigned d = 0, m = steps[i]; m; ++d, m >>= 1) {
+					if (!(m & 1))
+						continue;
+
+					uint32_t j = i + stride[d], cj = c + step_cost[d & 1];
+
+					if (cj < local[j]) {
+						local[j] = cj;
+						buckets[cj % flow_buckets].emplace_back(j);
+						++pending;
+					}
+				}
+			}
+
+			bucket.clear();
+		}
+	}
+
+	for (size_t k = 0; k < n; ++k)
+		out[k * n + k] = 0;
+}
+
+HpaGraph::HpaGraph(unsigned w, unsigned h)
+	: w(w), h(h), cols((w + hpa_cluster - 1) / hpa_cluster), rows((h + hpa_cluster - 1) / hpa_cluster)
+	, border_h((size_t)cols * rows), border_v((size_t)cols * rows), nodes((size_t)cols * rows), edges()
+	, search(), scratch(), built(false) {}
+
+TileRect HpaGraph::area(unsigned c) const noexcept {
+	int x = (c % cols) * hpa_cluster, y = (c / cols) * hpa_cluster;
+	return TileRect{x, y, std::min<int>(x + hpa_cluster, w), std::min<int>(y + hpa_cluster, h)};
+}
+
+/**
+ * Scan \a len tiles from (\a x, \a y) along the border in direction (\a dx, \a dy). The
+ * tiles on the other side are found by swapping the direction.
+ */
+void HpaGraph::link(const Occupancy &occ, std::vector<std::pair<uint32_t, uint32_t>> &border, int x, int y, int dx, int dy, unsigned len) {
+	border.clear();
+
+	for (unsigned i = 0; i < len;) {
+		// find next run of tiles that are free on both sides
+		unsigned first = i;
+		while (first < len && !(occ.passable(x + first * dx, y + first * dy) && occ.passable(x + first * dx + dy, y + first * dy + dx)))
+			++first;
+
+		unsigned last = first;
+		while (last < len && occ.passable(x + last * dx, y + last * dy) && occ.passable(x + last * dx + dy, y + last * dy + dx))
+			++last;
+
+		if (first == last)
+			break;
+
+		auto add = [&](unsigned k) {
+			int ax = x + k * dx, ay = y + k * dy;
+			border.emplace_back((uint32_t)ay * w + ax, (uint32_t)(ay + dx) * w + (ax + dy));
+		};
+
+		if (last - first >= hpa_wide) {
+			add(first);
+			add(last - 1);
+		} else {
+			add((first + last - 1) / 2);
+		}
+
+		i = last;
+	}
+}
+
+void HpaGraph::borders(const Occupancy &occ, unsigned c) {
+	TileRect r(area(c));
+	unsigned cx = c % cols, cy = c / cols;
+
+	if (cy + 1 < rows)
+		link(occ, border_h[c], r.left, r.bottom - 1, 1, 0, r.right - r.left);
+	if (cx + 1 < cols)
+		link(occ, border_v[c], r.right - 1, r.top, 0, 1, r.bottom - r.top);
+}
+
+void HpaGraph::transitions(unsigned c) {
+	unsigned cx = c % cols, cy = c / cols;
+	std::vector<uint32_t> &list = nodes[c];
+	list.clear();
+
+	// collect transitions on all four borders
+	for (auto &p : border_h[c])
+		list.emplace_back(p.first);
+	for (auto &p : border_v[c])
+		list.emplace_back(p.first);
+	if (cy)
+		for (auto &p : border_h[c - cols])
+			list.emplace_back(p.second);
+	if (cx)
+		for (auto &p : border_v[c - 1])
+			list.emplace_back(p.second);
+
+	std::sort(list.begin(), list.end());
+	list.erase(std::unique(list.begin(), list.end()), list.end());
+}
+
+void HpaGraph::connect(const Occupancy &occ, unsigned c, GridSearch &s, std::vector<uint32_t> &cost, Links &out) const {
+	unsigned cx = c % cols, cy = c / cols;
+	const std::vector<uint32_t> &list = nodes[c];
+	TileRect r(area(c));
+
+	out.clear();
+
+	s.table(occ, r, list, cost);
+
+	for (size_t k = 0, n = list.size(); k < n; ++k) {
+		out.emplace_back(list[k], std::vector<Edge>());
+		std::vector<Edge> &e = out.back().second;
+
+		for (size_t i = 0; i < n; ++i)
+			if (i != k && cost[k * n + i] != UINT32_MAX)
+				e.emplace_back(Edge{list[i], cost[k * n + i]});
+	}
+
+	// connect to the other side
+	auto at = [&](uint32_t t) -> std::vector<Edge>& {
+		return out[std::lower_bound(list.begin(), list.end(), t) - list.begin()].second;
+	};
+
+	for (auto &p : border_h[c])
+		at(p.first).emplace_back(Edge{p.second, step_cost[0]});
+	for (auto &p : border_v[c])
+		at(p.first).emplace_back(Edge{p.second, step_cost[0]});
+	if (cy)
+		for (auto &p : border_h[c - cols])
+			at(p.second).emplace_back(Edge{p.first, step_cost[0]});
+	if (cx)
+		for (auto &p : border_v[c - 1])
+			at(p.second).emplace_back(Edge{p.first, step_cost[0]});
+}
+
+void HpaGraph::rebuild(const Occupancy &occ, unsigned c) {
+	for (uint32_t t : nodes[c])
+		edges.erase(t);
+
+	transitions(c);
+
+	Links links;
+	connect(occ, c, search, scratch, links);
+
+	for (auto &l : links)
+		edges.emplace(l.first, std::move(l.second));
+}
+
+void HpaGraph::build(const Occupancy &occ, JobPool &jobs) {
+	assert(occ.width() == w && occ.height() == h);
+	size_t n = (size_t)cols * rows, chunk = std::max<size_t>(1, n / (4 * (jobs.size() + 1)));
+	std::vector<Links> links(n);
+
+	edges.clear();
+
+	jobs.run(n, chunk, [&](size_t begin, size_t end) {
+		for (size_t c = begin; c < end; ++c)
+			borders(occ, (unsigned)c);
+	});
+
+	// every chunk needs its own scratch space
+	jobs.run(n, chunk, [&](size_t begin, size_t end) {
+		GridSearch s;
+		std::vector<uint32_t> cost;
+
+		for (size_t c = begin; c < end; ++c) {
+			transitions((unsigned)c);
+			connect(occ, (unsigned)c, s, cost, links[c]);
+		}
+	});
+
+	for (auto &list : links)
+		for (auto &l : list)
+			edges.emplace(l.first, std::move(l.second));
+
+	built = true;
+}
+
+void HpaGraph::repair(const Occupancy &occ, const std::vector<uint32_t> &tiles) {
+	if (!built)
+		return;
+
+	std::set<unsigned> dirty, affected;
+
+	for (uint32_t t : tiles)
+		dirty.emplace(cluster(t));
+
+	// transitions of a cluster also live in its upper and left neighbour
+	for (unsigned c : dirty) {
+		unsigned cx = c % cols, cy = c / cols;
+
+		borders(occ, c);
+		affected.emplace(c);
+
+		if (cx) {
+			borders(occ, c - 1);
+			affected.emplace(c - 1);
+		}
+		if (cy) {
+			borders(occ, c - cols);
+			affected.emplace(c - cols);
+		}
+		if (cx + 1 < cols)
+			affected.emplace(c + 1);
+		if (cy + 1 < rows)
+			affected.emplace(c + cols);
+	}
+
+	for (unsigned c : affected)
+		rebuild(occ, c);
+}
+
+bool HpaGraph::find(const Occupancy &occ, uint32_t start, uint32_t goal, Route &route, GridSearch &search, PathStats *stats) const {
+	route.abstract.clear();
+	route.tiles.clear();
+	route.next = route.step = 0;
+
+	if (!occ.passable(goal % w, goal / w))
+		return false;
+
+	unsigned cs = cluster(start), cg = cluster(goal);
+
+	// nearby goals do not need the abstract graph
+	if (cs == cg && search.find(occ, start, goal, area(cs), route.tiles, stats)) {
+		route.abstract.emplace_back(goal);
+		route.next = 1;
+		return true;
+	}
+
+	// temporarily connect start and goal to the transitions of their clusters
+	std::vector<uint32_t> from_start, to_goal;
+	search.costs(occ, start, area(cs), nodes[cs], from_start, stats);
+	search.costs(occ, goal, area(cg), nodes[cg], to_goal, stats);
+
+	std::unordered_map<uint32_t, uint32_t> g, parent;
+	std::vector<uint64_t> open;
+
+	auto push = [&](uint32_t t, uint32_t cost, uint32_t from) {
+		auto it = g.find(t);
+		if (it != g.end() && it->second <= cost)
+			return;
+
+		g[t] = cost;
+		parent[t] = from;
+		open.emplace_back((uint64_t)(cost + octile(t, goal, w)) << 32 | t);
+		std::push_heap(open.begin(), open.end(), std::greater<uint64_t>());
+	};
+
+	push(start, 0, start);
+
+	bool found = false;
+
+	while (!open.empty()) {
+		std::pop_heap(open.begin(), open.end(), std::greater<uint64_t>());
+		uint32_t t = (uint32_t)open.back(), f = (uint32_t)(open.back() >> 32);
+		open.pop_back();
+
+		uint32_t gt = g[t];
+		if (f != gt + octile(t, goal, w))
+			continue;
+
+		if (stats)
+			++stats->expanded;
+
+		if (t == goal) {
+			found = true;
+			break;
+		}
+
+		if (t == start)
+			for (size_t i = 0; i < nodes[cs].size(); ++i)
+				if (from_start[i] != UINT32_MAX)
+					push(nodes[cs][i], from_start[i], start);
+
+		auto adj = edges.find(t);
+		if (adj != edges.end())
+			for (const Edge &e : adj->second)
+				push(e.to, gt + e.cost, t);
+
+		if (cluster(t) == cg) {
+			auto it = std::lower_bound(nodes[cg].begin(), nodes[cg].end(), t);
+			if (it != nodes[cg].end() && *it == t && to_goal[it - nodes[cg].begin()] != UINT32_MAX)
+				push(goal, gt + to_goal[it - nodes[cg].begin()], t);
+		}
+	}
+
+	if (!found)
+		return false;
+
+	for (uint32_t t = goal; t != start; t = parent[t])
+		route.abstract.emplace_back(t);
+
+	std::reverse(route.abstract.begin(), route.abstract.end());
+	return true;
+}
+
+bool HpaGraph::refine(const Occupancy &occ, uint32_t from, Route &r, PathStats *stats) {
+	assert(r.next < r.abstract.size());
+	uint32_t to = r.abstract[r.next++];
+
+	r.tiles.clear();
+	r.step = 0;
+
+	// consecutive waypoints are in the same or in neighbouring clusters
+	TileRect a(area(cluster(from))), b(area(cluster(to)));
+	TileRect both{std::min(a.left, b.left), std::min(a.top, b.top), std::max(a.right, b.right), std::max(a.bottom, b.bottom)};
+
+	return search.find(occ, from, to, both, r.tiles, stats);
+}
+
+}
+
+}
@@ -0,0 +1,149 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Hierarchical pathfinding (HPA*). The map is divided in square clusters. Wherever two
+ * neighbouring clusters share free tiles along their border, transition tiles are placed
+ * on both sides. All transitions within a cluster are connected by the cost of the shortest
+ * path between them that stays inside the cluster. Long paths are planned on this much
+ * smaller graph first, and only refined to tiles one abstract step at a time as the unit
+ * advances.
+ */
+
+#include "path.hpp"
+#include "jobs.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+static constexpr unsigned hpa_cluster = 16;
+/** Entrances that are at least this wide get a transition at either end instead of one in the middle. */
+static constexpr unsigned hpa_wide = 6;
+
+/** Half open tile area [left, right) x [top, bottom) */
+struct TileRect final {
+	int left, top, right, bottom;
+
+	bool contains(int x, int y) const noexcept {
+		return x >= left && x < right && y >= top && y < bottom;
+	}
+};
+
+struct PathStats final {
+	size_t expanded; /**< number of nodes taken from the open list */
+
+	PathStats() : expanded(0) {}
+};
+
+/** Grid search with reusable scratch space. */
+class GridSearch final {
+	std::vector<uint32_t> g, parent, seen;
+	uint32_t stamp;
+	std::vector<uint64_t> open;
+	// scratch space for table
+	std::vector<uint8_t> steps;
+	std::vector<uint32_t> local, slot, buckets[flow_buckets];
+public:
+	GridSearch() : g(), parent(), seen(), stamp(0), open(), steps(), local(), slot(), buckets() {}
+
+	/**
+	 * Find shortest path from \a start to \a goal that stays within \a area. The tiles after
+	 * \a start up to and including \a goal are appended to \a path. Returns false if there is
+	 * no such path.
+	 */
+	bool find(const Occupancy &occ, uint32_t start, uint32_t goal, const TileRect &area, std::vector<uint32_t> &path, PathStats *stats=nullptr);
+
+	/** Compute cost from \a start to all \a targets within \a area. Unreachable targets get UINT32_MAX. */
+	void costs(const Occupancy &occ, uint32_t start, const TileRect &area, const std::vector<uint32_t> &targets, std::vector<uint32_t> &out, PathStats *stats=nullptr);
+	/**
+	 * Compute cost between all pairs of \a targets within \a area, which are all inside the area. The cost from
+	 * targets[i] to targets[j] is stored at out[i * targets.size() + j].
+	 */
+	void table(const Occupancy &occ, const TileRect &area, const std::vector<uint32_t> &targets, std::vector<uint32_t> &out, PathStats *stats=nullptr);
+private:
+	void reset(size_t n);
+	uint32_t cost(uint32_t i) const noexcept { return seen[i] == stamp ? g[i] : UINT32_MAX; }
+	/** Run search from \a start. Stops at \a goal unless it is UINT32_MAX. */
+	bool run(const Occupancy &occ, uint32_t start, uint32_t goal, const TileRect &area, PathStats *stats);
+};
+
+/** Path of a single unit. Only the part up to the next abstract waypoint has been refined to tiles. */
+struct Route final {
+	std::vector<uint32_t> abstract; /**< abstract waypoints, the last one is the destination */
+	std::vector<uint32_t> tiles; /**< tiles towards abstract[next - 1] */
+	size_t next, step;
+
+	Route() : abstract(), tiles(), next(0), step(0) {}
+
+	/** Whether the current refined part has been walked completely. */
+	bool walked() const noexcept { return step >= tiles.size(); }
+	bool done() const noexcept { return walked() && next >= abstract.size(); }
+};
+
+class HpaGraph final {
+	struct Edge final {
+		uint32_t to, cost;
+	};
+
+	/** Outgoing edges of all transitions in one cluster. */
+	typedef std::vector<std::pair<uint32_t, std::vector<Edge>>> Links;
+
+	unsigned w, h, cols, rows;
+	/** Transitions as (tile in upper or left cluster, tile in lower or right cluster) */
+	std::vector<std::vector<std::pair<uint32_t, uint32_t>>> border_h, border_v;
+	std::vector<std::vector<uint32_t>> nodes; /**< transition tiles per cluster */
+	std::unordered_map<uint32_t, std::vector<Edge>> edges;
+
+	GridSearch search;
+	std::vector<uint32_t> scratch;
+	bool built;
+public:
+	HpaGraph(unsigned w, unsigned h);
+
+	void build(const Occupancy &occ) {
+		JobPool caller(0);
+		build(occ, caller);
+	}
+	/** Build graph on \a jobs. All clusters are independent, so the outcome does not depend on the number of threads. */
+	void build(const Occupancy &occ, JobPool &jobs);
+	/** Fix graph after the passability of \a tiles has changed. This does nothing until the graph has been built. */
+	void repair(const Occupancy &occ, const std::vector<uint32_t> &tiles);
+
+	/** Plan abstract path from \a start to \a goal. Returns false if \a goal cannot be reached. */
+	bool find(const Occupancy &occ, uint32_t start, uint32_t goal, Route &r, PathStats *stats=nullptr) {
+		return find(occ, start, goal, r, search, stats);
+	}
+	/** Same as above, but safe to call from multiple threads at once if each one brings its own \a search. */
+	bool find(const Occupancy &occ, uint32_t start, uint32_t goal, Route &r, GridSearch &search, PathStats *stats=nullptr) const;
+	/** Refine path from \a from to the next abstract waypoint of \a r. Returns false if it has become unreachable. */
+	bool refine(const Occupancy &occ, uint32_t from, Route &r, PathStats *stats=nullptr);
+
+	size_t size() const noexcept { return edges.size(); }
+private:
+	unsigned cluster(uint32_t tile) const noexcept {
+		return (tile / w / hpa_cluster) * cols + (tile % w / hpa_cluster);
+	}
+
+	TileRect area(unsigned c) const noexcept;
+	void link(const Occupancy &occ, std::vector<std::pair<uint32_t, uint32_t>> &border, int x, int y, int dx, int dy, unsigned len);
+	/** Recompute transitions on the bottom and right border of cluster \a c. */
+	void borders(const Occupancy &occ, unsigned c);
+	/** Collect all transitions of cluster \a c. */
+	void transitions(unsigned c);
+	/** Compute edges of all transitions of cluster \a c. */
+	void connect(const Occupancy &occ, unsigned c, GridSearch &s, std::vector<uint32_t> &cost, Links &out) const;
+	void rebuild(const Occupancy &occ, unsigned c);
+};
+
+}
+
+}
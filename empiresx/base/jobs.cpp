@@ -0,0 +1,113 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "jobs.hpp"
+
+#include <cassert>
+
+#include <algorithm>
+
+namespace genie {
+
+JobPool::JobPool(unsigned threads)
+	: workers(), queues(new Queue[threads + 1]), mut(), cv_work(), cv_done()
+	, generation(0), stop(false), pending(0)
+{
+	for (unsigned i = 0; i < threads; ++i)
+		workers.emplace_back(&JobPool::work, this, i);
+}
+
+JobPool::~JobPool() {
+	{
+		std::lock_guard<std::mutex> lock(mut);
+		stop = true;
+	}
+	cv_work.notify_all();
+
+	for (auto &t : workers)
+		t.join();
+}
+
+bool JobPool::pop(unsigned self, Chunk &c) {
+	unsigned count = size() + 1;
+
+	// take the most recent chunk from our own queue first, then steal the oldest from the others
+	for (unsigned i = 0; i < count; ++i) {
+		Queue &q = queues[(self + i) % count];
+		std::lock_guard<std::mutex> lock(q.mut);
+
+		if (q.chunks.empty())
+			continue;
+
+		if (i == 0) {
+			c = q.chunks.back();
+			q.chunks.pop_back();
+		} else {
+			c = q.chunks.front();
+			q.chunks.pop_front();
+		}
+		return true;
+	}
+
+	return false;
+}
+
+void JobPool::finish() {
+	if (pending.fetch_sub(1) == 1) {
+		std::lock_guard<std::mutex> lock(mut);
+		cv_done.notify_all();
+	}
+}
+
+void JobPool::work(unsigned self) {
+	uint64_t seen = 0;
+
+	while (1) {
+		{
+			std::unique_lock<std::mutex> lock(mut);
+			cv_work.wait(lock, [&]{ return stop || generation != seen; });
+
+			if (stop)
+				return;
+
+			seen = generation;
+		}
+
+		for (Chunk c; pop(self, c); finish())
+			(*c.job)(c.begin, c.end);
+	}
+}
+
+void JobPool::run(size_t n, size_t chunk, const Job &job) {
+	assert(chunk);
+
+	if (workers.empty() || n <= chunk) {
+		if (n)
+			job(0, n);
+		return;
+	}
+
+	unsigned count = size() + 1, self = size();
+	size_t chunks = (n + chunk - 1) / chunk;
+
+	pending.store(chunks);
+
+	for (size_t i = 0; i < chunks; ++i) {
+		Queue &q = queues[i % count];
+		std::lock_guard<std::mutex> lock(q.mut);
+		q.chunks.push_back(Chunk{&job, i * chunk, std::min(n, (i + 1) * chunk)});
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mut);
+		++generation;
+	}
+	cv_work.notify_all();
+
+	for (Chunk c; pop(self, c); finish())
+		(*c.job)(c.begin, c.end);
+
+	std::unique_lock<std::mutex> lock(mut);
+	cv_done.wait(lock, [&]{ return pending.load() == 0; });
+}
+
+}
@@ -0,0 +1,69 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Simple job system for the simulation. A job is split into chunks that are spread
+ * over all workers. Each worker has its own deque and steals from the others when it
+ * runs out of work. The caller helps out until all chunks have been processed, so the
+ * work is done when run returns.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace genie {
+
+/** Process the half open range [begin, end). */
+typedef std::function<void(size_t begin, size_t end)> Job;
+
+class JobPool final {
+	struct Chunk final {
+		const Job *job;
+		size_t begin, end;
+	};
+
+	struct Queue final {
+		std::mutex mut;
+		std::deque<Chunk> chunks;
+	};
+
+	std::vector<std::thread> workers;
+	std::unique_ptr<Queue[]> queues; /**< one for each worker and one for the caller */
+	std::mutex mut; // lock for all following variables
+	std::condition_variable cv_work, cv_done;
+	uint64_t generation;
+	bool stop;
+	std::atomic<size_t> pending;
+public:
+	/** Create pool with \a threads workers. If zero, all jobs are run by the caller. */
+	JobPool(unsigned threads);
+	~JobPool();
+
+	JobPool(const JobPool&) = delete;
+	JobPool &operator=(const JobPool&) = delete;
+
+	unsigned size() const noexcept { return (unsigned)workers.size(); }
+
+	/**
+	 * Run \a job on [0, n) in chunks of at most \a chunk items and wait for all of them to complete.
+	 * The chunks may be processed in any order, so \a job must not depend on any other chunk.
+	 */
+	void run(size_t n, size_t chunk, const Job &job);
+
+private:
+	bool pop(unsigned self, Chunk &c);
+	void finish();
+	void work(unsigned self);
+};
+
+}
@@ -0,0 +1,85 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "lockstep.hpp"
+
+#include <cstdio>
+
+#include <algorithm>
+
+namespace genie {
+
+namespace game {
+
+uint16_t turn_delay(unsigned rtt) {
+	unsigned delay = 1 + (rtt + turn_ms - 1) / turn_ms;
+	return (uint16_t)std::min<unsigned>(std::max<unsigned>(delay, turn_delay_min), turn_delay_max);
+}
+
+TurnScheduler::TurnScheduler()
+	: mut(), bundles(), complete(0), delay(turn_delay_initial)
+	, turn(0), ticks(0), sent(turn_delay_initial) {}
+
+void TurnScheduler::receive(const Order &o) {
+	std::lock_guard<std::mutex> lock(mut);
+	bundles[o.turn].emplace_back(o);
+}
+
+void TurnScheduler::receive(const TurnDone &done) {
+	std::lock_guard<std::mutex> lock(mut);
+
+	// the server sends turns in order over a reliable stream, so this should never happen
+	if (done.turn != complete)
+		fprintf(stderr, "%s: expected turn %u, got %u\n", __func__, complete, done.turn);
+
+	auto search = bundles.find(done.turn);
+	size_t count = search == bundles.end() ? 0 : search->second.size();
+
+	if (count != done.orders)
+		fprintf(stderr, "%s: turn %u: expected %u orders, got %zu\n", __func__, done.turn, done.orders, count);
+
+	complete = std::max(complete, done.turn + 1);
+	delay = done.delay;
+}
+
+uint32_t TurnScheduler::stamp() {
+	std::lock_guard<std::mutex> lock(mut);
+	// never stamp orders for turns that we have already reported to be done
+	return std::max(turn + delay, sent);
+}
+
+bool TurnScheduler::begin(std::vector<Order> &orders) {
+	if (ticks)
+		return true;
+
+	std::lock_guard<std::mutex> lock(mut);
+
+	if (turn >= complete)
+		return false;
+
+	auto search = bundles.find(turn);
+	if (search != bundles.end()) {
+		orders.insert(orders.end(), search->second.begin(), search->second.end());
+		bundles.erase(search);
+	}
+
+	return true;
+}
+
+bool TurnScheduler::end(uint32_t &end) {
+	if (++ticks < turn_ticks)
+		return false;
+
+	std::lock_guard<std::mutex> lock(mut);
+
+	// orders during this turn are stamped turn + delay at most
+	sent = std::max(sent, turn + delay + 1);
+	end = sent;
+
+	ticks = 0;
+	++turn;
+	return true;
+}
+
+}
+
+}
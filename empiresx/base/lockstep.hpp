@@ -0,0 +1,76 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Lockstep turn scheduling. The simulation is divided in turns with a fixed number of
+ * ticks. Player orders are stamped with the turn at which they are executed, which is
+ * a few turns ahead to hide the network latency. The server collects all orders and
+ * broadcasts them per turn, followed by a TurnDone. A turn can only start once its
+ * complete bundle of orders has been received, so all peers execute the same orders
+ * at the same tick.
+ */
+
+#include "net.hpp"
+
+#include <cstdint>
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+static constexpr unsigned turn_ticks = 5;
+static constexpr unsigned turn_ms = 100; /**< turn_ticks at 50 ticks per second */
+
+/** Number of turns that the server closes when the match starts, before any client can have sent a TurnEnd. */
+static constexpr uint16_t turn_delay_initial = 2;
+static constexpr uint16_t turn_delay_min = 2, turn_delay_max = 20;
+
+/** Number of ticks between comparing world checksums with the server. */
+static constexpr unsigned checksum_ticks = 10 * turn_ticks;
+/** Number of checksums the server keeps around for peers that lag behind. */
+static constexpr unsigned checksum_keep = 2 * turn_delay_max * turn_ticks / checksum_ticks + 2;
+
+/** Input delay in turns for the specified round trip time in milliseconds. */
+uint16_t turn_delay(unsigned rtt);
+
+class TurnScheduler final {
+	std::mutex mut; // lock for all variables that are modified by the network thread
+	std::map<uint32_t, std::vector<Order>> bundles;
+	uint32_t complete; /**< all bundles for turns before this one have been received */
+	uint16_t delay;
+
+	// only accessed by the simulation
+	uint32_t turn;
+	unsigned ticks;
+	uint32_t sent; /**< all orders for turns before this one have been sent */
+public:
+	TurnScheduler();
+
+	void receive(const Order &o);
+	void receive(const TurnDone &done);
+
+	/** Turn at which new orders are executed. */
+	uint32_t stamp();
+
+	/**
+	 * Prepare next tick. If it starts a turn, the orders for that turn are appended to \a orders.
+	 * Returns false if the bundle for that turn has not been received yet.
+	 */
+	bool begin(std::vector<Order> &orders);
+	/**
+	 * Finish tick. Returns true if it has completed a turn, which implies that all
+	 * orders for turn \a end and any turn before have been sent.
+	 */
+	bool end(uint32_t &end);
+
+	uint32_t current() const noexcept { return turn; }
+};
+
+}
+
+}
@@ -0,0 +1,121 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "mapgen.hpp"
+
+#include <cassert>
+
+#include <algorithm>
+
+namespace genie {
+
+namespace game {
+
+enum TileState : uint8_t {
+	tile_free,
+	tile_object,
+	tile_reserved, /**< must stay free, but objects may be next to it */
+};
+
+MapGen::MapGen(unsigned w, unsigned h, const Philox &rng)
+	: w(w), h(h), cols((w + mapgen_region - 1) / mapgen_region), rows((h + mapgen_region - 1) / mapgen_region)
+	, rng(rng), tiles((size_t)w * h, tile_free), area((size_t)cols * rows + 1), placed((size_t)cols * rows)
+{
+	area[0] = 0;
+
+	for (unsigned r = 0; r < cols * rows; ++r) {
+		unsigned x = (r % cols) * mapgen_region, y = (r / cols) * mapgen_region;
+		area[r + 1] = area[r] + (uint64_t)(std::min(x + mapgen_region, w) - x) * (std::min(y + mapgen_region, h) - y);
+	}
+}
+
+void MapGen::reserve(int left, int top, unsigned fw, unsigned fh) {
+	for (int y = top; y < top + (int)fh; ++y)
+		for (int x = left; x < left + (int)fw; ++x)
+			if (inside(x, y))
+				tiles[(size_t)y * w + x] = tile_reserved;
+}
+
+bool MapGen::fits(int x, int y, const ScatterKind &k) const noexcept {
+	int left = x, top = y, right = x, bottom = y;
+
+	for (unsigned i = 0; i < k.parts; ++i) {
+		int px = x + k.footprint[i][0], py = y + k.footprint[i][1];
+
+		if (!inside(px, py) || tiles[(size_t)py * w + px] != tile_free)
+			return false;
+
+		left = std::min(left, px);
+		top = std::min(top, py);
+		right = std::max(right, px);
+		bottom = std::max(bottom, py);
+	}
+
+	int s = (int)k.spacing;
+
+	for (int py = std::max(0, top - s); py <= std::min((int)h - 1, bottom + s); ++py)
+		for (int px = std::max(0, left - s); px <= std::min((int)w - 1, right + s); ++px)
+			if (tiles[(size_t)py * w + px] == tile_object)
+				return false;
+
+	return true;
+}
+
+void MapGen::fill(unsigned r, const std::vector<ScatterKind> &kinds) {
+	Philox stream(rng.substream(RandomStream::mapgen, r));
+	int left = (r % cols) * mapgen_region, top = (r / cols) * mapgen_region;
+	int right = std::min<int>(left + mapgen_region, w) - 1, bottom = std::min<int>(top + mapgen_region, h) - 1;
+	uint64_t total = area.back();
+	std::vector<Placement> &list = placed[r];
+
+	list.clear();
+
+	for (unsigned k = 0; k < kinds.size(); ++k) {
+		const ScatterKind &kind = kinds[k];
+		// share of this region, such that the shares of all regions add up to the total count
+		uint64_t quota = kind.count * area[r + 1] / total - kind.count * area[r] / total;
+
+		for (uint64_t i = 0; i < quota; ++i)
+			for (unsigned t = 0; t < mapgen_tries; ++t) {
+				int x = (int)stream.next(left, right), y = (int)stream.next(top, bottom);
+
+				if (!fits(x, y, kind))
+					continue;
+
+				for (unsigned p = 0; p < kind.parts; ++p)
+					tiles[(size_t)(y + kind.footprint[p][1]) * w + x + kind.footprint[p][0]] = tile_object;
+
+				list.emplace_back(Placement{(uint16_t)x, (uint16_t)y, (uint8_t)k, (uint8_t)(kind.variants > 1 ? stream.next(kind.variants - 1) : 0)});
+				break;
+			}
+	}
+}
+
+void MapGen::scatter(JobPool &jobs, const std::vector<ScatterKind> &kinds, std::vector<Placement> &out) {
+	std::vector<unsigned> phase;
+
+	for (unsigned p = 0; p < 4; ++p) {
+		phase.clear();
+
+		for (unsigned r = 0; r < cols * rows; ++r)
+			if (((r % cols) & 1) == (p & 1) && ((r / cols) & 1) == (p >> 1))
+				phase.emplace_back(r);
+
+		jobs.run(phase.size(), 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+				fill(phase[i], kinds);
+		});
+	}
+
+	size_t n = 0;
+	for (auto &list : placed)
+		n += list.size();
+
+	out.reserve(out.size() + n);
+
+	for (auto &list : placed)
+		out.insert(out.end(), list.begin(), list.end());
+}
+
+}
+
+}
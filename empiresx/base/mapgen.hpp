@@ -0,0 +1,71 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Random map generator that scatters static objects without placing them on top of each
+ * other. The map is split in square regions that each get their own random substream, so
+ * the outcome only depends on the seed. Regions are processed in four phases like the squares
+ * of a checkerboard: regions in the same phase are at least a region apart, so they can be
+ * filled in parallel without looking at each other's tiles.
+ */
+
+#include "jobs.hpp"
+#include "random.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+/** Width and height of a region in tiles. Must exceed twice the reach of any object including its spacing. */
+static constexpr unsigned mapgen_region = 32;
+/** Number of random spots that are tried before an object is skipped. */
+static constexpr unsigned mapgen_tries = 30;
+
+struct ScatterKind final {
+	unsigned count; /**< number of objects on the whole map */
+	unsigned spacing; /**< minimum number of tiles between this and any other object */
+	const int (*footprint)[2]; /**< tile offsets of all parts */
+	unsigned parts;
+	unsigned variants; /**< number of different looks */
+};
+
+struct Placement final {
+	uint16_t x, y; /**< position of footprint origin */
+	uint8_t kind, variant;
+};
+
+class MapGen final {
+	unsigned w, h, cols, rows;
+	Philox rng;
+	std::vector<uint8_t> tiles;
+	std::vector<uint64_t> area; /**< number of tiles in all preceding regions */
+	std::vector<std::vector<Placement>> placed; /**< per region */
+public:
+	MapGen(unsigned w, unsigned h, const Philox &rng);
+
+	/** Keep [left, left+fw) x [top, top+fh) clear, e.g. for the town of a player. */
+	void reserve(int left, int top, unsigned fw, unsigned fh);
+
+	/**
+	 * Place all \a kinds in order of importance and append them to \a out in region order. Objects are
+	 * spread evenly over the map, but some may be skipped if there is no room left.
+	 */
+	void scatter(JobPool &jobs, const std::vector<ScatterKind> &kinds, std::vector<Placement> &out);
+private:
+	void fill(unsigned r, const std::vector<ScatterKind> &kinds);
+	bool fits(int x, int y, const ScatterKind &k) const noexcept;
+
+	bool inside(int x, int y) const noexcept {
+		return x >= 0 && y >= 0 && (unsigned)x < w && (unsigned)y < h;
+	}
+};
+
+}
+
+}
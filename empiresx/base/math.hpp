@@ -31,10 +31,64 @@ static constexpr inline uint64_t makepow2(uint64_t v) noexcept {
 	return ispow2(v) ? v : nextpow2(v);
 }
 
+/*
+ * Fixed point arithmetic. Floating point results may differ across compilers, optimization
+ * levels and platforms, so anything that must be identical for all peers in a match uses
+ * signed Q16.16 fixed point numbers and integer arithmetic only.
+ */
+typedef int32_t fixed;
+
+static constexpr unsigned fixed_bits = 16;
+static constexpr fixed fixed_one = 1 << fixed_bits;
+
+/** Convert to fixed point. Only use this for values that are not the result of any computation. */
+static constexpr inline fixed to_fixed(float v) noexcept {
+	return static_cast<fixed>(v * fixed_one);
+}
+
+static constexpr inline float from_fixed(fixed v) noexcept {
+	return static_cast<float>(v) / fixed_one;
+}
+
+static constexpr inline fixed fixmul(fixed a, fixed b) noexcept {
+	return static_cast<fixed>((static_cast<int64_t>(a) * b) >> fixed_bits);
+}
+
+/** Fixed point division. It is undefined to divide by zero. */
+static constexpr inline fixed fixdiv(fixed a, fixed b) noexcept {
+	return static_cast<fixed>(static_cast<int64_t>(a) * fixed_one / b);
+}
+
+/** Integer square root, rounded down. */
+static constexpr inline uint64_t isqrt(uint64_t v) noexcept {
+	uint64_t r = 0, bit = UINT64_C(1) << 62;
+
+	while (bit > v)
+		bit >>= 2;
+
+	while (bit) {
+		if (v >= r + bit) {
+			v -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return r;
+}
+
 template<typename T>
 static constexpr void tile_to_scr(T &x, T &y, T tx, T ty) {
 	y = (tx - ty) * th / 2;
 	x = (tx + ty) * tw / 2;
 }
 
+template<typename T>
+static constexpr void scr_to_tile(T &tx, T &ty, T x, T y) {
+	tx = x / tw + y / th;
+	ty = x / tw - y / th;
+}
+
 }
@@ -0,0 +1,212 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "move.hpp"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define MOVE_AVX 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MOVE_SSE2 1
+#endif
+
+/*
+ * NOTE the vectorized kernels rely on IEEE 754 double precision arithmetic being exact
+ * for all integers below 2^53 and on correctly rounded division and square roots. Do not
+ * compile this file with -ffast-math or anything similar that allows the compiler to
+ * replace these operations by approximations. CMakeLists.txt also turns off contraction
+ * into fused multiply-add, which no macro tells us about.
+ */
+
+#ifdef __FAST_MATH__
+#error "move.cpp must not be compiled with -ffast-math"
+#endif
+
+namespace genie {
+
+namespace game {
+
+static constexpr int sign(int64_t v) noexcept {
+	return (v > 0) - (v < 0);
+}
+
+/** Quantize screen vector to one of eight directions. Both axes count if their angle is within 22.5 degrees of a diagonal. */
+static inline uint8_t octant(int64_t x, int64_t y) noexcept {
+	// tan(22.5 deg) is approximately 106/256
+	int64_t ax = x < 0 ? -x : x, ay = y < 0 ? -y : y;
+	int qx = ax * 256 > ay * 106 ? sign(x) : 0;
+	int qy = ay * 256 > ax * 106 ? sign(y) : 0;
+
+	return static_cast<uint8_t>(1 + (qy + 1) * 3 + (qx + 1));
+}
+
+static inline void move_one(fixed &x, fixed &y, fixed tx, fixed ty, fixed speed, uint8_t &facing) noexcept {
+	int64_t dx = static_cast<int64_t>(tx) - x, dy = static_cast<int64_t>(ty) - y;
+
+	if ((dx < 0 ? -dx : dx) < move_threshold && (dy < 0 ? -dy : dy) < move_threshold) {
+		facing = 0;
+		return;
+	}
+
+	// convert map delta to screen delta to determine where the unit is facing
+	facing = octant((dx + dy) * tw / 2, (dx - dy) * th / 2);
+
+	uint64_t len = isqrt(static_cast<uint64_t>(dx * dx) + static_cast<uint64_t>(dy * dy));
+
+	if (len <= static_cast<uint64_t>(speed)) {
+		x = tx;
+		y = ty;
+		return;
+	}
+
+	x += static_cast<fixed>(dx * speed / static_cast<int64_t>(len));
+	y += static_cast<fixed>(dy * speed / static_cast<int64_t>(len));
+}
+
+void move_scalar(fixed *x, fixed *y, const fixed *tx, const fixed *ty, const fixed *speed, uint8_t *facing, size_t n) noexcept {
+	for (size_t i = 0; i < n; ++i)
+		move_one(x[i], y[i], tx[i], ty[i], speed[i], facing[i]);
+}
+
+#if MOVE_AVX
+
+const char *const move_isa = "avx";
+
+struct VecOps final {
+	typedef __m256d vec;
+	static constexpr size_t width = 4;
+
+	static vec load(const fixed *p) noexcept { return _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)p)); }
+	static void store(fixed *p, vec v) noexcept { _mm_storeu_si128((__m128i*)p, _mm256_cvttpd_epi32(v)); }
+
+	static vec set(double v) noexcept { return _mm256_set1_pd(v); }
+	static vec add(vec a, vec b) noexcept { return _mm256_add_pd(a, b); }
+	static vec sub(vec a, vec b) noexcept { return _mm256_sub_pd(a, b); }
+	static vec mul(vec a, vec b) noexcept { return _mm256_mul_pd(a, b); }
+	static vec div(vec a, vec b) noexcept { return _mm256_div_pd(a, b); }
+	static vec sqrt(vec v) noexcept { return _mm256_sqrt_pd(v); }
+	static vec trunc(vec v) noexcept { return _mm256_round_pd(v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+
+	static vec lt(vec a, vec b) noexcept { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+	static vec le(vec a, vec b) noexcept { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+	static vec gt(vec a, vec b) noexcept { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+
+	static vec and_(vec a, vec b) noexcept { return _mm256_and_pd(a, b); }
+	/** Compute ~a & b */
+	static vec andnot(vec a, vec b) noexcept { return _mm256_andnot_pd(a, b); }
+	static vec select(vec mask, vec a, vec b) noexcept { return _mm256_blendv_pd(b, a, mask); }
+};
+
+#elif MOVE_SSE2
+
+const char *const move_isa = "sse2";
+
+struct VecOps final {
+	typedef __m128d vec;
+	static constexpr size_t width = 2;
+
+	static vec load(const fixed *p) noexcept { return _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)p)); }
+	static void store(fixed *p, vec v) noexcept { _mm_storel_epi64((__m128i*)p, _mm_cvttpd_epi32(v)); }
+
+	static vec set(double v) noexcept { return _mm_set1_pd(v); }
+	static vec add(vec a, vec b) noexcept { return _mm_add_pd(a, b); }
+	static vec sub(vec a, vec b) noexcept { return _mm_sub_pd(a, b); }
+	static vec mul(vec a, vec b) noexcept { return _mm_mul_pd(a, b); }
+	static vec div(vec a, vec b) noexcept { return _mm_div_pd(a, b); }
+	static vec sqrt(vec v) noexcept { return _mm_sqrt_pd(v); }
+	// all values that are truncated fit in 32 bits
+	static vec trunc(vec v) noexcept { return _mm_cvtepi32_pd(_mm_cvttpd_epi32(v)); }
+
+	static vec lt(vec a, vec b) noexcept { return _mm_cmplt_pd(a, b); }
+	static vec le(vec a, vec b) noexcept { return _mm_cmple_pd(a, b); }
+	static vec gt(vec a, vec b) noexcept { return _mm_cmpgt_pd(a, b); }
+
+	static vec and_(vec a, vec b) noexcept { return _mm_and_pd(a, b); }
+	/** Compute ~a & b */
+	static vec andnot(vec a, vec b) noexcept { return _mm_andnot_pd(a, b); }
+	static vec select(vec mask, vec a, vec b) noexcept { return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b)); }
+};
+
+#else
+
+const char *const move_isa = "scalar";
+
+#endif
+
+#if MOVE_AVX || MOVE_SSE2
+
+typedef VecOps V;
+typedef V::vec vec;
+
+static inline vec vabs(vec v) noexcept {
+	return V::andnot(V::set(-0.0), v);
+}
+
+static inline vec vsign(vec v) noexcept {
+	vec zero = V::set(0), one = V::set(1);
+	return V::sub(V::and_(V::gt(v, zero), one), V::and_(V::lt(v, zero), one));
+}
+
+/** Vectorized move_one. Every step is exact, so this matches the integer arithmetic in move_one. */
+static inline void move_vec(fixed *x, fixed *y, const fixed *tx, const fixed *ty, const fixed *speed, uint8_t *facing) noexcept {
+	vec px = V::load(x), py = V::load(y), qx = V::load(tx), qy = V::load(ty), s = V::load(speed);
+	vec dx = V::sub(qx, px), dy = V::sub(qy, py);
+	vec one = V::set(1), thr = V::set(move_threshold);
+
+	vec idle = V::and_(V::lt(vabs(dx), thr), V::lt(vabs(dy), thr));
+
+	// see octant
+	vec sx = V::mul(V::add(dx, dy), V::set(tw / 2)), sy = V::mul(V::sub(dx, dy), V::set(th / 2));
+	vec ax = V::mul(vabs(sx), V::set(256)), ay = V::mul(vabs(sy), V::set(256));
+	vec bx = V::mul(vabs(sx), V::set(106)), by = V::mul(vabs(sy), V::set(106));
+	vec fx = V::and_(V::gt(ax, by), vsign(sx)), fy = V::and_(V::gt(ay, bx), vsign(sy));
+	vec f = V::andnot(idle, V::add(V::set(1 + 3 + 1), V::add(V::mul(fy, V::set(3)), fx)));
+
+	// the square root is correctly rounded, so the truncated estimate is off by at most one
+	vec n = V::add(V::mul(dx, dx), V::mul(dy, dy));
+	vec len = V::trunc(V::sqrt(n));
+	len = V::sub(len, V::and_(V::gt(V::mul(len, len), n), one));
+	vec len1 = V::add(len, one);
+	len = V::add(len, V::and_(V::le(V::mul(len1, len1), n), one));
+
+	// the quotient is never close enough to an integer to be rounded up to it
+	vec snap = V::le(len, s);
+	vec mx = V::select(snap, qx, V::add(px, V::trunc(V::div(V::mul(dx, s), len))));
+	vec my = V::select(snap, qy, V::add(py, V::trunc(V::div(V::mul(dy, s), len))));
+
+	V::store(x, V::select(idle, px, mx));
+	V::store(y, V::select(idle, py, my));
+
+	fixed fv[V::width];
+	V::store(fv, f);
+
+	for (size_t i = 0; i < V::width; ++i)
+		facing[i] = static_cast<uint8_t>(fv[i]);
+}
+
+void move_simd(fixed *x, fixed *y, const fixed *tx, const fixed *ty, const fixed *speed, uint8_t *facing, size_t n) noexcept {
+	constexpr size_t w = V::width;
+	size_t i = 0;
+
+	for (; i + 2 * w <= n; i += 2 * w) {
+		move_vec(x + i, y + i, tx + i, ty + i, speed + i, facing + i);
+		move_vec(x + i + w, y + i + w, tx + i + w, ty + i + w, speed + i + w, facing + i + w);
+	}
+
+	for (; i + w <= n; i += w)
+		move_vec(x + i, y + i, tx + i, ty + i, speed + i, facing + i);
+
+	move_scalar(x + i, y + i, tx + i, ty + i, speed + i, facing + i, n - i);
+}
+
+#else
+
+void move_simd(fixed *x, fixed *y, const fixed *tx, const fixed *ty, const fixed *speed, uint8_t *facing, size_t n) noexcept {
+	move_scalar(x, y, tx, ty, speed, facing, n);
+}
+
+#endif
+
+}
+
+}
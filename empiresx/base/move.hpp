@@ -0,0 +1,44 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Batched unit movement kernels. All kernels must yield exactly the same results
+ * as move_scalar, since every peer has to end up with the same simulation state.
+ */
+
+#include "math.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace genie {
+
+namespace game {
+
+static constexpr fixed move_threshold = fixed_one / 2 / tw; // half a horizontal pixel should be close enough
+
+/**
+ * Largest map position, in tiles, for which move_simd is exact. The vectorized kernel
+ * uses double precision arithmetic that only represents all intermediate results
+ * exactly if all coordinates are in range [0,move_simd_max).
+ */
+static constexpr unsigned move_simd_max = 1024;
+
+/** Name of the instruction set move_simd has been compiled for. */
+extern const char *const move_isa;
+
+/**
+ * Advance \a n units towards their target by at most their speed. Units that are
+ * already close enough to their target do not move.
+ *
+ * \a facing receives for each unit zero if it has not moved or the screen direction
+ * it has moved in as 1 + (y + 1) * 3 + (x + 1) with x and y each one of -1, 0 or 1.
+ */
+void move_scalar(fixed *x, fixed *y, const fixed *tx, const fixed *ty, const fixed *speed, uint8_t *facing, size_t n) noexcept;
+/** Same as move_scalar, but processes multiple units at once if the target supports it. */
+void move_simd(fixed *x, fixed *y, const fixed *tx, const fixed *ty, const fixed *speed, uint8_t *facing, size_t n) noexcept;
+
+}
+
+}
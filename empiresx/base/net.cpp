@@ -49,12 +49,19 @@ const unsigned cmd_sizes[] = {
 	sizeof(CreatePlayer),
 	sizeof(AssignSlave),
 	sizeof(uint8_t),
+	sizeof(Order),
+	sizeof(TurnEnd),
+	sizeof(TurnDone),
+	sizeof(uint32_t),
+	sizeof(Checksum),
+	sizeof(uint32_t),
 };
 
 void CmdData::hton(uint16_t type) {
 	assert(cmd_sizes[(unsigned)CmdType::max - 1]);
 	static_assert(sizeof(JoinUser) == sizeof(user_id) + NAME_LIMIT);
 	static_assert(sizeof(user_id) == sizeof(uint16_t));
+	static_assert(sizeof(Order) == 5 * sizeof(uint32_t));
 
 	switch ((CmdType)type) {
 	case CmdType::text:
@@ -82,6 +89,33 @@ void CmdData::hton(uint16_t type) {
 		assign.from = htobe16(assign.from);
 		assign.to = htobe16(assign.to);
 		break;
+	case CmdType::order:
+		order.turn = htobe32(order.turn);
+		order.player = htobe16(order.player);
+		order.type = htobe16(order.type);
+		order.unit = htobe32(order.unit);
+		order.x = (int32_t)htobe32((uint32_t)order.x);
+		order.y = (int32_t)htobe32((uint32_t)order.y);
+		break;
+	case CmdType::turn_end:
+		turn_end.turn = htobe32(turn_end.turn);
+		break;
+	case CmdType::turn_done:
+		turn_done.turn = htobe32(turn_done.turn);
+		turn_done.orders = htobe16(turn_done.orders);
+		turn_done.delay = htobe16(turn_done.delay);
+		break;
+	case CmdType::ping:
+		ping = htobe32(ping);
+		break;
+	case CmdType::checksum:
+		checksum.tick = htobe32(checksum.tick);
+		checksum.hash[0] = htobe32(checksum.hash[0]);
+		checksum.hash[1] = htobe32(checksum.hash[1]);
+		break;
+	case CmdType::desync:
+		desync = htobe32(desync);
+		break;
 	}
 }
 
@@ -112,6 +146,33 @@ void CmdData::ntoh(uint16_t type) {
 		assign.from = be16toh(assign.from);
 		assign.to = be16toh(assign.to);
 		break;
+	case CmdType::order:
+		order.turn = be32toh(order.turn);
+		order.player = be16toh(order.player);
+		order.type = be16toh(order.type);
+		order.unit = be32toh(order.unit);
+		order.x = (int32_t)be32toh((uint32_t)order.x);
+		order.y = (int32_t)be32toh((uint32_t)order.y);
+		break;
+	case CmdType::turn_end:
+		turn_end.turn = be32toh(turn_end.turn);
+		break;
+	case CmdType::turn_done:
+		turn_done.turn = be32toh(turn_done.turn);
+		turn_done.orders = be16toh(turn_done.orders);
+		turn_done.delay = be16toh(turn_done.delay);
+		break;
+	case CmdType::ping:
+		ping = be32toh(ping);
+		break;
+	case CmdType::checksum:
+		checksum.tick = be32toh(checksum.tick);
+		checksum.hash[0] = be32toh(checksum.hash[0]);
+		checksum.hash[1] = be32toh(checksum.hash[1]);
+		break;
+	case CmdType::desync:
+		desync = be32toh(desync);
+		break;
 	}
 }
 
@@ -244,6 +305,64 @@ Command Command::gamestate(uint8_t type) {
 	return cmd;
 }
 
+Command Command::order(const Order &o) {
+	Command cmd;
+
+	cmd.length = cmd_sizes[cmd.type = (uint16_t)CmdType::order];
+	cmd.data.order = o;
+
+	return cmd;
+}
+
+Command Command::turn_end(uint32_t turn) {
+	Command cmd;
+
+	cmd.length = cmd_sizes[cmd.type = (uint16_t)CmdType::turn_end];
+	cmd.data.turn_end.turn = turn;
+
+	return cmd;
+}
+
+Command Command::turn_done(uint32_t turn, uint16_t orders, uint16_t delay) {
+	Command cmd;
+
+	cmd.length = cmd_sizes[cmd.type = (uint16_t)CmdType::turn_done];
+	cmd.data.turn_done.turn = turn;
+	cmd.data.turn_done.orders = orders;
+	cmd.data.turn_done.delay = delay;
+
+	return cmd;
+}
+
+Command Command::ping(uint32_t stamp) {
+	Command cmd;
+
+	cmd.length = cmd_sizes[cmd.type = (uint16_t)CmdType::ping];
+	cmd.data.ping = stamp;
+
+	return cmd;
+}
+
+Command Command::checksum(uint32_t tick, uint64_t hash) {
+	Command cmd;
+
+	cmd.length = cmd_sizes[cmd.type = (uint16_t)CmdType::checksum];
+	cmd.data.checksum.tick = tick;
+	cmd.data.checksum.hash[0] = (uint32_t)hash;
+	cmd.data.checksum.hash[1] = (uint32_t)(hash >> 32);
+
+	return cmd;
+}
+
+Command Command::desync(uint32_t turn) {
+	Command cmd;
+
+	cmd.length = cmd_sizes[cmd.type = (uint16_t)CmdType::desync];
+	cmd.data.desync = turn;
+
+	return cmd;
+}
+
 const unsigned map_sizes[] = {
 	48, // 0
 	72, // 1
@@ -266,7 +385,7 @@ void StartMatch::dump() const {
 
 StartMatch StartMatch::random(unsigned slave_count, unsigned player_count) {
 	unsigned size = player_count <= 8 ? map_sizes[player_count] : (player_count + 6) * 12;
-	// maps bigger than 65536*65536 are not supported, since we would need at least 4GB of RAM
+	// maps bigger than 65536*65536 are not supported: terrain is paged in chunks, but occupancy and fog would need at least 4GB of RAM
 	assert(size <= UINT16_MAX);
 	
 	StartMatch m{(uint8_t)rand(), 0, (uint16_t)size, (uint16_t)size, (uint32_t)rand(), (uint8_t)rand(), (uint8_t)rand(), 1, 1, (uint16_t)slave_count};
@@ -135,6 +135,38 @@ struct AssignSlave final {
 	player_id to;
 };
 
+enum class OrderType {
+	move,
+	train, /**< unit is the handle of the building and x the unit type */
+};
+
+/** Player order that is executed by all peers at the start of the specified turn. */
+struct Order final {
+	uint32_t turn;
+	player_id player; /**< filled in by the server */
+	uint16_t type;
+	uint32_t unit;
+	int32_t x, y; /**< fixed point map position */
+};
+
+/** Sent by clients to indicate that all their orders for any turn before \a turn have been sent. */
+struct TurnEnd final {
+	uint32_t turn;
+};
+
+/** Sent by the server after all orders for \a turn have been sent. */
+struct TurnDone final {
+	uint32_t turn;
+	uint16_t orders; /**< number of orders for this turn */
+	uint16_t delay; /**< number of turns between issuing and executing new orders */
+};
+
+/** Sent by all peers to the server every checksum_ticks ticks to detect that they have run out of sync. */
+struct Checksum final {
+	uint32_t tick; /**< number of ticks computed */
+	uint32_t hash[2]; /**< low and high half, so the command data does not need 64 bit alignment */
+};
+
 union CmdData final {
 	TextMsg text;
 	JoinUser join;
@@ -144,6 +176,12 @@ union CmdData final {
 	CreatePlayer create;
 	AssignSlave assign;
 	uint8_t gamestate;
+	Order order;
+	TurnEnd turn_end;
+	TurnDone turn_done;
+	uint32_t ping;
+	Checksum checksum;
+	uint32_t desync; /**< turn at whose end all peers dump their state */
 
 	void hton(uint16_t type);
 	void ntoh(uint16_t type);
@@ -162,6 +200,12 @@ enum class CmdType {
 	create,
 	assign,
 	gamestate,
+	order,
+	turn_end,
+	turn_done,
+	ping,
+	checksum,
+	desync,
 	max,
 };
 
@@ -188,6 +232,12 @@ public:
 	static Command create(player_id id, const std::string &str);
 	static Command assign(user_id id, player_id pid);
 	static Command gamestate(uint8_t type);
+	static Command order(const Order &o);
+	static Command turn_end(uint32_t turn);
+	static Command turn_done(uint32_t turn, uint16_t orders, uint16_t delay);
+	static Command ping(uint32_t stamp);
+	static Command checksum(uint32_t tick, uint64_t hash);
+	static Command desync(uint32_t turn);
 };
 
 class ServerCallback {
@@ -0,0 +1,231 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "path.hpp"
+
+#include <cassert>
+
+#include <algorithm>
+
+namespace genie {
+
+namespace game {
+
+/** Step costs that approximate the distance ratio between straight and diagonal moves. */
+static constexpr uint32_t flow_cost[2] = {2, 3};
+static constexpr uint32_t flow_inf = UINT32_MAX;
+
+void Occupancy::update(int left, int top, unsigned fw, unsigned fh, bool add, std::vector<uint32_t> &changed) {
+	for (int y = top; y < top + (int)fh; ++y)
+		for (int x = left; x < left + (int)fw; ++x) {
+			if (!inside(x, y))
+				continue;
+
+			uint32_t i = (uint32_t)y * w + x;
+
+			if (add) {
+				assert(count[i] < UINT8_MAX);
+				if (!count[i]++)
+					changed.emplace_back(i);
+			} else {
+				assert(count[i]);
+				if (!--count[i])
+					changed.emplace_back(i);
+			}
+		}
+}
+
+bool FlowField::affected(const std::vector<uint32_t> &tiles) const noexcept {
+	// a tile only matters if it is part of the reachable area or borders on it
+	for (uint32_t i : tiles) {
+		int x = i % w, y = i / w;
+
+		if (reached(i))
+			return true;
+
+		for (unsigned d = 0; d < 8; ++d) {
+			int nx = x + flow_dx[d], ny = y + flow_dy[d];
+
+			if (nx >= 0 && ny >= 0 && (unsigned)nx < w && (unsigned)ny < h && reached((uint32_t)ny * w + nx))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+FlowCache::FlowCache(size_t capacity) : capacity(capacity), mut(), lru(), index(), hits(0), misses(0) {
+	assert(capacity);
+}
+
+std::shared_ptr<const FlowField> FlowCache::get(const Occupancy &occ, unsigned x, unsigned y) {
+	assert(occ.inside(x, y));
+	uint32_t dest = y * occ.width() + x;
+	std::unique_lock<std::mutex> lock(mut);
+
+	auto search = index.find(dest);
+	if (search != index.end()) {
+		++hits;
+		lru.splice(lru.begin(), lru, search->second);
+		return lru.front();
+	}
+
+	++misses;
+
+	// don't block other threads while computing
+	lock.unlock();
+	std::shared_ptr<const FlowField> f(compute(occ, dest));
+	lock.lock();
+
+	// someone else may have computed the same field meanwhile
+	search = index.find(dest);
+	if (search != index.end()) {
+		lru.splice(lru.begin(), lru, search->second);
+		return lru.front();
+	}
+
+	if (lru.size() >= capacity) {
+		index.erase(lru.back()->dest);
+		lru.pop_back();
+	}
+
+	lru.emplace_front(f);
+	index.emplace(dest, lru.begin());
+	return lru.front();
+}
+
+void FlowCache::invalidate(const std::vector<uint32_t> &tiles) {
+	std::lock_guard<std::mutex> lock(mut);
+
+	for (auto it = lru.begin(); it != lru.end();) {
+		if ((*it)->affected(tiles)) {
+			index.erase((*it)->dest);
+			it = lru.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void FlowCache::clear() {
+	std::lock_guard<std::mutex> lock(mut);
+	index.clear();
+	lru.clear();
+}
+
+/** Whether we can step from (\a x, \a y) in direction \a d. Diagonal steps must not cut corners. */
+static bool can_step(const Occupancy &occ, int x, int y, unsigned d) {
+	if (!occ.passable(x + flow_dx[d], y + flow_dy[d]))
+		return false;
+
+	return !(d & 1) || (occ.passable(x + flow_dx[d], y) && occ.passable(x, y + flow_dy[d]));
+}
+
+std::shared_ptr<const FlowField> FlowCache::compute(const Occupancy &occ, uint32_t dest) {
+	unsigned w = occ.width(), h = occ.height();
+	size_t n = (size_t)w * h;
+	std::shared_ptr<FlowField> f(new FlowField(w, h, dest));
+
+	// integration field: dijkstra from the destination. the destination itself may be
+	// blocked (e.g. when walking to a tree), in which case we stop next to it. all step
+	// costs are small, so a ring of buckets is enough as priority queue.
+	std::vector<uint32_t> cost(n, flow_inf);
+	std::vector<uint32_t> open[flow_buckets];
+	std::vector<uint32_t> escape; // blocked tiles that have a way out
+
+	cost[dest] = 0;
+	open[0].emplace_back(dest);
+
+	for (uint32_t c = 0, pending = 1; pending; ++c) {
+		auto &bucket = open[c % flow_buckets];
+
+		for (size_t k = 0; k < bucket.size(); ++k) {
+			uint32_t i = bucket[k];
+			--pending;
+
+			if (cost[i] != c)
+				continue;
+
+			int x = i % w, y = i / w;
+
+			for (unsigned d = 0; d < 8; ++d) {
+				// paths are symmetric, so we can step from the neighbour to us
+				if (!can_step(occ, x, y, d))
+					continue;
+
+				uint32_t j = (uint32_t)(y + flow_dy[d]) * w + (x + flow_dx[d]), cj = c + flow_cost[d & 1];
+
+				if (cj < cost[j]) {
+					cost[j] = cj;
+					open[cj % flow_buckets].emplace_back(j);
+					++pending;
+				}
+			}
+		}
+
+		bucket.clear();
+	}
+
+	// flow field: point every tile to its cheapest neighbour. ties are broken by direction
+	for (uint32_t i = 0; i < n; ++i) {
+		if (i == dest) {
+			f->dir[i] = flow_here;
+			continue;
+		}
+
+		int x = i % w, y = i / w;
+		bool free = occ.passable(x, y);
+		uint32_t best = flow_inf;
+		uint8_t dir = flow_none;
+
+		for (unsigned d = 0; d < 8; ++d) {
+			// units on blocked tiles may walk to any free neighbour to get out
+			if (free ? !can_step(occ, x, y, d) : !occ.passable(x + flow_dx[d], y + flow_dy[d]))
+				continue;
+
+			uint32_t j = (uint32_t)(y + flow_dy[d]) * w + (x + flow_dx[d]);
+			if (cost[j] == flow_inf || (free && cost[j] >= cost[i]))
+				continue;
+
+			uint32_t cj = cost[j] + flow_cost[d & 1];
+			if (cj < best) {
+				best = cj;
+				dir = (uint8_t)d;
+			}
+		}
+
+		if (!free) {
+			f->dir[i] = dir == flow_none ? flow_none : (uint8_t)(dir | flow_blocked);
+			if (dir != flow_none)
+				escape.emplace_back(i);
+		} else if (dir == flow_none && cost[i] != flow_inf) {
+			f->dir[i] = flow_here; // next to a blocked destination: this is as close as it gets
+		} else {
+			f->dir[i] = dir;
+		}
+	}
+
+	// lead units that are stuck deeper inside obstacles out the shortest way
+	for (size_t k = 0; k < escape.size(); ++k) {
+		uint32_t i = escape[k];
+		int x = i % w, y = i / w;
+
+		for (unsigned d = 0; d < 8; ++d) {
+			int nx = x + flow_dx[d], ny = y + flow_dy[d];
+
+			if (!occ.inside(nx, ny))
+				continue;
+
+			uint32_t j = (uint32_t)ny * w + nx;
+			if (j != dest && f->dir[j] == flow_none && !occ.passable(nx, ny)) {
+				f->dir[j] = (uint8_t)(((d + 4) % 8) | flow_blocked);
+				escape.emplace_back(j);
+			}
+		}
+	}
+
+	return f;
+}
+
+}
+
+}
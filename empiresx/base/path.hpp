@@ -0,0 +1,110 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Flow field pathfinding over the map tiles. A flow field tells for every tile in which
+ * direction to move to get closer to one particular destination. All units that head for
+ * the same destination share the same field, so a group order costs one search no matter
+ * how many units are in the group.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+/** Tile offsets for each direction. Odd directions are diagonal. */
+static constexpr int flow_dx[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+static constexpr int flow_dy[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+
+static constexpr uint8_t flow_here = 8; /**< tile is the destination */
+static constexpr uint8_t flow_blocked = 0x80; /**< tile is blocked: direction points to the cheapest free neighbour */
+static constexpr uint8_t flow_none = 0xff; /**< destination cannot be reached */
+
+/** Number of buckets in the open list. Must exceed the largest step cost. */
+static constexpr unsigned flow_buckets = 4;
+
+/** Number of static objects on each tile. Any tile with objects on it is impassable. */
+class Occupancy final {
+	unsigned w, h;
+	std::vector<uint8_t> count;
+public:
+	Occupancy(unsigned w, unsigned h) : w(w), h(h), count((size_t)w * h) {}
+
+	unsigned width() const noexcept { return w; }
+	unsigned height() const noexcept { return h; }
+
+	bool inside(int x, int y) const noexcept {
+		return x >= 0 && y >= 0 && (unsigned)x < w && (unsigned)y < h;
+	}
+
+	bool passable(int x, int y) const noexcept {
+		return inside(x, y) && !count[(size_t)y * w + x];
+	}
+
+	/**
+	 * Add or remove the footprint [left, left+fw) x [top, top+fh) of some object. The tiles
+	 * whose passability has changed are appended to \a changed.
+	 */
+	void update(int left, int top, unsigned fw, unsigned fh, bool add, std::vector<uint32_t> &changed);
+};
+
+class FlowField final {
+public:
+	const unsigned w, h;
+	const uint32_t dest; /**< tile index of the destination */
+	std::unique_ptr<uint8_t[]> dir;
+
+	FlowField(unsigned w, unsigned h, uint32_t dest) : w(w), h(h), dest(dest), dir(new uint8_t[(size_t)w * h]) {}
+
+	/** Whether the destination can be reached from free tile \a i. */
+	bool reached(uint32_t i) const noexcept {
+		return !(dir[i] & flow_blocked);
+	}
+
+	/** Whether any path in this field may be different after the passability of \a tiles has changed. */
+	bool affected(const std::vector<uint32_t> &tiles) const noexcept;
+};
+
+/**
+ * Least recently used cache of flow fields keyed by destination tile. Fields may be requested
+ * from multiple threads at once, as long as the occupancy does not change meanwhile.
+ */
+class FlowCache final {
+	size_t capacity;
+	mutable std::mutex mut; // lock for all following variables
+	std::list<std::shared_ptr<const FlowField>> lru; /**< most recently used first */
+	std::unordered_map<uint32_t, std::list<std::shared_ptr<const FlowField>>::iterator> index;
+public:
+	size_t hits, misses;
+
+	FlowCache(size_t capacity=32);
+
+	/** Get flow field towards tile (\a x, \a y). The field remains valid when it is evicted. */
+	std::shared_ptr<const FlowField> get(const Occupancy &occ, unsigned x, unsigned y);
+
+	/** Drop all fields that are affected by the passability changes of \a tiles. */
+	void invalidate(const std::vector<uint32_t> &tiles);
+	/** Drop all fields, e.g. after the occupancy has been replaced. */
+	void clear();
+
+	size_t size() const {
+		std::lock_guard<std::mutex> lock(mut);
+		return lru.size();
+	}
+private:
+	static std::shared_ptr<const FlowField> compute(const Occupancy &occ, uint32_t dest);
+};
+
+}
+
+}
@@ -0,0 +1,184 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "pathqueue.hpp"
+
+#include <cassert>
+
+#include <algorithm>
+
+namespace genie {
+
+namespace game {
+
+PathQueue::PathQueue(const Occupancy &occ, FlowCache &flows, const HpaGraph &hpa, unsigned threads)
+	: occ(occ), flows(flows), hpa(hpa), statics(), version(0)
+	, workers(), mut(), cv_work(), cv_done(), requests(), todo(), next_id(1), stop(false)
+	, resolved(0), late(0), stale(0), latency_total(0), latency_max(0)
+	, search(), budget(path_budget)
+{
+	for (unsigned i = 0; i < threads; ++i)
+		workers.emplace_back(&PathQueue::work, this);
+}
+
+PathQueue::~PathQueue() {
+	{
+		std::lock_guard<std::mutex> lock(mut);
+		stop = true;
+	}
+	cv_work.notify_all();
+
+	for (auto &t : workers)
+		t.join();
+}
+
+uint32_t PathQueue::submit(uint32_t due, uint32_t start, uint32_t goal, bool single, std::vector<uint32_t> &&units) {
+	std::unique_lock<std::mutex> lock(mut);
+
+	uint32_t id = next_id;
+	next_id = next_id == UINT32_MAX ? 1 : next_id + 1;
+
+	assert(requests.empty() || requests.back()->due <= due);
+	requests.emplace_back(new PathRequest(id, due, start, goal, single, std::move(units)));
+	todo.emplace_back(requests.back().get());
+
+	lock.unlock();
+	cv_work.notify_one();
+
+	return id;
+}
+
+void PathQueue::resolve(PathRequest &r, GridSearch &s) {
+	std::shared_lock<std::shared_mutex> lock(statics);
+
+	r.version = version;
+	r.flow.reset();
+	r.route.reset();
+
+	if (r.single) {
+		std::unique_ptr<Route> route(new Route());
+
+		if (hpa.find(occ, r.start, r.goal, *route, s)) {
+			r.route = std::move(route);
+			return;
+		}
+	}
+
+	r.flow = flows.get(occ, r.goal % occ.width(), r.goal / occ.width());
+}
+
+void PathQueue::run(PathRequest &r, GridSearch &s, std::unique_lock<std::mutex> &lock) {
+	r.state = PathRequest::State::running;
+	lock.unlock();
+
+	resolve(r, s);
+	std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - r.submitted;
+
+	lock.lock();
+	r.state = PathRequest::State::done;
+
+	++resolved;
+	latency_total += latency.count();
+	latency_max = std::max(latency_max, latency.count());
+
+	cv_done.notify_all();
+}
+
+void PathQueue::work() {
+	GridSearch s;
+	std::unique_lock<std::mutex> lock(mut);
+
+	while (1) {
+		cv_work.wait(lock, [this]{ return stop || !todo.empty(); });
+
+		if (stop)
+			return;
+
+		PathRequest *r = todo.front();
+		todo.pop_front();
+		run(*r, s, lock);
+	}
+}
+
+void PathQueue::take(uint32_t tick, std::vector<std::unique_ptr<PathRequest>> &out) {
+	std::unique_lock<std::mutex> lock(mut);
+
+	while (!requests.empty() && requests.front()->due <= tick) {
+		PathRequest &r = *requests.front();
+
+		if (r.state != PathRequest::State::done)
+			++late;
+
+		if (r.state == PathRequest::State::queued) {
+			todo.erase(std::find(todo.begin(), todo.end(), &r));
+			run(r, search, lock);
+		} else {
+			cv_done.wait(lock, [&r]{ return r.state == PathRequest::State::done; });
+		}
+
+		// the map can only change on this thread, so it cannot change after this check
+		if (r.version != version) {
+			++stale;
+			lock.unlock();
+			resolve(r, search);
+			lock.lock();
+		}
+
+		out.emplace_back(std::move(requests.front()));
+		requests.pop_front();
+	}
+}
+
+void PathQueue::help() {
+	auto start = std::chrono::steady_clock::now();
+	std::chrono::microseconds limit(budget);
+	std::unique_lock<std::mutex> lock(mut);
+
+	while (!todo.empty() && std::chrono::steady_clock::now() - start < limit) {
+		PathRequest *r = todo.front();
+		todo.pop_front();
+		run(*r, search, lock);
+	}
+}
+
+std::unique_lock<std::shared_mutex> PathQueue::change() {
+	std::unique_lock<std::shared_mutex> lock(statics);
+	++version;
+	return lock;
+}
+
+uint32_t PathQueue::upcoming() const {
+	std::lock_guard<std::mutex> lock(mut);
+	return next_id;
+}
+
+void PathQueue::reset(uint32_t id) {
+	std::unique_lock<std::mutex> lock(mut);
+
+	// workers still refer to the requests they are working on
+	todo.clear();
+	cv_done.wait(lock, [this]{
+		return std::none_of(requests.begin(), requests.end(), [](const std::unique_ptr<PathRequest> &r) { return r->state == PathRequest::State::running; });
+	});
+
+	requests.clear();
+	next_id = id ? id : 1;
+}
+
+PathQueueStats PathQueue::stats() const {
+	std::lock_guard<std::mutex> lock(mut);
+	PathQueueStats s;
+
+	s.depth = requests.size();
+	s.waiting = todo.size();
+	s.resolved = resolved;
+	s.late = late;
+	s.stale = stale;
+	s.latency_avg = resolved ? latency_total / resolved : 0;
+	s.latency_max = latency_max;
+
+	return s;
+}
+
+}
+
+}
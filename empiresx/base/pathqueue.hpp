@@ -0,0 +1,137 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Asynchronous path requests. Units submit requests that are resolved by background workers
+ * and by the simulation thread within a small time budget per tick. A result is handed out
+ * exactly path_delay ticks after its request, no matter how fast it was resolved, so every
+ * peer applies it at the same tick. Results that were computed before the map changed are
+ * computed again when they are handed out, so they only depend on the state of the world at
+ * that tick.
+ */
+
+#include "path.hpp"
+#include "hpa.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+/** Number of ticks between submitting a request and applying its result. */
+static constexpr unsigned path_delay = 3;
+/** Default time in microseconds the simulation thread spends on requests each tick. */
+static constexpr unsigned path_budget = 1000;
+
+struct PathRequest final {
+	enum class State {
+		queued,
+		running,
+		done,
+	};
+
+	uint32_t id, due; /**< due is the tick at which the result is applied */
+	uint32_t start, goal; /**< tiles */
+	bool single; /**< try HPA* first and fall back to a flow field if there is no path */
+	std::vector<uint32_t> units; /**< UnitRef of all units that wait for this request */
+
+	State state;
+	uint32_t version; /**< map version the result has been computed for */
+	std::shared_ptr<const FlowField> flow;
+	std::unique_ptr<Route> route;
+	std::chrono::steady_clock::time_point submitted;
+
+	PathRequest(uint32_t id, uint32_t due, uint32_t start, uint32_t goal, bool single, std::vector<uint32_t> &&units)
+		: id(id), due(due), start(start), goal(goal), single(single), units(std::move(units))
+		, state(State::queued), version(0), flow(), route(), submitted(std::chrono::steady_clock::now()) {}
+};
+
+struct PathQueueStats final {
+	size_t depth; /**< requests that have not been handed out yet */
+	size_t waiting; /**< requests that no one has started working on */
+	size_t resolved; /**< total number of resolved requests */
+	size_t late; /**< requests that had not been resolved yet when they were due */
+	size_t stale; /**< requests that had to be computed again because the map has changed */
+	double latency_avg, latency_max; /**< microseconds between submitting and resolving a request */
+};
+
+class PathQueue final {
+	const Occupancy &occ;
+	FlowCache &flows;
+	const HpaGraph &hpa;
+
+	/** Held shared while resolving and exclusive while the map is changed. */
+	std::shared_mutex statics;
+	uint32_t version;
+
+	std::vector<std::thread> workers;
+	mutable std::mutex mut; // lock for all following variables
+	std::condition_variable cv_work, cv_done;
+	std::deque<std::unique_ptr<PathRequest>> requests; /**< in submission order */
+	std::deque<PathRequest*> todo;
+	uint32_t next_id;
+	bool stop;
+	size_t resolved, late, stale;
+	double latency_total, latency_max;
+
+	GridSearch search; /**< for the simulation thread */
+public:
+	unsigned budget; /**< microseconds per tick that the simulation thread helps out */
+
+	/** Create queue with \a threads workers. If zero, all requests are resolved by the simulation thread. */
+	PathQueue(const Occupancy &occ, FlowCache &flows, const HpaGraph &hpa, unsigned threads);
+	~PathQueue();
+
+	PathQueue(const PathQueue&) = delete;
+	PathQueue &operator=(const PathQueue&) = delete;
+
+	/** Request path from tile \a start to tile \a goal for \a units. Returns the id of the request, which is never zero. */
+	uint32_t submit(uint32_t due, uint32_t start, uint32_t goal, bool single, std::vector<uint32_t> &&units);
+
+	/**
+	 * Move all requests that are due at \a tick to \a out in submission order. Any of them that
+	 * have not been resolved yet are finished first, so this may block.
+	 */
+	void take(uint32_t tick, std::vector<std::unique_ptr<PathRequest>> &out);
+
+	/** Resolve waiting requests until the budget has been used up. Requests are not interrupted, so one may go beyond it. */
+	void help();
+
+	/** Lock out all resolvers while the occupancy, flow cache or HPA* graph is modified. */
+	std::unique_lock<std::shared_mutex> change();
+
+	PathQueueStats stats() const;
+
+	/** Invoke \a f for every request that has not been handed out yet in submission order. */
+	template<typename F> void each(F f) const {
+		std::lock_guard<std::mutex> lock(mut);
+		for (auto &r : requests)
+			f(static_cast<const PathRequest&>(*r));
+	}
+
+	/** Id of the next request. */
+	uint32_t upcoming() const;
+	/** Drop all requests and number new ones starting at \a id, e.g. before restoring them from a snapshot. */
+	void reset(uint32_t id);
+private:
+	void resolve(PathRequest &r, GridSearch &s);
+	/** Resolve \a r on the calling thread. \a lock must hold mut. */
+	void run(PathRequest &r, GridSearch &s, std::unique_lock<std::mutex> &lock);
+	void work();
+};
+
+}
+
+}
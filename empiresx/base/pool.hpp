@@ -0,0 +1,131 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Typed object pools. Objects are carved out of big chunks, so creating thousands of trees
+ * costs a handful of allocations, and freed objects are reused before a new chunk is needed.
+ * All chunks are released at once when the pool is destroyed, e.g. together with the world
+ * at the end of a match. Pools are not thread-safe.
+ */
+
+#include <cassert>
+#include <cstddef>
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+template<typename T> class Pool;
+
+/** Puts objects back into the pool they came from. */
+template<typename T> class PoolDeleter final {
+	Pool<T> *pool;
+public:
+	PoolDeleter() noexcept : pool(NULL) {}
+	PoolDeleter(Pool<T> &pool) noexcept : pool(&pool) {}
+
+	void operator()(T *p) const noexcept {
+		assert(pool);
+		pool->destroy(p);
+	}
+};
+
+/** Object owned by a pool. The pool has to outlive it. */
+template<typename T> using Pooled = std::unique_ptr<T, PoolDeleter<T>>;
+
+template<typename T> class Pool final {
+	union Cell {
+		Cell *next;
+		alignas(T) unsigned char data[sizeof(T)];
+	};
+
+	static constexpr size_t chunk_min = 64;
+
+	std::vector<std::unique_ptr<Cell[]>> chunks;
+	Cell *freelist;
+	size_t used, left; /**< number of objects alive and fresh cells in the last chunk */
+	size_t next; /**< size of the next chunk */
+public:
+	Pool() : chunks(), freelist(NULL), used(0), left(0), next(chunk_min) {}
+
+	~Pool() {
+		assert(!used);
+	}
+
+	Pool(const Pool&) = delete;
+	Pool &operator=(const Pool&) = delete;
+
+	size_t size() const noexcept { return used; }
+	/** Number of chunks that have been allocated. */
+	size_t allocations() const noexcept { return chunks.size(); }
+
+	/** Make sure that \a n more objects can be created without allocating more than one chunk. */
+	void reserve(size_t n) {
+		size_t spare = left;
+		for (Cell *c = freelist; c && spare < n; c = c->next)
+			++spare;
+
+		if (spare < n)
+			grow(n - spare);
+	}
+
+	template<typename... Args> Pooled<T> create(Args&&... args) {
+		Cell *c = freelist;
+
+		if (c) {
+			freelist = c->next;
+		} else {
+			if (!left)
+				grow(next);
+
+			c = &chunks.back()[--left];
+		}
+
+		T *p;
+
+		try {
+			p = new (c->data) T(std::forward<Args>(args)...);
+		} catch (...) {
+			c->next = freelist;
+			freelist = c;
+			throw;
+		}
+
+		++used;
+		return Pooled<T>(p, PoolDeleter<T>(*this));
+	}
+
+	void destroy(T *p) noexcept {
+		assert(used);
+		p->~T();
+
+		Cell *c = reinterpret_cast<Cell*>(p);
+		c->next = freelist;
+		freelist = c;
+		--used;
+	}
+private:
+	void grow(size_t n) {
+		// fresh cells of the last chunk are lost, so keep them on the free list
+		for (; left; --left) {
+			Cell *c = &chunks.back()[left - 1];
+			c->next = freelist;
+			freelist = c;
+		}
+
+		chunks.emplace_back(new Cell[n]);
+		left = n;
+		next = std::max(next, n) * 2;
+	}
+};
+
+}
+
+}
@@ -0,0 +1,166 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "random.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RANDOM_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RANDOM_SSE2 1
+#endif
+
+namespace genie {
+
+static constexpr uint32_t philox_m0 = 0xD2511F53, philox_m1 = 0xCD9E8D57;
+/** Weyl sequence for the round keys: the golden ratio and sqrt(3) - 1 */
+static constexpr uint32_t philox_w0 = 0x9E3779B9, philox_w1 = 0xBB67AE85;
+static constexpr unsigned philox_rounds = 10;
+
+void Philox::generate(const uint32_t key[2], uint64_t counter, uint64_t stream, uint32_t out[4]) noexcept {
+	uint32_t c0 = (uint32_t)counter, c1 = (uint32_t)(counter >> 32), c2 = (uint32_t)stream, c3 = (uint32_t)(stream >> 32);
+	uint32_t k0 = key[0], k1 = key[1];
+
+	for (unsigned r = 0; r < philox_rounds; ++r) {
+		uint64_t p0 = (uint64_t)philox_m0 * c0, p1 = (uint64_t)philox_m1 * c2;
+
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+
+		k0 += philox_w0;
+		k1 += philox_w1;
+	}
+
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+#if RANDOM_AVX2
+
+const char *const random_isa = "avx2";
+
+struct VecOps final {
+	typedef __m256i vec;
+	static constexpr unsigned lanes = 8;
+
+	static vec set(uint32_t v) noexcept { return _mm256_set1_epi32((int)v); }
+	static vec iota(uint32_t v) noexcept { return _mm256_add_epi32(set(v), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)); }
+	static vec xor_(vec a, vec b) noexcept { return _mm256_xor_si256(a, b); }
+
+	static void mulhilo(vec a, uint32_t m, vec &hi, vec &lo) noexcept {
+		vec f = set(m), even = _mm256_mul_epu32(a, f), odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), f);
+		vec low = _mm256_set1_epi64x(0xffffffff);
+
+		lo = _mm256_or_si256(_mm256_and_si256(even, low), _mm256_slli_epi64(odd, 32));
+		hi = _mm256_or_si256(_mm256_srli_epi64(even, 32), _mm256_andnot_si256(low, odd));
+	}
+
+	/** Store the blocks of all lanes in counter order. */
+	static void store(uint32_t *out, vec x0, vec x1, vec x2, vec x3) noexcept {
+		// transposes lanes 0-3 in the lower and lanes 4-7 in the upper half
+		vec t0 = _mm256_unpacklo_epi32(x0, x1), t1 = _mm256_unpacklo_epi32(x2, x3);
+		vec t2 = _mm256_unpackhi_epi32(x0, x1), t3 = _mm256_unpackhi_epi32(x2, x3);
+		vec r0 = _mm256_unpacklo_epi64(t0, t1), r1 = _mm256_unpackhi_epi64(t0, t1);
+		vec r2 = _mm256_unpacklo_epi64(t2, t3), r3 = _mm256_unpackhi_epi64(t2, t3);
+
+		_mm256_storeu_si256((vec*)out, _mm256_permute2x128_si256(r0, r1, 0x20));
+		_mm256_storeu_si256((vec*)(out + 8), _mm256_permute2x128_si256(r2, r3, 0x20));
+		_mm256_storeu_si256((vec*)(out + 16), _mm256_permute2x128_si256(r0, r1, 0x31));
+		_mm256_storeu_si256((vec*)(out + 24), _mm256_permute2x128_si256(r2, r3, 0x31));
+	}
+};
+
+#elif RANDOM_SSE2
+
+const char *const random_isa = "sse2";
+
+struct VecOps final {
+	typedef __m128i vec;
+	static constexpr unsigned lanes = 4;
+
+	static vec set(uint32_t v) noexcept { return _mm_set1_epi32((int)v); }
+	static vec iota(uint32_t v) noexcept { return _mm_add_epi32(set(v), _mm_setr_epi32(0, 1, 2, 3)); }
+	static vec xor_(vec a, vec b) noexcept { return _mm_xor_si128(a, b); }
+
+	/** 32x32 bit products of all lanes. SSE2 only multiplies the even lanes, so do the odd ones separately. */
+	static void mulhilo(vec a, uint32_t m, vec &hi, vec &lo) noexcept {
+		vec f = set(m), even = _mm_mul_epu32(a, f), odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), f);
+		vec low = _mm_setr_epi32(-1, 0, -1, 0);
+
+		lo = _mm_or_si128(_mm_and_si128(even, low), _mm_slli_epi64(odd, 32));
+		hi = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_andnot_si128(low, odd));
+	}
+
+	/** Store the blocks of all lanes in counter order. */
+	static void store(uint32_t *out, vec x0, vec x1, vec x2, vec x3) noexcept {
+		vec t0 = _mm_unpacklo_epi32(x0, x1), t1 = _mm_unpacklo_epi32(x2, x3);
+		vec t2 = _mm_unpackhi_epi32(x0, x1), t3 = _mm_unpackhi_epi32(x2, x3);
+
+		_mm_storeu_si128((vec*)out, _mm_unpacklo_epi64(t0, t1));
+		_mm_storeu_si128((vec*)(out + 4), _mm_unpackhi_epi64(t0, t1));
+		_mm_storeu_si128((vec*)(out + 8), _mm_unpacklo_epi64(t2, t3));
+		_mm_storeu_si128((vec*)(out + 12), _mm_unpackhi_epi64(t2, t3));
+	}
+};
+
+#else
+
+const char *const random_isa = "scalar";
+
+#endif
+
+/** Compute \a blocks consecutive blocks starting at \a counter. */
+static void fill_blocks(const uint32_t key[2], uint64_t counter, uint64_t stream, uint32_t *out, size_t blocks) noexcept {
+#if RANDOM_AVX2 || RANDOM_SSE2
+	typedef VecOps V;
+	typedef V::vec vec;
+
+	// each lane gets its own counter, which must not carry into the upper half
+	for (; blocks >= V::lanes && (uint32_t)counter <= UINT32_MAX - (V::lanes - 1); blocks -= V::lanes, counter += V::lanes, out += 4 * V::lanes) {
+		vec c0 = V::iota((uint32_t)counter), c1 = V::set((uint32_t)(counter >> 32));
+		vec c2 = V::set((uint32_t)stream), c3 = V::set((uint32_t)(stream >> 32));
+		uint32_t k0 = key[0], k1 = key[1];
+
+		for (unsigned r = 0; r < philox_rounds; ++r) {
+			vec hi0, lo0, hi1, lo1;
+			V::mulhilo(c0, philox_m0, hi0, lo0);
+			V::mulhilo(c2, philox_m1, hi1, lo1);
+
+			c0 = V::xor_(V::xor_(hi1, c1), V::set(k0));
+			c1 = lo1;
+			c2 = V::xor_(V::xor_(hi0, c3), V::set(k1));
+			c3 = lo0;
+
+			k0 += philox_w0;
+			k1 += philox_w1;
+		}
+
+		V::store(out, c0, c1, c2, c3);
+	}
+#endif
+
+	for (; blocks; --blocks, ++counter, out += 4)
+		Philox::generate(key, counter, stream, out);
+}
+
+void Philox::fill(uint32_t *out, size_t n) noexcept {
+	// finish current block first
+	for (; n && (pos & 3); --n)
+		*out++ = next();
+
+	size_t blocks = n / 4;
+	fill_blocks(key, pos >> 2, stream, out, blocks);
+
+	pos += 4 * blocks;
+	out += 4 * blocks;
+	n -= 4 * blocks;
+
+	for (; n; --n)
+		*out++ = next();
+}
+
+}
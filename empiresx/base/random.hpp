@@ -8,6 +8,7 @@
  */
 
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <cmath>
 
@@ -64,4 +65,89 @@ public:
 	}
 };
 
+/** Well known substreams of Philox. */
+enum class RandomStream : uint32_t {
+	game,
+	map,
+	mapgen, /**< index is the region */
+	units, /**< index is the unit handle */
+};
+
+/** Name of the instruction set Philox::fill has been compiled for. */
+extern const char *const random_isa;
+
+/**
+ * Counter based generator Philox4x32-10 by Salmon et al. (Parallel random numbers: as easy as
+ * 1, 2, 3). The n-th number of a stream only depends on the seed, the stream and n, so any
+ * number of independent streams can be used at once in whatever order, e.g. one per thread or
+ * per map region, without any of them affecting the others.
+ */
+class Philox final {
+	uint32_t key[2];
+	uint64_t stream;
+	uint64_t pos; /**< index of next number */
+	uint32_t block[4]; /**< numbers [pos & ~3, (pos & ~3) + 4) */
+public:
+	explicit Philox(uint64_t seed, uint64_t stream=0) noexcept
+		: key{(uint32_t)seed, (uint32_t)(seed >> 32)}, stream(stream), pos(0), block() {}
+
+	Philox(uint64_t seed, RandomStream s, uint32_t index=0) noexcept
+		: Philox(seed, (uint64_t)s << 32 | index) {}
+
+	uint64_t seed() const noexcept { return (uint64_t)key[1] << 32 | key[0]; }
+
+	/** Create stream \a s with the same seed. */
+	Philox substream(RandomStream s, uint32_t index=0) const noexcept {
+		return Philox(seed(), s, index);
+	}
+
+	/** Continue at the \a n-th number of the stream. */
+	void seek(uint64_t n) noexcept {
+		pos = n;
+		if (pos & 3)
+			generate(key, pos >> 2, stream, block);
+	}
+
+	uint64_t tell() const noexcept { return pos; }
+
+	uint32_t next() noexcept {
+		if (!(pos & 3))
+			generate(key, pos >> 2, stream, block);
+		return block[pos++ & 3];
+	}
+
+	/** Return a number in range [0, high]. */
+	uint32_t next(uint32_t high) noexcept { return next(0, high); }
+
+	/**
+	 * Return a number in range [low, high]. This is unbiased and only uses integer arithmetic,
+	 * see Lemire: Fast random integer generation in an interval.
+	 */
+	uint32_t next(uint32_t low, uint32_t high) noexcept {
+		assert(low <= high);
+		uint32_t range = high - low + 1;
+
+		if (!range)
+			return next();
+
+		uint64_t m = (uint64_t)next() * range;
+
+		if ((uint32_t)m < range) {
+			uint32_t t = (0u - range) % range;
+
+			while ((uint32_t)m < t)
+				m = (uint64_t)next() * range;
+		}
+
+		return low + (uint32_t)(m >> 32);
+	}
+
+	/** Store the next \a n numbers of the stream in \a out. This is the same as calling next() \a n times. */
+	void fill(uint32_t *out, size_t n) noexcept;
+
+	/** Compute the four numbers of block \a counter of \a stream. */
+	static void generate(const uint32_t key[2], uint64_t counter, uint64_t stream, uint32_t out[4]) noexcept;
+};
+
 }
+
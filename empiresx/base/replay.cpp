@@ -0,0 +1,212 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "replay.hpp"
+
+#include "lockstep.hpp"
+#include "random.hpp"
+#include "world.hpp"
+
+#include "../endian.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <chrono>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+static const char replay_magic[8] = "AOEREPL";
+
+std::string replay_name(const StartMatch &settings) {
+	char name[64], stamp[32];
+	time_t now = time(NULL);
+	struct tm *tm = localtime(&now);
+
+	if (!tm || !strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S", tm))
+		snprintf(stamp, sizeof stamp, "%lld", (long long)now);
+
+	snprintf(name, sizeof name, "replay-%s-%08X.rec", stamp, (unsigned)settings.seed);
+	return name;
+}
+
+ReplayWriter::ReplayWriter(const char *path, const StartMatch &settings) : mut(), f(fopen(path, "wb")), path(path) {
+	if (!f)
+		throw std::runtime_error(std::string("replay: could not create ") + path + ": " + strerror(errno));
+
+	ReplayHeader hdr;
+	memcpy(hdr.magic, replay_magic, sizeof hdr.magic);
+	hdr.version = htobe32(replay_version);
+	hdr.reserved = 0;
+
+	StartMatch copy(settings);
+	Command cmd = Command::start(copy);
+
+	if (fwrite(&hdr, sizeof hdr, 1, f) != 1 || !put(cmd)) {
+		fclose(f);
+		throw std::runtime_error(std::string("replay: could not write ") + path);
+	}
+}
+
+ReplayWriter::~ReplayWriter() {
+	if (f)
+		fclose(f);
+}
+
+bool ReplayWriter::put(Command &cmd) {
+	size_t size = CMD_HDRSZ + cmd.length;
+	cmd.hton();
+	return fwrite(&cmd, size, 1, f) == 1;
+}
+
+void ReplayWriter::write(Command cmd) {
+	std::lock_guard<std::mutex> lock(mut);
+
+	if (!f)
+		return;
+
+	bool flush = cmd.type == (uint16_t)CmdType::turn_done;
+
+	// flush complete turns, so the replay is still useful if we crash
+	if (put(cmd) && (!flush || !fflush(f)))
+		return;
+
+	fprintf(stderr, "replay: could not write %s, recording stopped\n", path.c_str());
+	fclose(f);
+	f = nullptr;
+}
+
+ReplayReader::ReplayReader(const char *path) : f(fopen(path, "rb")), settings() {
+	if (!f)
+		throw std::runtime_error(std::string("replay: could not open ") + path + ": " + strerror(errno));
+
+	ReplayHeader hdr;
+	Command cmd;
+
+	try {
+		if (fread(&hdr, sizeof hdr, 1, f) != 1 || memcmp(hdr.magic, replay_magic, sizeof hdr.magic))
+			throw std::runtime_error(std::string("replay: not a replay: ") + path);
+
+		if (be32toh(hdr.version) != replay_version)
+			throw std::runtime_error(std::string("replay: unsupported version ") + std::to_string(be32toh(hdr.version)));
+
+		if (!next(cmd) || cmd.type != (uint16_t)CmdType::start)
+			throw std::runtime_error("replay: missing match settings");
+	} catch (const std::runtime_error&) {
+		fclose(f);
+		throw;
+	}
+
+	settings = cmd.data.start;
+}
+
+ReplayReader::~ReplayReader() {
+	fclose(f);
+}
+
+bool ReplayReader::next(Command &cmd) {
+	if (fread(&cmd, CMD_HDRSZ, 1, f) != 1)
+		return false;
+
+	uint16_t type = be16toh(cmd.type), length = be16toh(cmd.length);
+	size_t expect;
+
+	// only commands that are recorded are accepted
+	switch ((CmdType)type) {
+	case CmdType::start: expect = sizeof(StartMatch); break;
+	case CmdType::order: expect = sizeof(Order); break;
+	case CmdType::turn_done: expect = sizeof(TurnDone); break;
+	case CmdType::checksum: expect = sizeof(Checksum); break;
+	default:
+		throw std::runtime_error(std::string("replay: bad command type ") + std::to_string(type));
+	}
+
+	if (length != expect)
+		throw std::runtime_error(std::string("replay: bad length for command type ") + std::to_string(type));
+
+	if (fread((char*)&cmd + CMD_HDRSZ, length, 1, f) != 1)
+		return false;
+
+	cmd.ntoh();
+	return true;
+}
+
+ReplayStats replay(const char *path, unsigned threads) {
+	ReplayReader in(path);
+	Philox rng(in.settings.seed);
+	World world(rng, in.settings, true, threads);
+	TurnScheduler turns;
+	std::vector<Order> orders;
+	std::map<uint32_t, uint64_t> sums; /**< our own checksums that have not been compared yet */
+	ReplayStats stats{0, 0, 0, 0, UINT32_MAX, 0, 0};
+	Command cmd;
+
+	world.populate(in.settings.slave_count);
+
+	auto start = std::chrono::steady_clock::now();
+
+	while (in.next(cmd)) {
+		switch ((CmdType)cmd.type) {
+		case CmdType::order:
+			turns.receive(cmd.data.order);
+			++stats.orders;
+			break;
+		case CmdType::turn_done: {
+			uint32_t end;
+			turns.receive(cmd.data.turn_done);
+
+			// same as Game::tick without animations, but as long as the recorded turns last instead of the wall clock
+			while (turns.begin(orders)) {
+				world.apply(orders);
+				orders.clear();
+				world.tick();
+
+				if (world.ticks() % checksum_ticks == 0) {
+					sums.emplace(world.ticks(), world.checksum());
+					if (sums.size() > checksum_keep)
+						sums.erase(sums.begin());
+				}
+
+				if (turns.end(end))
+					++stats.turns;
+			}
+			break;
+		}
+		case CmdType::checksum: {
+			// the recorded checksum is always written after the turn that contains its tick
+			uint32_t tick = cmd.data.checksum.tick;
+			auto search = sums.find(tick);
+
+			if (search == sums.end())
+				break;
+
+			uint64_t hash = (uint64_t)cmd.data.checksum.hash[1] << 32 | cmd.data.checksum.hash[0];
+
+			if (hash != search->second && stats.desync == UINT32_MAX)
+				stats.desync = tick;
+
+			++stats.checksums;
+			sums.erase(sums.begin(), ++search);
+			break;
+		}
+		default:
+			throw std::runtime_error(std::string("replay: unexpected command type ") + std::to_string(cmd.type));
+		}
+	}
+
+	std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+	stats.ticks = world.ticks();
+	stats.checksum = world.checksum();
+	stats.seconds = diff.count();
+	return stats;
+}
+
+}
+
+}
@@ -0,0 +1,92 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Match replays. Since every peer computes the same world from the same orders, a replay only
+ * has to contain the match settings and the stream of orders and turn markers as broadcasted by
+ * the server. The world checksums are recorded as well, so playback can tell whether it still
+ * computes the same world. Everything is stored as network commands in network byte order:
+ * a short header, the start command and any number of order, turn_done and checksum commands.
+ */
+
+#include "net.hpp"
+
+#include <cstdint>
+#include <cstdio>
+
+#include <mutex>
+#include <string>
+
+namespace genie {
+
+namespace game {
+
+/** Increment whenever the replay format or the simulation changes in a way that old replays run out of sync. */
+static constexpr uint32_t replay_version = 6;
+
+struct ReplayHeader final {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+/** Default file name for a replay of a match started now with \a settings. */
+std::string replay_name(const StartMatch &settings);
+
+/** Appends commands to a replay. May be shared by the network thread and the simulation. */
+class ReplayWriter final {
+	std::mutex mut;
+	FILE *f;
+	std::string path;
+public:
+	/** Create replay \a path for a match with \a settings. Throws std::runtime_error if it cannot be created. */
+	ReplayWriter(const char *path, const StartMatch &settings);
+	~ReplayWriter();
+
+	ReplayWriter(const ReplayWriter&) = delete;
+	ReplayWriter &operator=(const ReplayWriter&) = delete;
+
+	/** Append \a cmd in host byte order. Any write error is reported once and stops the recording. */
+	void write(Command cmd);
+private:
+	bool put(Command &cmd);
+};
+
+class ReplayReader final {
+	FILE *f;
+public:
+	StartMatch settings;
+
+	/** Open replay \a path. Throws std::runtime_error if it cannot be read or if it is not compatible. */
+	explicit ReplayReader(const char *path);
+	~ReplayReader();
+
+	ReplayReader(const ReplayReader&) = delete;
+	ReplayReader &operator=(const ReplayReader&) = delete;
+
+	/**
+	 * Read next command in host byte order. Returns false at the end of the replay, which may cut
+	 * off the last command if the recording peer crashed. Throws std::runtime_error if it is damaged.
+	 */
+	bool next(Command &cmd);
+};
+
+struct ReplayStats final {
+	uint32_t ticks, turns;
+	size_t orders;
+	unsigned checksums; /**< number of recorded checksums that have been verified */
+	uint32_t desync; /**< first tick whose checksum differs from the recording or UINT32_MAX */
+	uint64_t checksum; /**< world checksum after the last tick */
+	double seconds; /**< time spent simulating, excluding the setup of the world */
+};
+
+/**
+ * Simulate replay \a path as fast as possible on \a threads worker threads in addition to the
+ * calling thread. Throws std::runtime_error if the replay cannot be read.
+ */
+ReplayStats replay(const char *path, unsigned threads=0);
+
+}
+
+}
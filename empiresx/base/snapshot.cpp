@@ -0,0 +1,173 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "snapshot.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#if windows
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace genie {
+
+namespace game {
+
+static const char snapshot_magic[8] = "AOESNAP";
+
+static constexpr uint64_t align(uint64_t v) noexcept {
+	return (v + snapshot_align - 1) & ~(uint64_t)(snapshot_align - 1);
+}
+
+size_t SnapshotWriter::write(const char *path) const {
+	SnapshotHeader hdr;
+	std::vector<SnapshotEntry> table(chunks.size());
+
+	memcpy(hdr.magic, snapshot_magic, sizeof hdr.magic);
+	hdr.version = snapshot_version;
+	hdr.order = snapshot_order;
+	hdr.sections = (uint32_t)chunks.size();
+	hdr.reserved = 0;
+
+	// lay out everything first, so the file is written front to back
+	uint64_t pos = align(sizeof hdr + table.size() * sizeof(SnapshotEntry));
+
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		const Chunk &c = chunks[i];
+		table[i] = SnapshotEntry{c.id, c.elem, pos, c.count};
+		pos = align(pos + c.count * c.elem);
+	}
+
+	hdr.size = pos;
+
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		throw std::runtime_error(std::string("snapshot: cannot create ") + path + ": " + strerror(errno));
+
+	static const uint8_t zero[snapshot_align] = {0};
+	bool good = fwrite(&hdr, sizeof hdr, 1, f) == 1 && fwrite(table.data(), sizeof(SnapshotEntry), table.size(), f) == table.size();
+	uint64_t at = sizeof hdr + table.size() * sizeof(SnapshotEntry);
+
+	for (size_t i = 0; good && i < chunks.size(); ++i) {
+		size_t bytes = chunks[i].count * chunks[i].elem;
+
+		good = fwrite(zero, 1, table[i].offset - at, f) == table[i].offset - at && fwrite(chunks[i].data, 1, bytes, f) == bytes;
+		at = table[i].offset + bytes;
+	}
+
+	good = good && fwrite(zero, 1, hdr.size - at, f) == hdr.size - at;
+
+	if (fclose(f) || !good)
+		throw std::runtime_error(std::string("snapshot: cannot write ") + path);
+
+	return (size_t)hdr.size;
+}
+
+SnapshotReader::SnapshotReader(const char *path) : base(nullptr), length(0), table(nullptr), sections(0) {
+#if windows
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error(std::string("snapshot: cannot open ") + path);
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || !(mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL))) {
+		CloseHandle(file);
+		throw std::runtime_error(std::string("snapshot: cannot map ") + path);
+	}
+
+	length = (size_t)size.QuadPart;
+	base = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+	if (!base) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		throw std::runtime_error(std::string("snapshot: cannot map ") + path);
+	}
+#else
+	if ((fd = open(path, O_RDONLY)) == -1)
+		throw std::runtime_error(std::string("snapshot: cannot open ") + path + ": " + strerror(errno));
+
+	struct stat st;
+	void *map = MAP_FAILED;
+
+	if (!fstat(fd, &st) && st.st_size > 0)
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map == MAP_FAILED) {
+		close(fd);
+		throw std::runtime_error(std::string("snapshot: cannot map ") + path);
+	}
+
+	length = (size_t)st.st_size;
+	base = (const uint8_t*)map;
+	// everything is read right away
+	madvise(map, length, MADV_WILLNEED);
+#endif
+
+	const SnapshotHeader *hdr = (const SnapshotHeader*)base;
+	const char *error = nullptr;
+
+	if (length < sizeof *hdr || memcmp(hdr->magic, snapshot_magic, sizeof hdr->magic))
+		error = "not a snapshot";
+	else if (hdr->order != snapshot_order)
+		error = "snapshot has been created on a host with another byte order";
+	else if (hdr->version != snapshot_version)
+		error = "unsupported snapshot version";
+	else if (hdr->size != length || (length - sizeof *hdr) / sizeof(SnapshotEntry) < hdr->sections)
+		error = "truncated snapshot";
+
+	if (!error) {
+		table = (const SnapshotEntry*)(base + sizeof *hdr);
+		sections = hdr->sections;
+
+		for (uint32_t i = 0; i < sections && !error; ++i) {
+			const SnapshotEntry &e = table[i];
+
+			if (e.offset % snapshot_align || e.offset > length || (length - e.offset) / (e.elem ? e.elem : 1) < e.count)
+				error = "corrupt section table";
+		}
+	}
+
+	if (error) {
+		unmap();
+		throw std::runtime_error(std::string(path) + ": " + error);
+	}
+}
+
+SnapshotReader::~SnapshotReader() {
+	unmap();
+}
+
+void SnapshotReader::unmap() noexcept {
+	if (!base)
+		return;
+
+#if windows
+	UnmapViewOfFile(base);
+	CloseHandle(mapping);
+	CloseHandle(file);
+#else
+	munmap((void*)base, length);
+	close(fd);
+#endif
+	base = nullptr;
+}
+
+const SnapshotEntry &SnapshotReader::find(SnapshotSection id) const {
+	for (uint32_t i = 0; i < sections; ++i)
+		if (table[i].id == (uint32_t)id)
+			return table[i];
+
+	throw std::runtime_error(std::string("snapshot: missing section ") + std::to_string((uint32_t)id));
+}
+
+}
+
+}
@@ -0,0 +1,229 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Binary snapshots of the simulation state, e.g. for save games, players that join a match in
+ * progress and recovering a crashed server. A snapshot consists of a header, a table of sections
+ * and the sections themselves, each aligned to snapshot_align bytes. Every section is a flat array
+ * of plain data: objects refer to each other by index, never by pointer. Most sections are the
+ * columns of Units as is, so saving is a series of large writes and loading maps the file and
+ * copies each column in one go. Anything that follows from the state, like the occupancy and the
+ * HPA* graph, is rebuilt after loading.
+ *
+ * Snapshots are stored in native byte order and are rejected by hosts with a different one.
+ */
+
+#include "../os_macros.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+/** Increment whenever the layout of any section changes. */
+static constexpr uint32_t snapshot_version = 8;
+static constexpr size_t snapshot_align = 64;
+/** Byte order marker: reads back differently on hosts with another byte order. */
+static constexpr uint32_t snapshot_order = 0x01020304;
+
+enum class SnapshotSection : uint32_t {
+	meta,
+	terrain_chunks, /**< index of each terrain chunk that differs from the generated one */
+	terrain_data, /**< tiles and heights of these chunks */
+	resources,
+	buildings,
+	// unit columns
+	unit_x,
+	unit_y,
+	unit_target_x,
+	unit_target_y,
+	unit_movespeed,
+	unit_goal_x,
+	unit_goal_y,
+	unit_path,
+	unit_dir,
+	unit_image,
+	unit_hp,
+	unit_hp_max,
+	unit_foe, /**< UnitRef or no_unit */
+	unit_cooldown,
+	unit_type,
+	unit_anim,
+	unit_dir_images,
+	unit_color,
+	unit_ref,
+	unit_slots, /**< slot of each unit handle, see SlotMap */
+	unit_freelist,
+	unit_flow, /**< index in flows or snapshot_none */
+	unit_route, /**< index in routes or snapshot_none */
+	flows,
+	flow_dirs, /**< directions of all flows, each map sized */
+	routes,
+	route_abstract,
+	route_tiles,
+	paths,
+	path_units,
+	stat_modifiers,
+	explored, /**< bitset of explored tiles of each player */
+	production, /**< queued unit types of all buildings in building order */
+	timers,
+	building_slots, /**< slot of each building handle, see SlotMap */
+	building_freelist,
+	resource_slots,
+	resource_freelist,
+	forest, /**< TileResource of each tree */
+};
+
+static constexpr uint32_t snapshot_none = UINT32_MAX;
+
+struct SnapshotHeader final {
+	char magic[8];
+	uint32_t version;
+	uint32_t order; /**< snapshot_order as written by the host that created the snapshot */
+	uint32_t sections;
+	uint32_t reserved;
+	uint64_t size; /**< size of the complete file in bytes */
+};
+
+struct SnapshotEntry final {
+	uint32_t id;
+	uint32_t elem; /**< size of one element in bytes, which catches most layout changes */
+	uint64_t offset, count;
+};
+
+struct SnapshotMeta final {
+	uint32_t tick;
+	uint32_t map_w, map_h;
+	uint32_t next_path; /**< id of the next path request */
+	uint32_t players; /**< number of players with stats */
+	uint32_t next_timer; /**< sequence number of the next timer */
+	uint32_t reserved[2];
+	uint64_t checksum; /**< World::checksum, which must match after loading */
+};
+
+struct ResourceRecord final {
+	float left, top;
+	uint32_t type, anim, image, amount;
+};
+
+struct BuildingRecord final {
+	float left, top;
+	uint32_t type, player, hp, hp_max;
+	uint32_t ready; /**< tick at which the front of the queue is done */
+	uint32_t queued; /**< number of units in the queue */
+};
+
+struct FlowRecord final {
+	uint32_t dest;
+};
+
+struct RouteRecord final {
+	uint32_t next, step;
+	uint32_t abstract, tiles; /**< number of waypoints and tiles */
+};
+
+struct PathRecord final {
+	uint32_t id, due, start, goal;
+	uint32_t single;
+	uint32_t units; /**< number of units waiting for it */
+};
+
+/** Collects sections and writes them in one go. */
+class SnapshotWriter final {
+	struct Chunk final {
+		uint32_t id, elem;
+		const void *data;
+		size_t count;
+	};
+
+	std::vector<Chunk> chunks;
+	std::vector<std::unique_ptr<uint8_t[]>> owned;
+public:
+	SnapshotWriter() : chunks(), owned() {}
+
+	/** Add \a count elements at \a data as section \a id. The data must remain valid until the snapshot is written. */
+	template<typename T> void add(SnapshotSection id, const T *data, size_t count) {
+		static_assert(std::is_trivially_copyable<T>::value, "sections must be plain data");
+		chunks.emplace_back(Chunk{(uint32_t)id, (uint32_t)sizeof(T), data, count});
+	}
+
+	template<typename T> void add(SnapshotSection id, const std::vector<T> &v) {
+		add(id, v.data(), v.size());
+	}
+
+	/** Allocate section \a id with \a count elements that is owned by the writer. */
+	template<typename T> T *alloc(SnapshotSection id, size_t count) {
+		owned.emplace_back(new uint8_t[count * sizeof(T)]);
+		T *data = reinterpret_cast<T*>(owned.back().get());
+		add(id, data, count);
+		return data;
+	}
+
+	/** Write snapshot to \a path and return its size in bytes. Throws std::runtime_error on failure. */
+	size_t write(const char *path) const;
+};
+
+/** Maps a snapshot in memory. Throws std::runtime_error if it cannot be read or if it is not compatible. */
+class SnapshotReader final {
+	const uint8_t *base;
+	size_t length;
+#if windows
+	void *file, *mapping;
+#else
+	int fd;
+#endif
+	const SnapshotEntry *table;
+	uint32_t sections;
+public:
+	explicit SnapshotReader(const char *path);
+	~SnapshotReader();
+
+	SnapshotReader(const SnapshotReader&) = delete;
+	SnapshotReader &operator=(const SnapshotReader&) = delete;
+
+	size_t size() const noexcept { return length; }
+
+	/** Elements of section \a id. The section must exist and contain elements of type \a T. */
+	template<typename T> const T *get(SnapshotSection id, size_t &count) const {
+		const SnapshotEntry &e = find(id);
+
+		if (e.elem != sizeof(T))
+			throw std::runtime_error(std::string("snapshot: bad element size in section ") + std::to_string(e.id));
+
+		count = (size_t)e.count;
+		return reinterpret_cast<const T*>(base + e.offset);
+	}
+
+	/** Get section \a id, which must contain exactly \a count elements. */
+	template<typename T> const T *get(SnapshotSection id, size_t count, const char *what) const {
+		size_t n;
+		const T *data = get<T>(id, n);
+
+		if (n != count)
+			throw std::runtime_error(std::string("snapshot: bad number of ") + what);
+
+		return data;
+	}
+
+	template<typename T> void get(SnapshotSection id, std::vector<T> &v) const {
+		size_t n;
+		const T *data = get<T>(id, n);
+		v.assign(data, data + n);
+	}
+private:
+	const SnapshotEntry &find(SnapshotSection id) const;
+	void unmap() noexcept;
+};
+
+}
+
+}
@@ -0,0 +1,64 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "stats.hpp"
+
+#include <algorithm>
+
+namespace genie {
+
+namespace game {
+
+void PlayerStats::reserve(unsigned n) {
+	for (; players < n; ++players)
+		for (unsigned t = 0; t < unit_type_count; ++t)
+			table.emplace_back(unit_base((UnitType)t));
+}
+
+void PlayerStats::clear() noexcept {
+	players = 0;
+	table.clear();
+	mods.clear();
+}
+
+/** Scale \a v by \a percent and add \a add. Integer math only, so all peers get the same result. */
+template<typename T> static void adjust(T &v, int32_t percent, int32_t add, int64_t max) noexcept {
+	int64_t r = (int64_t)v * percent / 100 + add;
+	v = (T)std::min<int64_t>(std::max<int64_t>(r, 0), max);
+}
+
+static void apply(UnitStats &s, Stat stat, int32_t percent, int32_t add) noexcept {
+	switch (stat) {
+	case Stat::hp: adjust(s.hp, percent, add, UINT16_MAX); break;
+	case Stat::attack: adjust(s.attack, percent, add, UINT16_MAX); break;
+	case Stat::reload: adjust(s.reload, percent, add, UINT16_MAX); break;
+	case Stat::train_time: adjust(s.train_time, percent, add, UINT16_MAX); break;
+	case Stat::melee_armor: adjust(s.melee_armor, percent, add, UINT8_MAX); break;
+	case Stat::pierce_armor: adjust(s.pierce_armor, percent, add, UINT8_MAX); break;
+	case Stat::los: adjust(s.los, percent, add, UINT8_MAX); break;
+	case Stat::range: adjust(s.range, percent, add, UINT8_MAX); break;
+	case Stat::speed: adjust(s.speed, percent, add, INT32_MAX); break;
+	case Stat::cost_wood: adjust(s.cost[(unsigned)ResourceType::wood], percent, add, UINT16_MAX); break;
+	case Stat::cost_food: adjust(s.cost[(unsigned)ResourceType::food], percent, add, UINT16_MAX); break;
+	case Stat::cost_gold: adjust(s.cost[(unsigned)ResourceType::gold], percent, add, UINT16_MAX); break;
+	case Stat::cost_stone: adjust(s.cost[(unsigned)ResourceType::stone], percent, add, UINT16_MAX); break;
+	case Stat::max: break;
+	}
+}
+
+bool PlayerStats::modify(const StatModifier &m) {
+	if (m.player >= players || (m.unit >= unit_type_count && m.unit != stat_all_units) || m.stat >= Stat::max || m.percent < 0)
+		return false;
+
+	UnitStats *row = &table[(size_t)m.player * unit_type_count];
+
+	for (unsigned t = 0; t < unit_type_count; ++t)
+		if (m.unit == stat_all_units || m.unit == t)
+			apply(row[t], m.stat, m.percent, m.add);
+
+	mods.emplace_back(m);
+	return true;
+}
+
+}
+
+}
@@ -0,0 +1,164 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Unit and building stats. The base stats of units are generated at build time from the
+ * table of the original game manual (doc/reverse_engineering/unit_stats_aoe.csv). Techs and
+ * handicaps change them per player with modifiers that are applied in order. The effective
+ * stats of all players are kept in one flat table, so looking up a stat is a single load.
+ */
+
+#include "math.hpp"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+enum class ResourceType {
+	wood,
+	food,
+	gold,
+	stone,
+};
+
+enum class UnitType {
+	villager,
+	clubman,
+};
+
+static constexpr unsigned unit_type_count = 2;
+
+enum class BuildingType {
+	barracks,
+	town_center
+};
+
+static constexpr unsigned building_type_count = 2;
+
+enum class AttackType : uint8_t {
+	none,
+	melee,
+	pierce,
+};
+
+enum class SpeedClass : uint8_t {
+	slow,
+	medium,
+	fast,
+};
+
+/** Movement speed in tiles per tick. */
+static constexpr fixed speed_of(SpeedClass s) noexcept {
+	return s == SpeedClass::slow ? to_fixed(0.35f) : s == SpeedClass::medium ? to_fixed(0.5f) : to_fixed(0.7f);
+}
+
+struct UnitStats final {
+	uint16_t hp, attack;
+	uint16_t reload; /**< time between attacks in milliseconds */
+	uint16_t train_time; /**< in seconds */
+	uint8_t melee_armor, pierce_armor;
+	uint8_t los, range, accuracy;
+	AttackType attack_type;
+	SpeedClass speed_class;
+	uint8_t age; /**< first age in which the unit is available, starting at 1 */
+	uint16_t cost[4]; /**< indexed by ResourceType */
+	fixed speed; /**< tiles per tick */
+};
+
+}
+
+}
+
+#include "unit_stats_aoe.hpp"
+
+namespace genie {
+
+namespace game {
+
+/** Row of each UnitType in unit_stats_aoe. */
+static constexpr UnitRow unit_rows[] = {
+	UnitRow::villager,
+	UnitRow::clubman,
+};
+
+static_assert(sizeof unit_rows / sizeof unit_rows[0] == unit_type_count, "every unit type needs stats");
+
+static constexpr const UnitStats &unit_base(UnitType t) noexcept {
+	return unit_stats_aoe[(unsigned)unit_rows[(unsigned)t]];
+}
+
+struct BuildingStats final {
+	uint16_t hp;
+	uint8_t size; /**< footprint in tiles along either axis */
+};
+
+static constexpr BuildingStats building_stats[] = {
+	{350, 3}, // barracks
+	{600, 3}, // town center
+};
+
+static_assert(sizeof building_stats / sizeof building_stats[0] == building_type_count, "every building type needs stats");
+
+enum class Stat : uint32_t {
+	hp,
+	attack,
+	reload,
+	train_time,
+	melee_armor,
+	pierce_armor,
+	los,
+	range,
+	speed,
+	cost_wood,
+	cost_food,
+	cost_gold,
+	cost_stone,
+	max,
+};
+
+static constexpr uint32_t stat_all_units = UINT32_MAX;
+
+/** Change of one stat of one or all unit types of a player, e.g. by a tech or a handicap. */
+struct StatModifier final {
+	uint32_t player;
+	uint32_t unit; /**< UnitType or stat_all_units */
+	Stat stat;
+	int32_t percent; /**< scales the stat first, 100 leaves it as is */
+	int32_t add; /**< in the unit of the stat, so raw fixed point for speed */
+};
+
+/** Effective unit stats of all players. */
+class PlayerStats final {
+	unsigned players;
+	std::vector<UnitStats> table; /**< indexed by player * unit_type_count + UnitType */
+	std::vector<StatModifier> mods; /**< in order of application */
+public:
+	PlayerStats() : players(0), table(), mods() {}
+
+	unsigned size() const noexcept { return players; }
+
+	/** Make room for at least \a n players. New players start with the base stats. */
+	void reserve(unsigned n);
+	void clear() noexcept;
+
+	/** Apply \a m on top of all modifiers that have been applied before. Returns false if it is invalid. */
+	bool modify(const StatModifier &m);
+
+	const UnitStats &unit(unsigned player, UnitType t) const noexcept {
+		assert(player < players);
+		return table[(size_t)player * unit_type_count + (unsigned)t];
+	}
+
+	const std::vector<StatModifier> &modifiers() const noexcept { return mods; }
+};
+
+}
+
+}
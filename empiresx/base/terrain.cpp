@@ -0,0 +1,217 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "terrain.hpp"
+
+#include <cstring>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace genie {
+
+namespace game {
+
+/** Tiles followed by heights of one chunk. */
+static constexpr size_t chunk_bytes = 2 * chunk_area;
+
+/**
+ * Run-length encode \a n bytes at \a src as PackBits: a control byte c < 128 is followed by
+ * c + 1 literal bytes and a control byte c > 128 by a single byte that is repeated 257 - c times.
+ */
+static void pack(std::vector<uint8_t> &dst, const uint8_t *src, size_t n) {
+	dst.clear();
+
+	for (size_t i = 0; i < n;) {
+		size_t run = 1;
+		while (i + run < n && run < 128 && src[i + run] == src[i])
+			++run;
+
+		if (run > 1) {
+			dst.emplace_back((uint8_t)(257 - run));
+			dst.emplace_back(src[i]);
+			i += run;
+			continue;
+		}
+
+		// literals up to the next run of at least three bytes
+		size_t lit = 1;
+		while (i + lit < n && lit < 128 && !(i + lit + 2 < n && src[i + lit] == src[i + lit + 1] && src[i + lit] == src[i + lit + 2]))
+			++lit;
+
+		dst.emplace_back((uint8_t)(lit - 1));
+		dst.insert(dst.end(), src + i, src + i + lit);
+		i += lit;
+	}
+
+	dst.shrink_to_fit();
+}
+
+static void unpack(uint8_t *dst, const std::vector<uint8_t> &src) {
+	size_t o = 0;
+
+	for (size_t i = 0; i < src.size();) {
+		uint8_t c = src[i++];
+
+		if (c < 128) {
+			memcpy(dst + o, &src[i], c + 1u);
+			i += c + 1u;
+			o += c + 1u;
+		} else if (c > 128) {
+			memset(dst + o, src[i++], 257u - c);
+			o += 257u - c;
+		}
+	}
+
+	assert(o == chunk_bytes);
+}
+
+Terrain::Terrain(const Philox &rng, unsigned w, unsigned h, unsigned kinds, TileLayout layout)
+	: w(w), h(h), cols((w + chunk_size - 1) >> chunk_bits), rows((h + chunk_size - 1) >> chunk_bits), kinds(kinds), layout(layout)
+	, rng(rng), chunks((size_t)cols * rows), packed((size_t)cols * rows), resident(0), budget(0), clock(0) {}
+
+void Terrain::limit(size_t n) {
+	budget = n;
+
+	if (budget && resident > budget)
+		evict(budget);
+}
+
+void Terrain::generate(size_t i, Chunk &c) const {
+	uint32_t r[chunk_area];
+	Philox(rng.substream(RandomStream::map, (uint32_t)i)).fill(r, chunk_area);
+
+	// scale to [0, kinds) without division. numbers are drawn row by row regardless of the layout
+	for (unsigned k = 0; k < chunk_area; ++k)
+		c.tiles[offset(k % chunk_size, k / chunk_size)] = (uint8_t)((uint64_t)r[k] * kinds >> 32);
+
+	// TODO support heightmaps
+	memset(c.heights, 0, sizeof c.heights);
+	c.dirty = false;
+}
+
+void Terrain::get_rows(const Chunk &c, uint8_t *dst) const noexcept {
+	for (unsigned y = 0, k = 0; y < chunk_size; ++y)
+		for (unsigned x = 0; x < chunk_size; ++x, ++k) {
+			unsigned i = offset(x, y);
+			dst[k] = c.tiles[i];
+			dst[chunk_area + k] = c.heights[i];
+		}
+}
+
+void Terrain::set_rows(Chunk &c, const uint8_t *src) const noexcept {
+	for (unsigned y = 0, k = 0; y < chunk_size; ++y)
+		for (unsigned x = 0; x < chunk_size; ++x, ++k) {
+			unsigned i = offset(x, y);
+			c.tiles[i] = src[k];
+			c.heights[i] = src[chunk_area + k];
+		}
+}
+
+Chunk &Terrain::make(size_t i) {
+	if (budget && resident >= budget)
+		evict(budget - budget / 4 - 1);
+
+	std::unique_ptr<Chunk> c(new Chunk);
+
+	if (packed[i].empty()) {
+		generate(i, *c);
+	} else {
+		uint8_t buf[chunk_bytes];
+		unpack(buf, packed[i]);
+		set_rows(*c, buf);
+		c->dirty = true;
+		std::vector<uint8_t>().swap(packed[i]);
+	}
+
+	++resident;
+	chunks[i] = std::move(c);
+	return *chunks[i];
+}
+
+void Terrain::evict(size_t keep) {
+	if (resident <= keep)
+		return;
+
+	std::vector<std::pair<uint64_t, size_t>> lru;
+	lru.reserve(resident);
+
+	for (size_t i = 0; i < chunks.size(); ++i)
+		if (chunks[i])
+			lru.emplace_back(chunks[i]->used, i);
+
+	size_t drop = resident - keep;
+	std::nth_element(lru.begin(), lru.begin() + (drop - 1), lru.end());
+
+	for (size_t k = 0; k < drop; ++k) {
+		size_t i = lru[k].second;
+		Chunk &c = *chunks[i];
+
+		// unchanged chunks are generated again, so only keep the changed ones
+		if (c.dirty) {
+			uint8_t buf[chunk_bytes];
+			get_rows(c, buf);
+			pack(packed[i], buf, chunk_bytes);
+		}
+
+		chunks[i].reset();
+	}
+
+	resident = keep;
+}
+
+void Terrain::save(SnapshotWriter &w) const {
+	std::vector<uint32_t> dirty;
+
+	for (size_t i = 0; i < chunks.size(); ++i)
+		if (chunks[i] ? chunks[i]->dirty : !packed[i].empty())
+			dirty.emplace_back((uint32_t)i);
+
+	uint32_t *idx = w.alloc<uint32_t>(SnapshotSection::terrain_chunks, dirty.size());
+	uint8_t *data = w.alloc<uint8_t>(SnapshotSection::terrain_data, dirty.size() * chunk_bytes);
+
+	for (uint32_t i : dirty) {
+		*idx++ = i;
+
+		if (chunks[i])
+			get_rows(*chunks[i], data);
+		else
+			unpack(data, packed[i]);
+
+		data += chunk_bytes;
+	}
+}
+
+void Terrain::load(const SnapshotReader &snap) {
+	size_t n;
+	const uint32_t *idx = snap.get<uint32_t>(SnapshotSection::terrain_chunks, n);
+	const uint8_t *data = snap.get<uint8_t>(SnapshotSection::terrain_data, n * chunk_bytes, "terrain chunks");
+
+	for (size_t k = 0; k < n; ++k)
+		if (idx[k] >= chunks.size() || (k && idx[k] <= idx[k - 1]))
+			throw std::runtime_error("snapshot: bad terrain chunk");
+
+	for (auto &c : chunks)
+		c.reset();
+	for (auto &p : packed)
+		std::vector<uint8_t>().swap(p);
+
+	resident = 0;
+
+	for (size_t k = 0; k < n; ++k, data += chunk_bytes) {
+		std::unique_ptr<Chunk> c(new Chunk);
+
+		set_rows(*c, data);
+		c->used = 0;
+		c->dirty = true;
+
+		chunks[idx[k]] = std::move(c);
+		++resident;
+	}
+
+	if (budget && resident > budget)
+		evict(budget);
+}
+
+}
+
+}
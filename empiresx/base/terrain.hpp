@@ -0,0 +1,188 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Tiles and heights of the map in chunks of 64x64 tiles. A chunk is generated from its own
+ * random substream the first time any of its tiles is looked at, so it does not matter in
+ * which order chunks are made and huge maps only cost memory for the area that has been
+ * looked at. With a limit on the number of resident chunks, the least recently used ones
+ * are paged out: chunks that have not been changed are simply made again when needed and
+ * changed ones are kept run-length encoded.
+ *
+ * Within a chunk, tiles are either stored row by row or in Morton order, which interleaves
+ * the bits of x and y such that every aligned 2^k x 2^k square is contiguous. The latter keeps
+ * the tiles around any spot close together for stencils like lines of sight and footprints.
+ * Only the accessors below know the layout, and snapshots always store chunks row by row.
+ */
+
+#include "random.hpp"
+#include "snapshot.hpp"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+static constexpr unsigned chunk_bits = 6, chunk_size = 1u << chunk_bits, chunk_area = chunk_size * chunk_size;
+
+enum class TileLayout {
+	rows,
+	morton,
+};
+
+/** Spread the bits of \a v < chunk_size to the even bits of the result. */
+static constexpr unsigned morton_spread(unsigned v) noexcept {
+	v = (v | v << 4) & 0x0f0f;
+	v = (v | v << 2) & 0x3333;
+	return (v | v << 1) & 0x5555;
+}
+
+/** morton_spread of all coordinates within a chunk, which is cheaper than spreading the bits each time. */
+struct MortonTable final {
+	uint16_t v[chunk_size];
+
+	constexpr MortonTable() : v() {
+		for (unsigned i = 0; i < chunk_size; ++i)
+			v[i] = (uint16_t)morton_spread(i);
+	}
+
+	constexpr unsigned operator[](unsigned i) const noexcept { return v[i]; }
+};
+
+static constexpr MortonTable morton_table;
+
+struct Chunk final {
+	uint8_t tiles[chunk_area], heights[chunk_area]; // in the layout of the terrain
+	uint64_t used; /**< when any of its tiles has been looked at last */
+	bool dirty; /**< whether it differs from what would be generated */
+};
+
+class Terrain final {
+	unsigned w, h, cols, rows;
+	unsigned kinds; /**< generated tiles are in [0, kinds) */
+	TileLayout layout;
+	Philox rng;
+	std::vector<std::unique_ptr<Chunk>> chunks;
+	std::vector<std::vector<uint8_t>> packed; /**< changed chunks that have been paged out, row by row */
+	size_t resident, budget; /**< most chunks in memory, or zero if unlimited */
+	uint64_t clock;
+public:
+	Terrain(const Philox &rng, unsigned w, unsigned h, unsigned kinds, TileLayout layout=TileLayout::rows);
+
+	unsigned chunk_cols() const noexcept { return cols; }
+	unsigned chunk_rows() const noexcept { return rows; }
+	/** Number of chunks in memory that are not paged out. */
+	size_t size() const noexcept { return resident; }
+
+	/** Keep at most \a n chunks in memory, or any number if zero. */
+	void limit(size_t n);
+
+	TileLayout tile_layout() const noexcept { return layout; }
+
+	/** Position of tile \a x, \a y within its chunk. */
+	unsigned offset(unsigned x, unsigned y) const noexcept {
+		x &= chunk_size - 1;
+		y &= chunk_size - 1;
+		return layout == TileLayout::morton ? morton_table[x] | morton_table[y] << 1 : y * chunk_size + x;
+	}
+
+	uint8_t tile(unsigned x, unsigned y) {
+		return at(x, y).tiles[offset(x, y)];
+	}
+
+	uint8_t height(unsigned x, unsigned y) {
+		return at(x, y).heights[offset(x, y)];
+	}
+
+	void set(unsigned x, unsigned y, uint8_t tile, uint8_t height) {
+		Chunk &c = at(x, y);
+		unsigned i = offset(x, y);
+
+		c.tiles[i] = tile;
+		c.heights[i] = height;
+		c.dirty = true;
+	}
+
+	/** Invoke \a f with the chunk coordinates of all chunks that overlap tiles [x0, x1] x [y0, y1] on the map. */
+	template<typename F> void each_chunk(unsigned x0, unsigned y0, unsigned x1, unsigned y1, F f) const {
+		assert(x0 <= x1 && x1 < w && y0 <= y1 && y1 < h);
+
+		for (unsigned cy = y0 >> chunk_bits; cy <= y1 >> chunk_bits; ++cy)
+			for (unsigned cx = x0 >> chunk_bits; cx <= x1 >> chunk_bits; ++cx)
+				f(cx, cy);
+	}
+
+	/**
+	 * Invoke \a f with x, y and tile of all tiles [x0, x1] x [y0, y1] on the map. This visits
+	 * the area chunk by chunk and only looks up each chunk once, which is much cheaper than
+	 * calling tile for every one of them.
+	 */
+	template<typename F> void each_tile(unsigned x0, unsigned y0, unsigned x1, unsigned y1, F f) {
+		each_chunk(x0, y0, x1, y1, [&](unsigned cx, unsigned cy) {
+			unsigned tx0 = std::max(x0, cx << chunk_bits), tx1 = std::min(x1, ((cx + 1) << chunk_bits) - 1);
+			unsigned ty0 = std::max(y0, cy << chunk_bits), ty1 = std::min(y1, ((cy + 1) << chunk_bits) - 1);
+			const Chunk &c = at(tx0, ty0);
+
+			if (layout == TileLayout::morton) {
+				for (unsigned y = ty0; y <= ty1; ++y) {
+					unsigned row = morton_table[y & (chunk_size - 1)] << 1;
+					for (unsigned x = tx0; x <= tx1; ++x)
+						f(x, y, c.tiles[row | morton_table[x & (chunk_size - 1)]]);
+				}
+			} else {
+				for (unsigned y = ty0; y <= ty1; ++y) {
+					const uint8_t *row = c.tiles + (y & (chunk_size - 1)) * chunk_size;
+					for (unsigned x = tx0; x <= tx1; ++x)
+						f(x, y, row[x & (chunk_size - 1)]);
+				}
+			}
+		});
+	}
+
+	/** Invoke \a f with the chunk coordinates of the up to eight chunks around chunk \a cx, \a cy. */
+	template<typename F> void neighbours(unsigned cx, unsigned cy, F f) const {
+		for (int dy = -1; dy <= 1; ++dy)
+			for (int dx = -1; dx <= 1; ++dx)
+				if ((dx || dy) && (int)cx + dx >= 0 && cx + dx < cols && (int)cy + dy >= 0 && cy + dy < rows)
+					f(cx + dx, cy + dy);
+	}
+
+	/** Store all changed chunks. Anything else follows from the seed. */
+	void save(SnapshotWriter &w) const;
+	/** Forget all chunks and restore the changed ones. Throws std::runtime_error if they are corrupt. */
+	void load(const SnapshotReader &snap);
+private:
+	Chunk &at(unsigned x, unsigned y) {
+		assert(x < w && y < h);
+		size_t i = (size_t)(y >> chunk_bits) * cols + (x >> chunk_bits);
+		Chunk *c = chunks[i].get();
+
+		if (!c)
+			c = &make(i);
+
+		c->used = ++clock;
+		return *c;
+	}
+
+	/** Bring chunk \a i into memory, paging out others if there are too many. */
+	Chunk &make(size_t i);
+	void generate(size_t i, Chunk &c) const;
+	/** Copy tiles and heights of \a c row by row to \a dst. */
+	void get_rows(const Chunk &c, uint8_t *dst) const noexcept;
+	/** Fill \a c from tiles and heights at \a src that are stored row by row. */
+	void set_rows(Chunk &c, const uint8_t *src) const noexcept;
+	/** Page out the least recently used chunks until only \a keep are left. */
+	void evict(size_t keep);
+};
+
+}
+
+}
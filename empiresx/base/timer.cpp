@@ -0,0 +1,84 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#include "timer.hpp"
+
+#include <cassert>
+
+#include <algorithm>
+
+namespace genie {
+
+namespace game {
+
+static bool by_seq(const Timer &a, const Timer &b) noexcept {
+	return a.seq < b.seq;
+}
+
+void TimerWheel::reset(uint32_t now, uint32_t seq) {
+	for (auto &level : wheel)
+		for (auto &slot : level)
+			slot.clear();
+
+	this->now = now;
+	this->seq = seq;
+	count = 0;
+}
+
+void TimerWheel::insert(const Timer &t) {
+	uint32_t delta = t.due - now;
+	unsigned level = 0;
+
+	// the top level covers the full range, so it is always big enough
+	while (level + 1 < levels && delta >> (bits * (level + 1)))
+		++level;
+
+	wheel[level][(t.due >> (bits * level)) & (slots - 1)].emplace_back(t);
+}
+
+void TimerWheel::schedule(uint32_t due, TimerType type, uint32_t target) {
+	assert(due - now < UINT32_MAX / 2);
+	insert(Timer{due, seq++, type, target});
+	++count;
+}
+
+bool TimerWheel::restore(const Timer &t) {
+	if (t.due - now >= UINT32_MAX / 2 || t.seq >= seq || t.type >= TimerType::max)
+		return false;
+
+	insert(t);
+	++count;
+	return true;
+}
+
+void TimerWheel::advance(std::vector<Timer> &fired) {
+	// move timers of higher levels down once the levels below have come full circle
+	for (unsigned level = 1; level < levels && !(now & ((1u << (bits * level)) - 1)); ++level) {
+		std::vector<Timer> &slot = wheel[level][(now >> (bits * level)) & (slots - 1)];
+
+		for (const Timer &t : slot)
+			insert(t);
+		slot.clear();
+	}
+
+	std::vector<Timer> &slot = wheel[0][now & (slots - 1)];
+	size_t first = fired.size();
+
+	fired.insert(fired.end(), slot.begin(), slot.end());
+	std::sort(fired.begin() + first, fired.end(), by_seq);
+
+	count -= slot.size();
+	slot.clear();
+	++now;
+}
+
+void TimerWheel::pending(std::vector<Timer> &list) const {
+	for (auto &level : wheel)
+		for (auto &slot : level)
+			list.insert(list.end(), slot.begin(), slot.end());
+
+	std::sort(list.begin(), list.end(), by_seq);
+}
+
+}
+
+}
@@ -0,0 +1,70 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+#pragma once
+
+/*
+ * Delayed game events. Instead of counting down every production queue and the like each
+ * tick, the simulation schedules an event for the tick at which something has to happen.
+ * Events live in a hierarchical timer wheel: four levels of 256 slots, where each level
+ * covers 256 times the range of the level below. Scheduling is O(1) and each tick only
+ * touches the events that are due, plus once in a while a slot of a higher level whose
+ * events are moved down. Events that are due at the same tick fire in the order in which
+ * they have been scheduled, so all peers handle them the same way.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include <array>
+#include <vector>
+
+namespace genie {
+
+namespace game {
+
+enum class TimerType : uint32_t {
+	production, /**< target is the handle of the building whose current production is done */
+	max,
+};
+
+/** Also used as snapshot record. */
+struct Timer final {
+	uint32_t due; /**< tick at which it fires */
+	uint32_t seq; /**< order in which it has been scheduled */
+	TimerType type;
+	uint32_t target;
+};
+
+class TimerWheel final {
+	static constexpr unsigned bits = 8, slots = 1u << bits, levels = 4;
+
+	uint32_t now; /**< next tick to fire */
+	uint32_t seq; /**< sequence number of the next timer */
+	size_t count;
+	std::array<std::array<std::vector<Timer>, slots>, levels> wheel;
+public:
+	TimerWheel() : now(0), seq(0), count(0), wheel() {}
+
+	size_t size() const noexcept { return count; }
+	uint32_t next_seq() const noexcept { return seq; }
+
+	/** Remove all timers and continue at tick \a now, numbering new timers from \a seq on. */
+	void reset(uint32_t now, uint32_t seq);
+
+	/** Fire \a type for \a target at tick \a due, which must not have been fired yet. */
+	void schedule(uint32_t due, TimerType type, uint32_t target);
+	/** Put back \a t as saved in a snapshot, including its sequence number. Returns false if it has been due already. */
+	bool restore(const Timer &t);
+
+	/** Append all timers due at the next tick to \a fired, in the order in which they have been scheduled, and move on. */
+	void advance(std::vector<Timer> &fired);
+
+	/** All timers that have not fired yet in the order in which they have been scheduled. */
+	void pending(std::vector<Timer> &list) const;
+private:
+	void insert(const Timer &t);
+};
+
+}
+
+}
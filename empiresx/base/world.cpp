@@ -1,6 +1,8 @@
 /* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
 
 #include "world.hpp"
+#include "move.hpp"
+#include "mapgen.hpp"
 
 #include "net.hpp"
 #include "drs.hpp"
@@ -8,8 +10,16 @@
 #include "random.hpp"
 
 #include <cmath>
+#include <cstdlib>
 #include <inttypes.h>
 
+#include <cstring>
+
+#include <map>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+
 namespace genie {
 
 namespace game {
@@ -29,7 +39,27 @@ GatherStatus Resource::gather(Resource &dest, unsigned amount) {
 	return GatherStatus::ok;
 }
 
-unsigned particle_id_counter = 1;
+/** Number of tiles that the sprite of a tree may extend beyond its tile. */
+static constexpr int tree_reach = 4;
+
+/** Duration of one tick in milliseconds. */
+static constexpr unsigned tick_ms = turn_ms / turn_ticks;
+
+/** Scramble all bits of \a h. This is the finalizer of splitmix64. */
+static inline uint64_t hash_mix(uint64_t h) noexcept {
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+	return h ^ (h >> 31);
+}
+
+static inline uint64_t pack(uint32_t hi, uint32_t lo) noexcept {
+	return (uint64_t)hi << 32 | lo;
+}
+
+/** Combine four words with independent products, which is cheaper than mixing them one after another. */
+static inline uint64_t hash_words(uint64_t a, uint64_t b, uint64_t c, uint64_t d) noexcept {
+	return hash_mix(a * 0x9E3779B97F4A7C15ull + b * 0xC2B2AE3D27D4EB4Full + c * 0x165667B19E3779F9ull + d * 0x27D4EB2F165667C5ull);
+}
 
 const unsigned res_hp[] = {
 	40,
@@ -65,105 +95,167 @@ StaticResource::StaticResource(Map &map, const Box2<float> &pos, ResourceType ty
 	: Particle(map, pos, res_anim, image)
 	, Resource(type, res_amount[(unsigned)type]) {}
 
-World::World(LCG &lcg, const StartMatch &settings, bool host)
-	: map(lcg, settings), lcg(lcg), host(host)
-	, static_res()
-	//, tiled_objects(Vector2<int>(ispow2(settings.map_w) ? settings.map_w : nextpow2(settings.map_w), ispow2(settings.map_h) ? settings.map_h : nextpow2(settings.map_h)))
-	//, movable_objects(Vector2<float>(static_cast<float>(settings.map_w), static_cast<float>(settings.map_h)))
+StaticResource::StaticResource(Map &map, const ResourceRecord &r)
+	: Particle(map, Box2<float>(r.left, r.top), r.anim, r.image)
+	, Resource((ResourceType)r.type, r.amount) {}
+
+ResourceRecord StaticResource::record() const noexcept {
+	return ResourceRecord{pos.left, pos.top, (uint32_t)type, anim_index, image_index, amount};
+}
+
+uint64_t StaticResource::digest() const noexcept {
+	return hash_words(pack(to_fixed(pos.left), to_fixed(pos.top)), (unsigned)type, amount, 1);
+}
+
+/** Same as the digest of a StaticResource at the tile of \a c. */
+static uint64_t digest(const TileResource &c) noexcept {
+	return hash_words(pack(to_fixed((float)c.x), to_fixed((float)c.y)), c.type, c.amount, 1);
+}
+
+Tree::Tree(Map &map, const TileResource &c)
+	: Particle(map, Box2<float>(c.x, c.y), (unsigned)DrsId::desert_tree + c.variant), seen(0) {}
+
+void StaticResource::dump(FILE *f) const {
+	fprintf(f, "resource %" PRIu32 " type %u at %g,%g amount %u\n", id, (unsigned)type, pos.left, pos.top, amount);
+}
+
+/** Screen area covered by the map with a one tile margin. */
+static Box2<float> map_scr(const StartMatch &settings) {
+	float w = settings.map_w, h = settings.map_h;
+	return Box2<float>(-tw, -(h + 1) * th / 2, (w + h + 2) * tw / 2, (w + h + 2) * th / 2);
+}
+
+World::World(const Philox &rng, const StartMatch &settings, bool host, unsigned threads)
+	: map(rng, settings), rng(rng), host(host)
+	, resource_pool(), building_pool(), tree_pool(), static_res(), buildings(), building_slots(EntityKind::building), resource_slots(EntityKind::resource), trees(), tree_query(0), tree_scr(), statics(0), occupancy(settings.map_w, settings.map_h), flows(), hpa(settings.map_w, settings.map_h), changed()
+	, paths(occupancy, flows, hpa, threads ? std::max(1u, threads / 2) : 0), due(), now(0)
+	, static_grid(map_scr(settings)), unit_grid(map_scr(settings))
+	, simd(settings.map_w <= move_simd_max && settings.map_h <= move_simd_max), facing(), cells(settings.map_w, settings.map_h), push_x(), push_y(), halt(), combat(), dead(), fog(settings.map_w, settings.map_h), timers(), fired()
+	, jobs(threads), units()
 {
 }
 
 #pragma warning(push)
 #pragma warning(disable: 4244)
 
+/** Shapes of the objects that are scattered over the map. */
+static const int part_single[][2] = {{0, 0}};
+static const int part_bushes[][2] = {{0, 0}, {1, 0}, {1, -1}, {0, -1}, {-1, -1}};
+static const int part_mine[][2] = {{0, 0}, {1, 0}, {0, 1}, {1, 1}};
+
 void World::populate(unsigned players) {
 	size_t tiles = static_cast<size_t>(map.w) * map.h;
 	size_t trees = static_cast<size_t>(round(pow(static_cast<double>(tiles), 0.6)));
 	size_t goldstone = players + static_cast<size_t>(round(pow(static_cast<double>(tiles), 0.23))) - 2;
 	size_t bushes = players + static_cast<size_t>(round(pow(static_cast<double>(tiles), 0.25))) - 1;
 
-	// TODO rewrite generation algorithm
-	// FIXME ensure there are no static nor dynamic objects placed on top of each other
+	MapGen gen(map.w, map.h, rng);
 
-	printf("create %llu trees\n", (long long unsigned)trees);
+	// keep the towns clear
+	for (unsigned i = 0; i < players; ++i)
+		gen.reserve(2, static_cast<int>((static_cast<float>(i + 1) / (players + 1)) * map.h) - 9, 10, 19);
 
-	for (size_t i = 0; i < trees; ++i) {
-		Box2<float> pos(
-			static_cast<uint16_t>(lcg.next(10, map.w - 1)),
-			static_cast<uint16_t>(lcg.next(map.h - 1))
-		);
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::wood, (unsigned)DrsId::desert_tree + lcg.next() % 4));
-	}
+	// most important ones go first, so the trees fill up the space that is left
+	std::vector<ScatterKind> kinds{
+		{(unsigned)goldstone, 2, part_mine, 4, 7},
+		{(unsigned)goldstone, 2, part_mine, 4, 7},
+		{(unsigned)bushes, 2, part_bushes, 5, 1},
+		{(unsigned)trees, 1, part_single, 1, 4},
+	};
+	static const ResourceType kind_type[] = {ResourceType::gold, ResourceType::stone, ResourceType::food, ResourceType::wood};
 
-	printf("create %llu bushes\n", (long long unsigned)5 * bushes);
+	std::vector<Placement> placed;
+	gen.scatter(jobs, kinds, placed);
 
-	for (size_t i = 0; i < bushes; ++i) {
-		Box2<float> pos(
-			static_cast<uint16_t>(lcg.next(12, map.w - 4 - 1)),
-			static_cast<uint16_t>(lcg.next(4, map.h - 4 - 1))
-		);
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::food, 240));
-		pos.left += 1;
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::food, 240));
-		pos.top -= 1;
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::food, 240));
-		pos.left -= 1;
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::food, 240));
-		pos.left -= 1;
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::food, 240));
-	}
+	size_t count[4] = {0}, parts = 0;
+	for (const Placement &p : placed)
+		if (kind_type[p.kind] != ResourceType::wood)
+			parts += kinds[p.kind].parts;
 
-	printf("create %llu goldstone\n", (long long unsigned)4 * goldstone);
+	// trees are too many to be particles, so they become part of the map
+	std::vector<TileResource> forest(map.forest.all());
+	size_t first_tree = forest.size();
 
-	for (size_t i = 0; i < goldstone; ++i) {
-		Box2<float> pos(
-			static_cast<uint16_t>(lcg.next(10, map.w - 10 - 1)),
-			static_cast<uint16_t>(lcg.next(2, map.h - 2 - 1))
-		);
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::gold, 481, lcg.next(6)));
-		pos.left -= 2;
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::gold, 481, lcg.next(6)));
-		pos.left += 3;
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::gold, 481, lcg.next(6)));
-		pos.top += 1;
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::gold, 481, lcg.next(6)));
+	static_res.reserve(static_res.size() + parts);
+	resource_pool.reserve(parts);
+	size_t first = static_res.size();
 
-		pos.left = static_cast<uint16_t>(lcg.next(10, map.w - 10 - 1));
-		pos.top = static_cast<uint16_t>(lcg.next(2, map.h - 2 - 1));
+	for (const Placement &p : placed) {
+		const ScatterKind &k = kinds[p.kind];
+		++count[p.kind];
 
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::stone, 622, lcg.next(6)));
-		pos.left -= 2;
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::stone, 622, lcg.next(6)));
-		pos.left += 3;
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::stone, 622, lcg.next(6)));
-		pos.top += 1;
-		static_res.emplace_back(new StaticResource(map, pos, ResourceType::stone, 622, lcg.next(6)));
+		for (unsigned i = 0; i < k.parts; ++i) {
+			Box2<float> pos(p.x + k.footprint[i][0], p.y + k.footprint[i][1]);
+
+			switch (kind_type[p.kind]) {
+			case ResourceType::gold:
+				static_res.emplace_back(resource_pool.create(map, pos, ResourceType::gold, 481, p.variant));
+				break;
+			case ResourceType::stone:
+				static_res.emplace_back(resource_pool.create(map, pos, ResourceType::stone, 622, p.variant));
+				break;
+			case ResourceType::food:
+				static_res.emplace_back(resource_pool.create(map, pos, ResourceType::food, 240));
+				break;
+			case ResourceType::wood:
+				forest.emplace_back(TileResource{(uint16_t)pos.left, (uint16_t)pos.top, (uint8_t)ResourceType::wood, p.variant, (uint16_t)res_amount[(unsigned)ResourceType::wood]});
+				break;
+			}
+		}
+	}
+
+	for (size_t i = first; i < static_res.size(); ++i) {
+		static_res[i]->id = resource_slots.add((uint32_t)i);
+		statics += static_res[i]->digest();
 	}
 
-	printf("create %u players and 3 villagers and 2 clubman\n", players);
+	for (size_t i = first_tree; i < forest.size(); ++i)
+		statics += digest(forest[i]);
+
+	if (!map.forest.assign(std::move(forest)))
+		throw std::runtime_error("populate: trees overlap");
+
+	fprintf(stderr, "create %llu trees, %llu bushes, %llu gold and %llu stone\n",
+		(long long unsigned)count[3], (long long unsigned)count[2], (long long unsigned)count[0], (long long unsigned)count[1]);
+
+	fprintf(stderr, "create %u players and 3 villagers and 2 clubman\n", players);
+	stats.reserve(players);
+	fog.reserve(players);
 
 	for (unsigned i = 0; i < players; ++i) {
 		Box2<float> pos(
 			5, (static_cast<float>(i + 1) / (players + 1)) * map.h
 		);
-		buildings.emplace_back(new Building(map, pos, BuildingType::town_center, i));
+		add_building(pos, BuildingType::town_center, i);
 		pos.top += 4;
-		buildings.emplace_back(new Building(map, pos, BuildingType::barracks, i));
+		add_building(pos, BuildingType::barracks, i);
 		pos.top += 3;
 		pos.left += 1;
-		units.emplace_back(new Unit(map, pos, UnitType::clubman, i));
+		add_unit(pos.topleft(), UnitType::clubman, i);
 		pos.left += 1;
-		units.emplace_back(new Unit(map, pos, UnitType::clubman, i));
+		add_unit(pos.topleft(), UnitType::clubman, i);
 		pos.top -= 3;
 		pos.left -= 2;
 
 		pos.top -= 4 + 3;
-		units.emplace_back(new Villager(map, pos, i));
+		add_unit(pos.topleft(), UnitType::villager, i);
 		pos.left += 1;
-		units.emplace_back(new Villager(map, pos, i));
+		add_unit(pos.topleft(), UnitType::villager, i);
 		pos.left += 2;
-		units.emplace_back(new Villager(map, pos, i));
+		add_unit(pos.topleft(), UnitType::villager, i);
 	}
+
+	// nobody can have a path yet, so there is nothing to invalidate
+	for (auto &x : static_res) {
+		static_grid.insert(x.get(), x->scr);
+		occupancy.update(static_cast<int>(x->pos.left), static_cast<int>(x->pos.top), 1, 1, true, changed);
+	}
+
+	for (const TileResource &c : map.forest.all())
+		occupancy.update(c.x, c.y, 1, 1, true, changed);
+
+	changed.clear();
+	hpa.build(occupancy, jobs);
 }
 
 #pragma warning(pop)
@@ -178,18 +270,56 @@ static const DrsId build_anim_player[] = {
 	DrsId::town_center_player,
 };
 
-static const unsigned build_hp[] = {
-	350, // barracks
-	600, // town center
+/** Unit that each building type trains. */
+static const UnitType build_trains[] = {
+	UnitType::clubman,
+	UnitType::villager,
 };
 
 Building::Building(Map &map, const Box2<float> &pos, BuildingType type, unsigned player)
 	: Particle(map, pos, (unsigned)build_anim_base[(unsigned)type], 0, player)
-	, Alive(build_hp[(unsigned)type])
-	, anim_player((unsigned)build_anim_player[(unsigned)type]), player(player), prod(), type(type) {}
+	, Alive(building_stats[(unsigned)type].hp)
+	, anim_player((unsigned)build_anim_player[(unsigned)type]), player(player), prod(), ready(0), type(type) {}
+
+Building::Building(Map &map, const BuildingRecord &r)
+	: Building(map, Box2<float>(r.left, r.top), (BuildingType)r.type, r.player)
+{
+	hp = r.hp;
+	hp_max = r.hp_max;
+	ready = r.ready;
+}
+
+BuildingRecord Building::record() const noexcept {
+	return BuildingRecord{pos.left, pos.top, (uint32_t)type, player, hp, hp_max, ready, (uint32_t)prod.size()};
+}
 
-void Building::tick(World &world) {
-	auto &next = prod.front();
+bool Building::enqueue(UnitType what) {
+	if (prod.size() >= production_max)
+		return false;
+
+	prod.emplace_back(what);
+	return true;
+}
+
+uint64_t Building::digest() const noexcept {
+	// the queue is short enough to be numbered exactly
+	uint32_t queue = 0;
+	for (const Production &p : prod)
+		queue = queue * (unit_type_count + 1) + (unsigned)p.what + 1;
+
+	return hash_words(pack(to_fixed(pos.left), to_fixed(pos.top)), pack((unsigned)type, player), pack(hp, ready), pack(2, queue));
+}
+
+void Building::dump(FILE *f) const {
+	fprintf(f, "building %" PRIu32 " type %u player %u at %g,%g hp %u/%u", id, (unsigned)type, player, pos.left, pos.top, hp, hp_max);
+
+	if (!prod.empty()) {
+		fprintf(f, " ready %" PRIu32 " queue", ready);
+		for (const Production &p : prod)
+			fprintf(f, " %u", (unsigned)p.what);
+	}
+
+	fputc('\n', f);
 }
 
 static const DrsId unit_anim[] = {
@@ -197,102 +327,1342 @@ static const DrsId unit_anim[] = {
 	DrsId::clubman_stand,
 };
 
-static const unsigned unit_hp[] = {
-	25,
-	25,
-};
-
 static const unsigned unit_dir_images[] = {
 	6,
 	6,
 };
 
-static const float unit_movespeed[] = {
-	0.5f,
-	0.4f,
+/** Whether idle units of each type attack enemies that come into sight. */
+static const bool unit_aggressive[] = {
+	false, // villager
+	true, // clubman
 };
 
-Unit::Unit(Map &map, const Box2<float> &pos, UnitType type, unsigned player)
-	: Particle(map, pos, (unsigned)unit_anim[(unsigned)type], 0, player)
-	, Alive(unit_hp[(unsigned)type])
-	, type(type), dir((UnitDirection)(rand() % 8)), dir_images(unit_dir_images[(unsigned)type])
-	, target(pos.left, pos.top)
-{
-	hflip = dir >= UnitDirection::top_right;
+template<typename T> static void swap_remove(std::vector<T> &v, size_t i) {
+	v[i] = std::move(v.back());
+	v.pop_back();
 }
 
-void Unit::imgtick() {
-	image_index = (image_index + 1) % dir_images;
+static Vector2<float> to_float(const Vector2<fixed> &v) {
+	return Vector2<float>(from_fixed(v.x), from_fixed(v.y));
 }
 
-static constexpr float move_threshold = 0.5f / tw; // half a horizontal pixel should be close enough
+UnitRef Units::add(Map &map, const Philox &rng, const Vector2<fixed> &p, UnitType t, unsigned player, const UnitStats &stats) {
+	UnitRef r = slots.add((uint32_t)size());
 
-void Unit::tick(World &world) {
-	float dx = target.x - pos.left, dy = target.y - pos.top;
+	unsigned anim = (unsigned)unit_anim[(unsigned)t];
+	int hx, hy;
+	Box2<float> s(map.tile_to_scr(to_float(p), hx, hy, anim, 0));
 
-	if (abs(dx) < move_threshold && abs(dy) < move_threshold)
-		return;
+	x.emplace_back(p.x);
+	y.emplace_back(p.y);
+	target_x.emplace_back(p.x);
+	target_y.emplace_back(p.y);
+	movespeed.emplace_back(stats.speed);
+	goal_x.emplace_back(p.x);
+	goal_y.emplace_back(p.y);
+	flow.emplace_back();
+	route.emplace_back();
+	path.emplace_back(0);
+
+	dir.emplace_back((UnitDirection)Philox(rng.substream(RandomStream::units, r)).next(7));
+	image_index.emplace_back(0);
+	scr.emplace_back(s);
+	hotspot_x.emplace_back(hx);
+	hotspot_y.emplace_back(hy);
+
+	hp.emplace_back(stats.hp);
+	hp_max.emplace_back(stats.hp);
+	foe.emplace_back(no_unit);
+	cooldown.emplace_back(0);
+	eye.emplace_back((uint32_t)(p.y >> fixed_bits) * map.w + (uint32_t)(p.x >> fixed_bits));
+	sight.emplace_back(stats.los);
+
+	type.emplace_back(t);
+	anim_index.emplace_back(anim);
+	dir_images.emplace_back(unit_dir_images[(unsigned)t]);
+	color.emplace_back(player);
+	ref.emplace_back(r);
+	digest.emplace_back(0);
+	rehash(size() - 1);
+
+	return r;
+}
+
+void Units::erase(UnitRef r) {
+	size_t i = index(r);
+
+	slots.move(ref.back(), (uint32_t)i);
+	slots.erase(r);
+	checksum -= digest[i];
+
+	swap_remove(x, i);
+	swap_remove(y, i);
+	swap_remove(target_x, i);
+	swap_remove(target_y, i);
+	swap_remove(movespeed, i);
+	swap_remove(goal_x, i);
+	swap_remove(goal_y, i);
+	swap_remove(flow, i);
+	swap_remove(route, i);
+	swap_remove(path, i);
+	swap_remove(dir, i);
+	swap_remove(image_index, i);
+	swap_remove(scr, i);
+	swap_remove(hotspot_x, i);
+	swap_remove(hotspot_y, i);
+	swap_remove(hp, i);
+	swap_remove(hp_max, i);
+	swap_remove(foe, i);
+	swap_remove(cooldown, i);
+	swap_remove(eye, i);
+	swap_remove(sight, i);
+	swap_remove(type, i);
+	swap_remove(anim_index, i);
+	swap_remove(dir_images, i);
+	swap_remove(color, i);
+	swap_remove(ref, i);
+	swap_remove(digest, i);
+}
+
+void Units::imgtick() noexcept {
+	for (size_t i = 0, n = size(); i < n; ++i)
+		image_index[i] = (image_index[i] + 1) % dir_images[i];
+}
+
+/** Facing for screen vectors quantized to -1, 0 or 1 per axis, indexed by (y + 1) * 3 + (x + 1). */
+static const UnitDirection dir_octants[3 * 3] = {
+	UnitDirection::top_left, UnitDirection::top, UnitDirection::top_right,
+	UnitDirection::left, UnitDirection::down, UnitDirection::right,
+	UnitDirection::down_left, UnitDirection::down, UnitDirection::down_right,
+};
+
+/** Whether position \a x, \a y is within \a r of \a tx, \a ty along both axes. */
+static inline bool within(fixed x, fixed y, fixed tx, fixed ty, fixed r) noexcept {
+	return std::abs(static_cast<int64_t>(tx) - x) < r && std::abs(static_cast<int64_t>(ty) - y) < r;
+}
+
+static inline bool arrived(fixed x, fixed y, fixed tx, fixed ty) noexcept {
+	return within(x, y, tx, ty, move_threshold);
+}
+
+/**
+ * Distance at which a waypoint counts as reached. Units that walk together push each other off
+ * the tile centers they are heading for, so they must not insist on reaching them exactly.
+ */
+static constexpr fixed waypoint_radius = unit_spacing / 2;
+
+static constexpr fixed tile_center(int t) noexcept {
+	return static_cast<fixed>(t * fixed_one + fixed_one / 2);
+}
+
+void Units::steer(size_t first, size_t last, unsigned w) noexcept {
+	for (size_t i = first; i < last; ++i) {
+		if (!within(x[i], y[i], target_x[i], target_y[i], waypoint_radius))
+			continue;
+
+		if (route[i]) {
+			Route &r = *route[i];
+
+			if (!r.walked()) {
+				uint32_t t = r.tiles[r.step++];
+				target_x[i] = tile_center(t % w);
+				target_y[i] = tile_center(t / w);
+			} else if (r.done()) {
+				target_x[i] = goal_x[i];
+				target_y[i] = goal_y[i];
+			}
+			continue;
+		}
+
+		const FlowField *f = flow[i].get();
+		if (!f)
+			continue;
+
+		int tx = x[i] >> fixed_bits, ty = y[i] >> fixed_bits;
+		uint32_t tile = (uint32_t)ty * f->w + tx;
+		uint8_t d = f->dir[tile];
+
+		if (d == flow_here) {
+			// walk up to the exact spot, unless the destination is blocked
+			if (tile == f->dest) {
+				target_x[i] = goal_x[i];
+				target_y[i] = goal_y[i];
+			}
+			continue;
+		}
+
+		if (d == flow_none)
+			continue;
+
+		d &= ~flow_blocked;
+		target_x[i] = tile_center(tx + flow_dx[d]);
+		target_y[i] = tile_center(ty + flow_dy[d]);
+	}
+}
+
+void Units::move(size_t first, size_t last, uint8_t *facing, bool simd) noexcept {
+	size_t i = first, n = last - first;
+
+	if (simd)
+		move_simd(&x[i], &y[i], &target_x[i], &target_y[i], &movespeed[i], &facing[i], n);
+	else
+		move_scalar(&x[i], &y[i], &target_x[i], &target_y[i], &movespeed[i], &facing[i], n);
+}
+
+void Units::separate(size_t first, size_t last, const UnitCells &cells, fixed *push_x, fixed *push_y, uint8_t *halt) const noexcept {
+	static constexpr int64_t spacing2 = static_cast<int64_t>(unit_spacing) * unit_spacing;
+
+	for (size_t i = first; i < last; ++i) {
+		fixed ux = x[i], uy = y[i];
+		bool walking = flow[i] || route[i];
+		bool stop = walking && arrived(ux, uy, goal_x[i], goal_y[i]);
+		int64_t px = 0, py = 0;
+		unsigned count = 0;
+
+		cells.near(ux, uy, [&](uint32_t k) {
+			if (k == i)
+				return true;
+
+			int64_t dx = static_cast<int64_t>(ux) - x[k], dy = static_cast<int64_t>(uy) - y[k];
+			int64_t d2 = dx * dx + dy * dy;
+
+			if (d2 >= spacing2)
+				return true;
+
+			// units on the same spot are pushed apart in the order of their references
+			if (!d2)
+				dx = ref[i] < ref[k] ? -unit_spacing / 2 : unit_spacing / 2;
+
+			// the closer, the harder the push
+			px += dx * (spacing2 - d2) / spacing2;
+			py += dy * (spacing2 - d2) / spacing2;
 
-	float angle = atan2(dy, dx);
-	pos.left += cos(angle) * movespeed;
-	pos.top += sin(angle) * movespeed;
+			// the group has arrived when the first ones have: the rest stops as soon as it bumps into them
+			if (walking && goal_x[k] == goal_x[i] && goal_y[k] == goal_y[i] && resting(k))
+				stop = true;
 
-	// FIXME update unit direction
-	// -angle + 270
-	Vector2<float> scr_target;
-	genie::tile_to_scr(scr_target.x, scr_target.y, target.x, target.y);
-	float scr_dx = scr_target.x - scr.left, scr_dy = scr_target.y;
-	// force scr_angle to be positive in range [0,360)
-	double scr_angle = fmod(2 * M_PI + -atan2(scr_dy, scr_dx) + 1.5 * M_PI, 2 * M_PI);
+			return ++count < push_neighbours;
+		});
 
-	unsigned norm_dir = static_cast<unsigned>(8 + round(scr_angle / (2 * M_PI / 8))) % 8;
-	dir = (UnitDirection)(norm_dir);
+		// both units of each pair move half the way
+		push_x[i] = (fixed)std::clamp<int64_t>(px / 2, -push_max, push_max);
+		push_y[i] = (fixed)std::clamp<int64_t>(py / 2, -push_max, push_max);
+		halt[i] = stop;
+	}
+}
 
-	hflip = norm_dir >= (unsigned)UnitDirection::top_right;
+void Units::moved(size_t i, uint8_t facing, Map &map) {
+	if (facing)
+		dir[i] = dir_octants[facing - 1];
 
 	Box2<float> dim;
-	int index = (unsigned)dir * dir_images + image_index;
-	img_dim(dim, hotspot_x, hotspot_y, anim_index, index);
+	int index = (unsigned)dir[i] * dir_images[i] + image_index[i];
+	img_dim(dim, hotspot_x[i], hotspot_y[i], anim_index[i], index);
 
-	if (hflip)
-		hotspot_x = static_cast<int>(dim.w) - hotspot_x;
+	if (hflip(i))
+		hotspot_x[i] = static_cast<int>(dim.w) - hotspot_x[i];
+
+	scr[i] = map.tile_to_scr(Vector2<float>(from_fixed(x[i]), from_fixed(y[i])), hotspot_x[i], hotspot_y[i], anim_index[i], image_index[i]);
+}
 
-	// particle has moved, force update scr
-	scr = world.map.tile_to_scr(pos.topleft(), hotspot_x, hotspot_y, anim_index, image_index);
+bool Units::resting(size_t i) const noexcept {
+	return !path[i] && !flow[i] && !route[i] && arrived(x[i], y[i], target_x[i], target_y[i]);
 }
 
-void Unit::draw(int offx, int offy) const {
-	int index = (unsigned)dir * dir_images + image_index;
-	Particle::draw(offx, offy, index);
+uint64_t Units::hash(size_t i) const noexcept {
+	return hash_words(pack(goal_x[i], goal_y[i]), pack(path[i], foe[i]), hp[i], pack(ref[i], color[i] << 8 | (unsigned)type[i]));
+}
+
+void Units::rehash(size_t i) noexcept {
+	uint64_t h = hash(i);
+	checksum += h - digest[i];
+	digest[i] = h;
+}
+
+uint64_t Units::positions() const noexcept {
+	uint64_t sum = 0;
+
+	// odd weights keep every bit of the position
+	for (size_t i = 0, n = size(); i < n; ++i)
+		sum += pack(x[i], y[i]) * (digest[i] | 1);
+
+	return sum;
+}
+
+void Units::save(SnapshotWriter &w) const {
+	w.add(SnapshotSection::unit_x, x);
+	w.add(SnapshotSection::unit_y, y);
+	w.add(SnapshotSection::unit_target_x, target_x);
+	w.add(SnapshotSection::unit_target_y, target_y);
+	w.add(SnapshotSection::unit_movespeed, movespeed);
+	w.add(SnapshotSection::unit_goal_x, goal_x);
+	w.add(SnapshotSection::unit_goal_y, goal_y);
+	w.add(SnapshotSection::unit_path, path);
+	w.add(SnapshotSection::unit_dir, dir);
+	w.add(SnapshotSection::unit_image, image_index);
+	w.add(SnapshotSection::unit_hp, hp);
+	w.add(SnapshotSection::unit_hp_max, hp_max);
+	w.add(SnapshotSection::unit_foe, foe);
+	w.add(SnapshotSection::unit_cooldown, cooldown);
+	w.add(SnapshotSection::unit_type, type);
+	w.add(SnapshotSection::unit_anim, anim_index);
+	w.add(SnapshotSection::unit_dir_images, dir_images);
+	w.add(SnapshotSection::unit_color, color);
+	w.add(SnapshotSection::unit_ref, ref);
+	w.add(SnapshotSection::unit_slots, slots.all());
+	std::copy(slots.free().begin(), slots.free().end(), w.alloc<uint32_t>(SnapshotSection::unit_freelist, slots.free().size()));
+
+	// flow fields are shared by all units that have been sent together, so store each one once
+	size_t n = size(), routes = 0, abstract = 0, tiles = 0;
+	uint32_t *unit_flow = w.alloc<uint32_t>(SnapshotSection::unit_flow, n);
+	uint32_t *unit_route = w.alloc<uint32_t>(SnapshotSection::unit_route, n);
+	std::unordered_map<const FlowField*, uint32_t> index;
+	std::vector<const FlowField*> fields;
+
+	for (size_t i = 0; i < n; ++i) {
+		const FlowField *f = flow[i].get();
+		unit_flow[i] = snapshot_none;
+
+		if (f) {
+			auto ins = index.emplace(f, (uint32_t)fields.size());
+			if (ins.second)
+				fields.emplace_back(f);
+			unit_flow[i] = ins.first->second;
+		}
+
+		unit_route[i] = snapshot_none;
+
+		if (route[i]) {
+			unit_route[i] = (uint32_t)routes++;
+			abstract += route[i]->abstract.size();
+			tiles += route[i]->tiles.size();
+		}
+	}
+
+	size_t area = fields.empty() ? 0 : (size_t)fields[0]->w * fields[0]->h;
+	FlowRecord *flows = w.alloc<FlowRecord>(SnapshotSection::flows, fields.size());
+	uint8_t *dirs = w.alloc<uint8_t>(SnapshotSection::flow_dirs, fields.size() * area);
+
+	for (size_t k = 0; k < fields.size(); ++k) {
+		flows[k].dest = fields[k]->dest;
+		memcpy(dirs + k * area, fields[k]->dir.get(), area);
+	}
+
+	RouteRecord *rec = w.alloc<RouteRecord>(SnapshotSection::routes, routes);
+	uint32_t *way = w.alloc<uint32_t>(SnapshotSection::route_abstract, abstract);
+	uint32_t *steps = w.alloc<uint32_t>(SnapshotSection::route_tiles, tiles);
+
+	for (size_t i = 0; i < n; ++i) {
+		const Route *r = route[i].get();
+		if (!r)
+			continue;
+
+		*rec++ = RouteRecord{(uint32_t)r->next, (uint32_t)r->step, (uint32_t)r->abstract.size(), (uint32_t)r->tiles.size()};
+		way = std::copy(r->abstract.begin(), r->abstract.end(), way);
+		steps = std::copy(r->tiles.begin(), r->tiles.end(), steps);
+	}
 }
 
-Villager::Villager(Map &map, const Box2<float> &pos, unsigned player)
-	: Unit(map, pos, UnitType::villager, player) {}
+void Units::load(const SnapshotReader &snap, Map &map) {
+	snap.get(SnapshotSection::unit_x, x);
+	size_t n = x.size();
+
+	auto column = [&snap, n](SnapshotSection id, auto &v) {
+		snap.get(id, v);
+		if (v.size() != n)
+			throw std::runtime_error(std::string("snapshot: bad length of unit column ") + std::to_string((uint32_t)id));
+	};
+
+	column(SnapshotSection::unit_y, y);
+	column(SnapshotSection::unit_target_x, target_x);
+	column(SnapshotSection::unit_target_y, target_y);
+	column(SnapshotSection::unit_movespeed, movespeed);
+	column(SnapshotSection::unit_goal_x, goal_x);
+	column(SnapshotSection::unit_goal_y, goal_y);
+	column(SnapshotSection::unit_path, path);
+	column(SnapshotSection::unit_dir, dir);
+	column(SnapshotSection::unit_image, image_index);
+	column(SnapshotSection::unit_hp, hp);
+	column(SnapshotSection::unit_hp_max, hp_max);
+	column(SnapshotSection::unit_foe, foe);
+	column(SnapshotSection::unit_cooldown, cooldown);
+	column(SnapshotSection::unit_type, type);
+	column(SnapshotSection::unit_anim, anim_index);
+	column(SnapshotSection::unit_dir_images, dir_images);
+	column(SnapshotSection::unit_color, color);
+	column(SnapshotSection::unit_ref, ref);
+	size_t slot_count, free_count;
+	const Slot *s = snap.get<Slot>(SnapshotSection::unit_slots, slot_count);
+	const uint32_t *f = snap.get<uint32_t>(SnapshotSection::unit_freelist, free_count);
+
+	if (!slots.restore(s, slot_count, f, free_count, n))
+		throw std::runtime_error("snapshot: corrupt unit slots");
+
+	for (size_t i = 0; i < n; ++i)
+		if (!slots.valid(ref[i]) || slots.index(ref[i]) != i || (unsigned)type[i] >= unit_type_count || !dir_images[i] || !hp[i]
+			|| (foe[i] != no_unit && !slots.valid(foe[i])))
+			throw std::runtime_error("snapshot: corrupt unit " + std::to_string(i));
+
+	// the world knows what the units see
+	eye.assign(n, 0);
+	sight.assign(n, 0);
+
+	// screen positions depend on the graphics and are left out
+	scr.resize(n);
+	hotspot_x.resize(n);
+	hotspot_y.resize(n);
+
+	for (size_t i = 0; i < n; ++i)
+		scr[i] = map.tile_to_scr(Vector2<float>(from_fixed(x[i]), from_fixed(y[i])), hotspot_x[i], hotspot_y[i], anim_index[i], image_index[i]);
+
+	size_t count, area = (size_t)map.w * map.h;
+	const FlowRecord *flows = snap.get<FlowRecord>(SnapshotSection::flows, count);
+	const uint8_t *dirs = snap.get<uint8_t>(SnapshotSection::flow_dirs, count * area, "flow directions");
+	std::vector<std::shared_ptr<const FlowField>> fields;
+
+	for (size_t k = 0; k < count; ++k) {
+		if (flows[k].dest >= area)
+			throw std::runtime_error("snapshot: corrupt flow field " + std::to_string(k));
+
+		std::shared_ptr<FlowField> f(new FlowField(map.w, map.h, flows[k].dest));
+		memcpy(f->dir.get(), dirs + k * area, area);
+		fields.emplace_back(f);
+	}
+
+	const uint32_t *unit_flow = snap.get<uint32_t>(SnapshotSection::unit_flow, n, "unit flow fields");
+	flow.assign(n, nullptr);
+
+	for (size_t i = 0; i < n; ++i)
+		if (unit_flow[i] != snapshot_none) {
+			if (unit_flow[i] >= fields.size())
+				throw std::runtime_error("snapshot: bad flow field of unit " + std::to_string(i));
+			flow[i] = fields[unit_flow[i]];
+		}
+
+	size_t routes, abstract, tiles;
+	const RouteRecord *rec = snap.get<RouteRecord>(SnapshotSection::routes, routes);
+	const uint32_t *way = snap.get<uint32_t>(SnapshotSection::route_abstract, abstract);
+	const uint32_t *steps = snap.get<uint32_t>(SnapshotSection::route_tiles, tiles);
+	const uint32_t *unit_route = snap.get<uint32_t>(SnapshotSection::unit_route, n, "unit routes");
+
+	route.clear();
+	route.resize(n);
+
+	// routes are stored in unit order
+	for (size_t i = 0, k = 0; i < n; ++i) {
+		if (unit_route[i] == snapshot_none)
+			continue;
+
+		if (unit_route[i] != k || k >= routes || rec[k].abstract > abstract || rec[k].tiles > tiles || rec[k].next > rec[k].abstract || rec[k].step > rec[k].tiles)
+			throw std::runtime_error("snapshot: bad route of unit " + std::to_string(i));
+
+		std::unique_ptr<Route> r(new Route());
+		r->abstract.assign(way, way + rec[k].abstract);
+		r->tiles.assign(steps, steps + rec[k].tiles);
+		r->next = rec[k].next;
+		r->step = rec[k].step;
+
+		way += rec[k].abstract;
+		abstract -= rec[k].abstract;
+		steps += rec[k].tiles;
+		tiles -= rec[k].tiles;
+		++k;
+
+		route[i] = std::move(r);
+	}
+
+	digest.assign(n, 0);
+	checksum = 0;
+
+	for (size_t i = 0; i < n; ++i)
+		rehash(i);
+}
+
+UnitRef World::add_unit(const Vector2<float> &pos, UnitType type, unsigned player) {
+	stats.reserve(player + 1);
+	fog.reserve(player + 1);
+
+	UnitRef r = units.add(map, rng, Vector2<fixed>(to_fixed(pos.x), to_fixed(pos.y)), type, player, stats.unit(player, type));
+	size_t i = units.index(r);
+
+	unit_grid.insert(r, units.scr[i]);
+	fog.add(player, units.eye[i] % map.w, units.eye[i] / map.w, units.sight[i]);
+	return r;
+}
+
+void World::erase_unit(UnitRef r) {
+	size_t i = units.index(r);
+
+	unit_grid.erase(r, units.scr[i]);
+	fog.remove(units.color[i], units.eye[i] % map.w, units.eye[i] / map.w, units.sight[i]);
+	units.erase(r);
+}
+
+void World::add_building(const Box2<float> &pos, BuildingType type, unsigned player) {
+	buildings.emplace_back(building_pool.create(map, pos, type, player));
+	buildings.back()->id = building_slots.add((uint32_t)(buildings.size() - 1));
+	statics += buildings.back()->digest();
+	static_grid.insert(buildings.back().get(), buildings.back()->scr);
+	occupy(pos, building_stats[(unsigned)type].size, true);
+}
+
+/** Hash of modifier \a m, which is the \a i-th one that has been applied. */
+static uint64_t digest(const StatModifier &m, size_t i) noexcept {
+	return hash_words(pack(m.player, m.unit), (uint32_t)m.stat, pack((uint32_t)m.percent, (uint32_t)m.add), pack(3, (uint32_t)i));
+}
+
+bool World::modify(const StatModifier &m) {
+	if (!stats.modify(m))
+		return false;
+
+	statics += digest(m, stats.modifiers().size() - 1);
+
+	// existing units get the new speed and keep the hit points they have lost
+	for (size_t i = 0, n = units.size(); i < n; ++i) {
+		if (units.color[i] != m.player || (m.unit != stat_all_units && m.unit != (unsigned)units.type[i]))
+			continue;
+
+		const UnitStats &s = stats.unit(m.player, units.type[i]);
+		unsigned lost = units.hp_max[i] - units.hp[i];
+
+		units.movespeed[i] = s.speed;
+		units.hp_max[i] = s.hp;
+		units.hp[i] = s.hp > lost ? s.hp - lost : 1;
+		units.rehash(i);
+
+		if (units.sight[i] != s.los) {
+			int x = units.eye[i] % map.w, y = units.eye[i] / map.w;
+			fog.remove(m.player, x, y, units.sight[i]);
+			fog.add(m.player, x, y, units.sight[i] = s.los);
+		}
+	}
+
+	return true;
+}
+
+void World::reveal(unsigned player, bool lift) {
+	fog.reserve(player + 1);
+	fog.reveal(player);
+	fog.lift(player, lift);
+}
+
+void World::deplete(StaticResource *r) {
+	assert(resource_slots.valid(r->id));
+	size_t i = resource_slots.index(r->id);
+
+	statics -= r->digest();
+	static_grid.erase(r, r->scr);
+	occupy(r->pos, 1, false);
+
+	// the last resource takes its place
+	resource_slots.move(static_res.back()->id, (uint32_t)i);
+	resource_slots.erase(r->id);
+	swap_remove(static_res, i);
+}
+
+unsigned World::harvest(unsigned x, unsigned y, unsigned amount) {
+	TileResource *c = map.forest.find(x, y);
+	if (!c)
+		return 0;
+
+	amount = std::min<unsigned>(amount, c->amount);
+	statics -= digest(*c);
+	c->amount -= amount;
+
+	if (c->amount) {
+		statics += digest(*c);
+	} else {
+		map.forest.erase(x, y);
+		trees.erase(y * map.w + x);
+		occupy(Box2<float>((float)x, (float)y), 1, false);
+	}
+
+	return amount;
+}
+
+GatherStatus World::gather(Handle h, Resource &dest, unsigned amount) {
+	if (!resource_slots.valid(h))
+		return GatherStatus::depleted;
+
+	StaticResource &r = *static_res[resource_slots.index(h)];
+	uint64_t before = r.digest();
+	GatherStatus s = r.gather(dest, amount);
+
+	// the amount is hashed as well, so the digest of the resource has to be updated
+	statics += r.digest() - before;
+
+	if (s == GatherStatus::depleted)
+		deplete(&r);
+
+	return s;
+}
+
+void World::occupy(const Box2<float> &pos, unsigned size, bool add) {
+	changed.clear();
+
+	{
+		auto lock(paths.change());
+		occupancy.update(static_cast<int>(pos.left), static_cast<int>(pos.top), size, size, add, changed);
+
+		if (changed.empty())
+			return;
+
+		flows.invalidate(changed);
+		hpa.repair(occupancy, changed);
+	}
+
+	// units may follow fields that have been evicted already, so check them one by one.
+	// they keep following the old field until the new one is due.
+	const FlowField *last = nullptr;
+	bool affected = false;
+	std::map<uint32_t, std::vector<UnitRef>> replan; // units per destination tile
+
+	for (size_t i = 0, n = units.size(); i < n; ++i) {
+		if (units.route[i]) {
+			Route &r = *units.route[i];
+
+			// the abstract path is checked once we get there, but the refined part may have been cut off
+			if (r.tiles.empty() || r.done())
+				continue;
+
+			bool cut = false;
+			for (size_t k = r.step ? r.step - 1 : 0; k < r.tiles.size() && !cut; ++k)
+				cut = std::find(changed.begin(), changed.end(), r.tiles[k]) != changed.end();
+
+			if (cut) {
+				--r.next;
+				r.tiles.clear();
+				r.step = 0;
+				units.target_x[i] = units.x[i];
+				units.target_y[i] = units.y[i];
+			}
+			continue;
+		}
+
+		// units that wait for a path already get one for the new map
+		if (!units.flow[i] || units.path[i])
+			continue;
+
+		// units that are sent together share the same field, so avoid checking it over and over again
+		if (units.flow[i].get() != last) {
+			last = units.flow[i].get();
+			affected = last->affected(changed);
+		}
+
+		if (affected)
+			replan[last->dest].emplace_back(units.ref[i]);
+	}
+
+	for (auto &p : replan)
+		request(p.first, false, p.second);
+}
+
+/** Single units that have to go at least this many tiles in either direction use HPA* instead of a flow field. */
+static constexpr unsigned hpa_min_distance = 2 * hpa_cluster;
+
+static inline uint32_t tile_of(fixed x, fixed y, unsigned w) noexcept {
+	return static_cast<uint32_t>(y >> fixed_bits) * w + static_cast<uint32_t>(x >> fixed_bits);
+}
+
+void World::request(uint32_t goal, bool single, const std::vector<UnitRef> &refs) {
+	assert(!refs.empty());
+	size_t i = units.index(refs[0]);
+	uint32_t start = single ? tile_of(units.x[i], units.y[i], map.w) : goal;
+	uint32_t id = paths.submit(now + path_delay, start, goal, single, std::vector<uint32_t>(refs));
+
+	for (UnitRef r : refs) {
+		size_t k = units.index(r);
+		units.path[k] = id;
+		units.rehash(k);
+	}
+}
+
+void World::deliver(PathRequest &r) {
+	for (UnitRef ref : r.units) {
+		if (!units.valid(ref))
+			continue;
+
+		size_t i = units.index(ref);
+
+		// the unit may have got another order meanwhile
+		if (units.path[i] != r.id)
+			continue;
+
+		units.path[i] = 0;
+		units.rehash(i);
+		units.route[i] = std::move(r.route);
+		units.flow[i] = r.flow;
+		// let steer pick the first waypoint
+		units.target_x[i] = units.x[i];
+		units.target_y[i] = units.y[i];
+	}
+}
+
+void World::apply(const std::vector<Order> &orders) {
+	std::map<UnitRef, uint32_t> dest; // destination tile of the last order per unit
+
+	for (const Order &o : orders) {
+		if ((OrderType)o.type == OrderType::train)
+			train(o);
+
+		if ((OrderType)o.type != OrderType::move || !units.valid(o.unit))
+			continue;
+
+		size_t i = units.index(o.unit);
+		if (units.color[i] != o.player)
+			continue;
+
+		fixed gx = std::clamp<fixed>(o.x, 0, (fixed)(map.w - 1) * fixed_one);
+		fixed gy = std::clamp<fixed>(o.y, 0, (fixed)(map.h - 1) * fixed_one);
+
+		units.goal_x[i] = gx;
+		units.goal_y[i] = gy;
+		units.foe[i] = no_unit;
+		units.flow[i].reset();
+		units.route[i].reset();
+		units.target_x[i] = units.x[i];
+		units.target_y[i] = units.y[i];
+		units.rehash(i);
+
+		dest[o.unit] = tile_of(gx, gy, map.w);
+	}
+
+	std::map<uint32_t, std::vector<UnitRef>> group; // units per destination tile
+	for (auto &d : dest)
+		group[d.second].emplace_back(d.first);
+
+	for (auto &g : group) {
+		size_t i = units.index(g.second[0]);
+		unsigned dx = std::abs((int)(g.first % map.w) - (units.x[i] >> fixed_bits));
+		unsigned dy = std::abs((int)(g.first / map.w) - (units.y[i] >> fixed_bits));
+
+		request(g.first, g.second.size() == 1 && std::max(dx, dy) >= hpa_min_distance, g.second);
+	}
+}
+
+void World::train(const Order &o) {
+	Building *b = building(o.unit);
+	if (!b || o.x < 0 || (unsigned)o.x >= unit_type_count)
+		return;
+
+	UnitType what = (UnitType)o.x;
+
+	if (b->owner() != o.player || build_trains[(unsigned)b->type] != what)
+		return;
+
+	statics -= b->digest();
+
+	if (b->enqueue(what) && b->queue().size() == 1)
+		produce(*b);
+
+	statics += b->digest();
+}
+
+void World::produce(Building &b) {
+	const UnitStats &s = stats.unit(b.owner(), b.queue().front().what);
+	uint32_t due = now + std::max(1u, s.train_time * 1000u / tick_ms);
+
+	b.start(due);
+	timers.schedule(due, TimerType::production, b.id);
+}
+
+void World::fire(const Timer &t) {
+	switch (t.type) {
+	case TimerType::production: {
+		// the building may have been destroyed since
+		Building *p = building(t.target);
+		if (!p)
+			break;
+
+		Building &b = *p;
+		assert(!b.queue().empty() && b.done() == t.due);
+
+		// the unit comes out in the middle of the front of the building
+		unsigned size = building_stats[(unsigned)b.type].size;
+		Vector2<float> pos(std::min<float>(b.pos.left + size / 2, map.w - 1), std::min<float>(b.pos.top + size, map.h - 1));
+
+		statics -= b.digest();
+		add_unit(pos, b.queue().front().what, b.owner());
+		b.finish();
+
+		if (!b.queue().empty())
+			produce(b);
+		else
+			b.start(0);
+
+		statics += b.digest();
+		break;
+	}
+	case TimerType::max:
+		assert(0);
+		break;
+	}
+}
+
+void World::refine() {
+	for (size_t i = 0, n = units.size(); i < n; ++i) {
+		Route *r = units.route[i].get();
+
+		if (!r || !r->walked() || r->next >= r->abstract.size() || !arrived(units.x[i], units.y[i], units.target_x[i], units.target_y[i]))
+			continue;
+
+		// plan again if something has been built on our way
+		if (!hpa.refine(occupancy, tile_of(units.x[i], units.y[i], map.w), *r)) {
+			uint32_t goal = r->abstract.back();
+			units.route[i].reset();
+			request(goal, true, std::vector<UnitRef>(1, units.ref[i]));
+		}
+	}
+}
 
 void World::imgtick() {
-	for (auto &x : units)
-		x->imgtick();
+	units.imgtick();
+}
+
+/** Number of units per job. This is a multiple of the width of any movement kernel. */
+static constexpr size_t tick_chunk = 256;
+
+bool World::shove(size_t i) {
+	fixed dx = push_x[i], dy = push_y[i];
+	if (!dx && !dy)
+		return false;
+
+	fixed x = units.x[i] + dx, y = units.y[i] + dy;
+	if (!occupancy.passable(x >> fixed_bits, y >> fixed_bits))
+		return false;
+
+	// units that stand still stay where they have been pushed to
+	if (units.resting(i)) {
+		units.target_x[i] += dx;
+		units.target_y[i] += dy;
+	}
+
+	units.x[i] = x;
+	units.y[i] = y;
+	return true;
+}
+
+/** Squared distance in raw fixed point units. */
+static inline int64_t distance2(fixed x0, fixed y0, fixed x1, fixed y1) noexcept {
+	int64_t dx = static_cast<int64_t>(x1) - x0, dy = static_cast<int64_t>(y1) - y0;
+	return dx * dx + dy * dy;
+}
+
+/** Squared distance of \a tiles tiles in raw fixed point units. */
+static constexpr int64_t tiles2(unsigned tiles) noexcept {
+	return static_cast<int64_t>(tiles) * fixed_one * tiles * fixed_one;
+}
+
+/** Make unit \a i stay where it is, e.g. when it is done fighting. */
+static void stand(Units &u, size_t i) noexcept {
+	u.goal_x[i] = u.target_x[i] = u.x[i];
+	u.goal_y[i] = u.target_y[i] = u.y[i];
+}
+
+UnitRef World::nearest_enemy(size_t i, unsigned los) const {
+	fixed x = units.x[i], y = units.y[i];
+	int tx = x >> fixed_bits, ty = y >> fixed_bits, r = (int)los + 1;
+	int64_t best = tiles2(los);
+	UnitRef found = no_unit;
+
+	// the cells have been built before units were pushed, which the extra tile makes up for
+	cells.each(tx - r, ty - r, tx + r, ty + r, [&](uint32_t k) {
+		if (units.color[k] == units.color[i])
+			return;
+
+		int64_t d = distance2(x, y, units.x[k], units.y[k]);
+		UnitRef ref = units.ref[k];
+
+		if (d < best || (d == best && ref < found)) {
+			best = d;
+			found = ref;
+		}
+	});
+
+	return found;
+}
+
+void World::engage(size_t first, size_t last, CombatChunk &out) {
+	for (size_t i = first; i < last; ++i) {
+		const UnitStats &s = stats.unit(units.color[i], units.type[i]);
+		if (!s.attack || s.attack_type == AttackType::none)
+			continue;
+
+		if (units.cooldown[i])
+			--units.cooldown[i];
+
+		fixed x = units.x[i], y = units.y[i];
+		UnitRef foe = units.foe[i];
+
+		// give up on foes that have escaped
+		if (foe != no_unit) {
+			size_t k = units.index(foe);
+
+			if (distance2(x, y, units.x[k], units.y[k]) > tiles2(s.los)) {
+				foe = no_unit;
+				stand(units, i);
+			}
+		}
+
+		// units that have been sent somewhere mind their own business
+		if (foe == no_unit && unit_aggressive[(unsigned)units.type[i]] && units.resting(i)
+			&& (foe = nearest_enemy(i, s.los)) != no_unit)
+			stand(units, i);
+
+		if (foe != units.foe[i]) {
+			units.foe[i] = foe;
+			out.changed.emplace_back((uint32_t)i);
+		}
+
+		if (foe == no_unit)
+			continue;
+
+		size_t k = units.index(foe);
+
+		if (distance2(x, y, units.x[k], units.y[k]) > tiles2(s.range + 1u)) {
+			units.target_x[i] = units.x[k];
+			units.target_y[i] = units.y[k];
+			continue;
+		}
+
+		units.target_x[i] = x;
+		units.target_y[i] = y;
+
+		if (units.cooldown[i])
+			continue;
+
+		const UnitStats &t = stats.unit(units.color[k], units.type[k]);
+		unsigned armor = s.attack_type == AttackType::melee ? t.melee_armor : t.pierce_armor;
+
+		out.hits.emplace_back(DamageEvent{foe, s.attack > armor ? s.attack - armor : 1u});
+		units.cooldown[i] = (uint16_t)std::max(1u, (s.reload + tick_ms / 2) / tick_ms);
+	}
+}
+
+void World::fight() {
+	size_t n = units.size(), chunks = std::max<size_t>(1, (n + tick_chunk - 1) / tick_chunk);
+
+	if (combat.size() < chunks)
+		combat.resize(chunks);
+
+	// units only change their own state and read that of others, so they can be processed in any order
+	jobs.run(n, tick_chunk, [this](size_t begin, size_t end) {
+		engage(begin, end, combat[begin / tick_chunk]);
+	});
+
+	for (CombatChunk &c : combat) {
+		for (uint32_t i : c.changed)
+			units.rehash(i);
+		c.changed.clear();
+	}
+
+	// apply all damage in one sweep in unit order, so the outcome does not depend on how the work was divided
+	for (CombatChunk &c : combat) {
+		for (const DamageEvent &e : c.hits) {
+			size_t k = units.index(e.target);
+			if (!units.hp[k])
+				continue;
+
+			units.hp[k] = e.damage < units.hp[k] ? units.hp[k] - e.damage : 0;
+			units.rehash(k);
+
+			if (!units.hp[k])
+				dead.emplace_back(e.target);
+		}
+		c.hits.clear();
+	}
+
+	if (dead.empty())
+		return;
+
+	for (UnitRef r : dead)
+		erase_unit(r);
+	dead.clear();
+
+	// references to the dead may be handed out again, so forget them right away
+	for (size_t i = 0, n = units.size(); i < n; ++i)
+		if (units.foe[i] != no_unit && !units.valid(units.foe[i])) {
+			units.foe[i] = no_unit;
+			stand(units, i);
+			units.rehash(i);
+		}
 }
 
 void World::tick() {
-	for (auto& x : units)
-		x->tick(*this);
+	// events that are due now, e.g. buildings that are done training a unit
+	timers.advance(fired);
+	for (const Timer &t : fired)
+		fire(t);
+	fired.clear();
+
+	// paths that have been requested path_delay ticks ago
+	paths.take(now, due);
+	for (auto &r : due)
+		deliver(*r);
+	due.clear();
+
+	refine();
+
+	// movement: units only touch their own state, so they can be processed in any order
+	facing.resize(units.size());
+	jobs.run(units.size(), tick_chunk, [this](size_t begin, size_t end) {
+		units.steer(begin, end, map.w);
+		units.move(begin, end, facing.data(), simd);
+	});
+
+	// avoidance: units push each other apart based on where everyone has moved to
+	size_t n = units.size();
+	cells.build(units.x.data(), units.y.data(), n);
+	push_x.resize(n);
+	push_y.resize(n);
+	halt.resize(n);
+
+	jobs.run(n, tick_chunk, [this](size_t begin, size_t end) {
+		units.separate(begin, end, cells, push_x.data(), push_y.data(), halt.data());
+	});
+
+	// merge in unit order, so the outcome does not depend on how the work was divided.
+	// img_dim is not thread safe, so this cannot be done by the workers.
+	for (size_t i = 0; i < n; ++i) {
+		if (halt[i]) {
+			units.flow[i].reset();
+			units.route[i].reset();
+			units.target_x[i] = units.x[i];
+			units.target_y[i] = units.y[i];
+		}
+
+		if (!shove(i) && !facing[i])
+			continue;
+
+		Box2<float> old(units.scr[i]);
+		units.moved(i, facing[i], map);
+		unit_grid.move(units.ref[i], old, units.scr[i]);
+
+		// only units that enter another tile change what their player sees
+		uint32_t eye = tile_of(units.x[i], units.y[i], map.w);
+		if (eye != units.eye[i]) {
+			fog.move(units.color[i], units.eye[i] % map.w, units.eye[i] / map.w, eye % map.w, eye / map.w, units.sight[i]);
+			units.eye[i] = eye;
+		}
+	}
+
+	fight();
+
+	++now;
+	// get a head start on the requests of the next ticks
+	paths.help();
+}
+
+uint64_t World::checksum() const noexcept {
+	return hash_mix(units.checksum + units.positions() + hash_mix(statics + now));
+}
+
+void World::dump(FILE *f) const {
+	fprintf(f, "tick %" PRIu32 " checksum %016" PRIx64 "\n", now, checksum());
+
+	// dense indices depend on the order in which units have been removed, so list them by reference
+	std::vector<size_t> order(units.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return units.ref[a] < units.ref[b]; });
+
+	for (size_t i : order)
+		fprintf(f, "unit %" PRIu32 " type %u player %u at %" PRId32 ",%" PRId32 " target %" PRId32 ",%" PRId32 " goal %" PRId32 ",%" PRId32 " hp %u/%u path %" PRIu32 " foe %" PRId32 " cooldown %u digest %016" PRIx64 "\n",
+			units.ref[i], (unsigned)units.type[i], units.color[i], units.x[i], units.y[i], units.target_x[i], units.target_y[i],
+			units.goal_x[i], units.goal_y[i], units.hp[i], units.hp_max[i], units.path[i], (int32_t)units.foe[i], units.cooldown[i], units.digest[i]);
+
+	for (auto &b : buildings)
+		b->dump(f);
+
+	for (auto &r : static_res)
+		r->dump(f);
+
+	for (const TileResource &c : map.forest.all())
+		fprintf(f, "tree at %u,%u type %u amount %u\n", c.x, c.y, c.type, c.amount);
+}
+
+size_t World::save(const char *path) const {
+	SnapshotWriter w;
+
+	*w.alloc<SnapshotMeta>(SnapshotSection::meta, 1) = SnapshotMeta{now, map.w, map.h, paths.upcoming(), stats.size(), timers.next_seq(), {0, 0}, checksum()};
+	map.terrain.save(w);
+
+	ResourceRecord *res = w.alloc<ResourceRecord>(SnapshotSection::resources, static_res.size());
+	for (auto &r : static_res)
+		*res++ = r->record();
+
+	BuildingRecord *build = w.alloc<BuildingRecord>(SnapshotSection::buildings, buildings.size());
+	size_t queued = 0;
+
+	for (auto &b : buildings) {
+		*build++ = b->record();
+		queued += b->queue().size();
+	}
+
+	uint32_t *prod = w.alloc<uint32_t>(SnapshotSection::production, queued);
+	for (auto &b : buildings)
+		for (const Production &p : b->queue())
+			*prod++ = (uint32_t)p.what;
+
+	std::vector<Timer> pending;
+	timers.pending(pending);
+	w.add(SnapshotSection::timers, pending);
+
+	w.add(SnapshotSection::building_slots, building_slots.all());
+	std::copy(building_slots.free().begin(), building_slots.free().end(), w.alloc<uint32_t>(SnapshotSection::building_freelist, building_slots.free().size()));
+	w.add(SnapshotSection::resource_slots, resource_slots.all());
+	std::copy(resource_slots.free().begin(), resource_slots.free().end(), w.alloc<uint32_t>(SnapshotSection::resource_freelist, resource_slots.free().size()));
+	w.add(SnapshotSection::forest, map.forest.all());
+
+	w.add(SnapshotSection::stat_modifiers, stats.modifiers());
+	w.add(SnapshotSection::explored, fog.explored());
+	units.save(w);
+
+	// pending requests are part of the state: their results are applied at a fixed tick
+	size_t requests = 0, waiting = 0;
+	paths.each([&](const PathRequest &r) {
+		++requests;
+		waiting += r.units.size();
+	});
+
+	PathRecord *rec = w.alloc<PathRecord>(SnapshotSection::paths, requests);
+	uint32_t *refs = w.alloc<uint32_t>(SnapshotSection::path_units, waiting);
+
+	paths.each([&](const PathRequest &r) {
+		*rec++ = PathRecord{r.id, r.due, r.start, r.goal, r.single, (uint32_t)r.units.size()};
+		refs = std::copy(r.units.begin(), r.units.end(), refs);
+	});
+
+	return w.write(path);
+}
+
+void World::load(const char *path) {
+	SnapshotReader snap(path);
+	const SnapshotMeta &meta = *snap.get<SnapshotMeta>(SnapshotSection::meta, 1, "meta data");
+
+	if (meta.map_w != map.w || meta.map_h != map.h)
+		throw std::runtime_error(std::string(path) + ": map size does not match");
+
+	size_t requests, count;
+	const PathRecord *rec = snap.get<PathRecord>(SnapshotSection::paths, requests);
+
+	// requests are numbered in submission order, so they get the same ids when they are submitted again
+	paths.reset(requests ? rec[0].id : meta.next_path);
+
+	{
+		auto lock(paths.change());
+
+		map.terrain.load(snap);
+
+		static_grid.clear();
+		static_res.clear();
+		buildings.clear();
+		statics = 0;
+		occupancy = Occupancy(map.w, map.h);
+
+		const ResourceRecord *res = snap.get<ResourceRecord>(SnapshotSection::resources, count);
+		static_res.reserve(count);
+		resource_pool.reserve(count);
+
+		for (size_t i = 0; i < count; ++i) {
+			if (res[i].type >= sizeof res_amount / sizeof res_amount[0])
+				throw std::runtime_error("snapshot: corrupt resource " + std::to_string(i));
+
+			static_res.emplace_back(resource_pool.create(map, res[i]));
+			StaticResource *r = static_res.back().get();
+
+			statics += r->digest();
+			static_grid.insert(r, r->scr);
+			occupancy.update(static_cast<int>(r->pos.left), static_cast<int>(r->pos.top), 1, 1, true, changed);
+		}
+
+		const TileResource *cells = snap.get<TileResource>(SnapshotSection::forest, count);
+		trees.clear();
+
+		for (size_t i = 0; i < count; ++i)
+			if (cells[i].type >= sizeof res_amount / sizeof res_amount[0] || !cells[i].amount)
+				throw std::runtime_error("snapshot: corrupt tree " + std::to_string(i));
+
+		if (!map.forest.assign(std::vector<TileResource>(cells, cells + count)))
+			throw std::runtime_error("snapshot: trees off the map or on top of each other");
+
+		for (const TileResource &c : map.forest.all()) {
+			statics += digest(c);
+			occupancy.update(c.x, c.y, 1, 1, true, changed);
+		}
+
+		const BuildingRecord *build = snap.get<BuildingRecord>(SnapshotSection::buildings, count);
+		size_t queued;
+		const uint32_t *prod = snap.get<uint32_t>(SnapshotSection::production, queued);
+
+		for (size_t i = 0; i < count; ++i) {
+			if (build[i].type >= building_type_count || build[i].queued > production_max || build[i].queued > queued)
+				throw std::runtime_error("snapshot: corrupt building " + std::to_string(i));
+
+			buildings.emplace_back(building_pool.create(map, build[i]));
+			Building *b = buildings.back().get();
+			unsigned size = building_stats[build[i].type].size;
+
+			for (uint32_t k = 0; k < build[i].queued; ++k, --queued) {
+				if (*prod != (uint32_t)build_trains[build[i].type])
+					throw std::runtime_error("snapshot: corrupt production of building " + std::to_string(i));
+
+				b->enqueue((UnitType)*prod++);
+			}
+
+			statics += b->digest();
+			static_grid.insert(b, b->scr);
+			occupancy.update(static_cast<int>(b->pos.left), static_cast<int>(b->pos.top), size, size, true, changed);
+		}
+
+		// handles of buildings and resources are stored in their slot maps only
+		auto handles = [&snap](SlotMap &m, SnapshotSection slots, SnapshotSection free, auto &all, const char *what) {
+			size_t slot_count, free_count;
+			const Slot *s = snap.get<Slot>(slots, slot_count);
+			const uint32_t *f = snap.get<uint32_t>(free, free_count);
+
+			if (!m.restore(s, slot_count, f, free_count, all.size()))
+				throw std::runtime_error(std::string("snapshot: corrupt ") + what + " slots");
+
+			for (uint32_t k = 0; k < slot_count; ++k)
+				if (s[k].index != SlotMap::no_index)
+					all[s[k].index]->id = m.handle(k);
+		};
+
+		handles(building_slots, SnapshotSection::building_slots, SnapshotSection::building_freelist, buildings, "building");
+		handles(resource_slots, SnapshotSection::resource_slots, SnapshotSection::resource_freelist, static_res, "resource");
+
+		changed.clear();
+		flows.clear();
+		hpa.build(occupancy, jobs);
+	}
+
+	const StatModifier *mods = snap.get<StatModifier>(SnapshotSection::stat_modifiers, count);
+	stats.clear();
+	stats.reserve(meta.players);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (!stats.modify(mods[i]))
+			throw std::runtime_error("snapshot: corrupt stat modifier " + std::to_string(i));
+
+		statics += digest(mods[i], i);
+	}
+
+	// what the players see follows from their units, but what they have explored does not
+	const uint64_t *explored = snap.get<uint64_t>(SnapshotSection::explored, count);
+	fog.clear();
+	fog.reserve(meta.players);
+
+	if (!fog.explored(explored, count))
+		throw std::runtime_error("snapshot: bad length of explored tiles");
+
+	units.load(snap, map);
+	unit_grid.clear();
+
+	for (size_t i = 0, n = units.size(); i < n; ++i) {
+		if (units.color[i] >= meta.players)
+			throw std::runtime_error("snapshot: bad player of unit " + std::to_string(i));
+
+		unit_grid.insert(units.ref[i], units.scr[i]);
+
+		units.eye[i] = tile_of(units.x[i], units.y[i], map.w);
+		units.sight[i] = stats.unit(units.color[i], units.type[i]).los;
+		fog.add(units.color[i], units.eye[i] % map.w, units.eye[i] / map.w, units.sight[i]);
+	}
+
+	now = meta.tick;
+
+	const Timer *pending = snap.get<Timer>(SnapshotSection::timers, count);
+	timers.reset(meta.tick, meta.next_timer);
+	fired.clear();
+
+	for (size_t i = 0; i < count; ++i) {
+		const Building *b = building(pending[i].target);
+
+		if (!b || b->queue().empty() || b->done() != pending[i].due || !timers.restore(pending[i]))
+			throw std::runtime_error("snapshot: corrupt timer " + std::to_string(i));
+	}
+
+	const uint32_t *refs = snap.get<uint32_t>(SnapshotSection::path_units, count);
+
+	for (size_t k = 0; k < requests; ++k) {
+		if (rec[k].units > count)
+			throw std::runtime_error("snapshot: corrupt path request " + std::to_string(k));
+
+		uint32_t id = paths.submit(rec[k].due, rec[k].start, rec[k].goal, rec[k].single != 0, std::vector<uint32_t>(refs, refs + rec[k].units));
+		if (id != rec[k].id)
+			throw std::runtime_error("snapshot: path requests are not numbered consecutively");
+
+		refs += rec[k].units;
+		count -= rec[k].units;
+	}
+
+	if (checksum() != meta.checksum)
+		throw std::runtime_error(std::string(path) + ": checksum does not match");
 }
 
 void World::query_static(std::vector<Particle*> &list, const Box2<float> &bounds) {
-	for (auto &x : static_res)
-		if (bounds.intersects(x->scr))
-			list.push_back(x.get());
+	static_grid.query(bounds, [&](Particle *p) {
+		if (bounds.intersects(p->scr))
+			list.push_back(p);
+	});
+
+	// tiles whose trees may reach into bounds: sprites stick out of their tile by a few tiles at most
+	float x[4], y[4];
+	scr_to_tile(x[0], y[0], bounds.left, bounds.top);
+	scr_to_tile(x[1], y[1], bounds.right(), bounds.top);
+	scr_to_tile(x[2], y[2], bounds.left, bounds.bottom());
+	scr_to_tile(x[3], y[3], bounds.right(), bounds.bottom());
+
+	int x0 = (int)*std::min_element(x, x + 4) - tree_reach, x1 = (int)*std::max_element(x, x + 4) + tree_reach;
+	int y0 = (int)*std::min_element(y, y + 4) - tree_reach, y1 = (int)*std::max_element(y, y + 4) + tree_reach;
+
+	x0 = std::max(x0, 0);
+	y0 = std::max(y0, 0);
+	x1 = std::min<int>(x1, map.w - 1);
+	y1 = std::min<int>(y1, map.h - 1);
+
+	++tree_query;
+
+	if (x0 <= x1 && y0 <= y1)
+		map.forest.each(x0, y0, x1, y1, [&](const TileResource &c) {
+			if (c.variant >= tree_scr.size())
+				tree_scr.resize(c.variant + 1);
+
+			Box2<float> &scr = tree_scr[c.variant];
+			if (!scr.w) {
+				int hx, hy;
+				scr = map.tile_to_scr(Vector2<float>(0, 0), hx, hy, (unsigned)DrsId::desert_tree + c.variant, 0);
+			}
+
+			float left, top;
+			tile_to_scr(left, top, (float)c.x, (float)c.y);
+
+			if (!bounds.intersects(Box2<float>(scr.left + left, scr.top + top, scr.w, scr.h)))
+				return;
+
+			Pooled<Tree> &t = trees[c.y * map.w + c.x];
+			if (!t)
+				t = tree_pool.create(map, c);
+
+			t->seen = tree_query;
+
+			list.push_back(t.get());
+		});
 
-	for (auto &x : buildings)
-		if (bounds.intersects(x->scr))
-			list.push_back(x.get());
+	// forget trees that have dropped out of view, so scrolling over the map does not make a particle for each one
+	for (auto it = trees.begin(); it != trees.end();)
+		if (tree_query - it->second->seen > 1)
+			it = trees.erase(it);
+		else
+			++it;
 }
 
-void World::query_dynamic(std::vector<Particle*> &list, const Box2<float> &bounds) {
-	for (auto &x : units)
-		if (bounds.intersects(x->scr))
-			list.push_back(x.get());
+void World::query_dynamic(std::vector<UnitRef> &list, const Box2<float> &bounds) {
+	unit_grid.query(bounds, [&](UnitRef r) {
+		if (bounds.intersects(units.scr[units.index(r)]))
+			list.push_back(r);
+	});
 }
 
 }
@@ -6,13 +6,30 @@
 #include "random.hpp"
 #include "math.hpp"
 #include "geom.hpp"
+#include "jobs.hpp"
+#include "net.hpp"
+#include "path.hpp"
+#include "hpa.hpp"
+#include "pathqueue.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+#include "crowd.hpp"
+#include "fog.hpp"
+#include "forest.hpp"
+#include "terrain.hpp"
+#include "handle.hpp"
+#include "pool.hpp"
+#include "timer.hpp"
 
 #include <cassert>
+#include <cmath>
+#include <cstdio>
 
 #include <array>
 #include <memory>
 #include <vector>
 #include <set>
+#include <unordered_map>
 #include <algorithm>
 #include <deque>
 
@@ -100,14 +117,93 @@ public:
 	}
 };
 
+/**
+ * Uniform bucketed grid in screen space. Objects are bucketed by their top-left corner, so
+ * queries are widened by the largest object extent seen so far to find every object that
+ * overlaps the query area. The caller is responsible for the final intersection test.
+ */
+template<typename T> class SpatialGrid final {
+	Box2<float> area;
+	float cell;
+	unsigned cols, rows;
+	float max_w, max_h;
+	std::vector<std::vector<T>> cells;
+public:
+	SpatialGrid(const Box2<float> &area, float cell=256)
+		: area(area), cell(cell)
+		, cols(std::max(1u, static_cast<unsigned>(ceil(area.w / cell))))
+		, rows(std::max(1u, static_cast<unsigned>(ceil(area.h / cell))))
+		, max_w(0), max_h(0), cells((size_t)cols * rows) {}
+
+private:
+	/** Clamp coordinates to the grid: anything outside the covered area ends up in the border cells. */
+	unsigned col(float x) const noexcept {
+		float c = (x - area.left) / cell;
+		return c < 0 ? 0 : std::min(static_cast<unsigned>(c), cols - 1);
+	}
+
+	unsigned row(float y) const noexcept {
+		float r = (y - area.top) / cell;
+		return r < 0 ? 0 : std::min(static_cast<unsigned>(r), rows - 1);
+	}
+
+	std::vector<T> &bucket(const Box2<float> &scr) {
+		return cells[(size_t)row(scr.top) * cols + col(scr.left)];
+	}
+public:
+	void insert(const T &v, const Box2<float> &scr) {
+		max_w = std::max(max_w, scr.w);
+		max_h = std::max(max_h, scr.h);
+		bucket(scr).emplace_back(v);
+	}
+
+	void erase(const T &v, const Box2<float> &scr) {
+		auto &b = bucket(scr);
+		auto it = std::find(b.begin(), b.end(), v);
+		assert(it != b.end());
+		*it = b.back();
+		b.pop_back();
+	}
+
+	/** Update bookkeeping for \a v that has been moved from \a from to \a to. */
+	void move(const T &v, const Box2<float> &from, const Box2<float> &to) {
+		if (col(from.left) == col(to.left) && row(from.top) == row(to.top)) {
+			max_w = std::max(max_w, to.w);
+			max_h = std::max(max_h, to.h);
+			return;
+		}
+
+		erase(v, from);
+		insert(v, to);
+	}
+
+	/** Invoke \a f for every object that may intersect \a bounds. */
+	template<typename F> void query(const Box2<float> &bounds, F f) const {
+		unsigned c0 = col(bounds.left - max_w), c1 = col(bounds.right());
+		unsigned r0 = row(bounds.top - max_h), r1 = row(bounds.bottom());
+
+		for (unsigned r = r0; r <= r1; ++r)
+			for (unsigned c = c0; c <= c1; ++c)
+				for (const T &v : cells[(size_t)r * cols + c])
+					f(v);
+	}
+
+	void clear() {
+		for (auto &b : cells)
+			b.clear();
+		max_w = max_h = 0;
+	}
+};
+
 extern void img_dim(Box2<float> &dim, int &hotspot_x, int &hotspot_y, unsigned res, unsigned image);
 
 class Map final {
 public:
 	unsigned w, h;
-	std::unique_ptr<uint8_t[]> tiles, heights; // y,x order
+	Terrain terrain;
+	Forest forest;
 
-	Map(LCG &lcg, const StartMatch &settings);
+	Map(const Philox &rng, const StartMatch &settings);
 
 	Box2<float> tile_to_scr(const Vector2<float> &pos, int &hotspot_x, int &hotspot_y, unsigned res, unsigned image) {
 		Box2<float> scr;
@@ -119,13 +215,6 @@ public:
 	}
 };
 
-enum class ResourceType {
-	wood,
-	food,
-	gold,
-	stone,
-};
-
 enum class GatherStatus {
 	ok,
 	incompatible,
@@ -142,8 +231,6 @@ public:
 	GatherStatus gather(Resource &dest, unsigned amount=1);
 };
 
-extern uint32_t particle_id_counter;
-
 /**
  * Most abstract non-tiled world object. This may be an effect (e.g. debris, dead units, ...)
  * or static resources (trees, berry bushes, ...) or dynamic stuff (e.g. deer, clubman, ...)
@@ -156,30 +243,24 @@ protected:
 	unsigned anim_index;
 	unsigned image_index;
 	unsigned color;
-	uint32_t id;
+	Handle id; /**< assigned by the world to anything that is part of the simulation */
 	bool hflip;
 
 	// special ctor for e.g. effects that do not care about the tile position \a pos
 	Particle(const Box2<float> &scr, unsigned anim_index, unsigned image_index=0, unsigned color=0, bool hflip=false)
 		: pos(), scr(scr), anim_index(anim_index), image_index(image_index), color(color)
-		, id(particle_id_counter), hflip(hflip)
-	{
-		// disallow particle_id_counter to be zero
-		particle_id_counter = particle_id_counter == UINT32_MAX ? 1 : particle_id_counter + 1;
-	}
+		, id(no_handle), hflip(hflip) {}
 
 	// default ctor for anything that is not a graphical effect
 	Particle(Map &map, const Box2<float> &pos, unsigned anim_index, unsigned image_index=0, unsigned color=0, bool hflip=false)
 		: pos(pos), scr(map.tile_to_scr(pos.topleft(), hotspot_x, hotspot_y, anim_index, image_index)), anim_index(anim_index), image_index(image_index), color(color)
-		, id(particle_id_counter), hflip(hflip)
-	{
-		// disallow particle_id_counter to be zero
-		particle_id_counter = particle_id_counter == UINT32_MAX ? 1 : particle_id_counter + 1;
-	}
+		, id(no_handle), hflip(hflip) {}
+
+	friend class World;
 public:
 	virtual ~Particle() {}
 
-	constexpr uint32_t getid() const noexcept {
+	constexpr Handle getid() const noexcept {
 		return id;
 	}
 
@@ -225,7 +306,7 @@ public:
 
 #undef min
 
-class Alive : public Active {
+class Alive {
 public:
 	unsigned hp, hp_max;
 
@@ -243,43 +324,69 @@ public:
 	}
 };
 
-enum class UnitType {
-	villager,
-	clubman,
-};
+/** Maximum number of units that can be queued in one building. */
+static constexpr unsigned production_max = 5;
 
+/** Unit that is queued for training. */
 class Production final {
 public:
 	UnitType what;
-	unsigned ticks, total;
-
-	Production(UnitType what, unsigned ticks);
-
-	bool tick();
-};
 
-enum class BuildingType {
-	barracks,
-	town_center
+	explicit Production(UnitType what) : what(what) {}
 };
 
+/**
+ * Buildings do nothing by themselves: the world schedules a timer for the moment the unit
+ * in front of the queue is done, so buildings cost nothing while they are waiting.
+ */
 class Building final : public Particle, public Alive {
 	unsigned anim_player;
 	unsigned player;
 	std::deque<Production> prod;
+	uint32_t ready; /**< tick at which the front of prod is done */
 
 public:
 	const BuildingType type;
 
 	Building(Map &map, const Box2<float> &pos, BuildingType type, unsigned player=0);
+	Building(Map &map, const BuildingRecord &r);
+
+	unsigned owner() const noexcept { return player; }
+	const std::deque<Production> &queue() const noexcept { return prod; }
+	uint32_t done() const noexcept { return ready; }
+
+	/** Add \a what to the queue. Returns false if the queue is full. */
+	bool enqueue(UnitType what);
+	/** Start training the front of the queue, which is done at tick \a when. */
+	void start(uint32_t when) noexcept { ready = when; }
+	/** Remove the front of the queue once it is done. */
+	void finish() { prod.pop_front(); }
 
-	void tick(World &world) override;
 	void draw(int offx, int offy) const override;
+
+	/** Hash of all simulation state. */
+	uint64_t digest() const noexcept;
+	void dump(FILE *f) const;
+	BuildingRecord record() const noexcept;
+};
+
+/** Drawable stand-in for a tree of the forest of the map. It is made once it becomes visible and is not part of the simulation. */
+class Tree final : public Particle {
+public:
+	uint32_t seen; /**< query_static call that has returned it last */
+
+	Tree(Map &map, const TileResource &c);
 };
 
 class StaticResource final : public Particle, public Resource {
 public:
 	StaticResource(Map &map, const Box2<float> &pos, ResourceType type, unsigned res_anim, unsigned image=0);
+	StaticResource(Map &map, const ResourceRecord &r);
+
+	/** Hash of all simulation state. */
+	uint64_t digest() const noexcept;
+	void dump(FILE *f) const;
+	ResourceRecord record() const noexcept;
 };
 
 enum class UnitDirection {
@@ -294,40 +401,184 @@ enum class UnitDirection {
 	down_right
 };
 
-class Unit : public Particle, public Alive {
-	UnitType type;
-	UnitDirection dir; /**< indicates which direction the unit is facing */
-	unsigned dir_images;
-	float movespeed;
-	Vector2<float> target; /**< map pos target. this never represents a screen position! */
+/** Stable reference to a unit. Unlike its index in Units, it remains valid when other units are removed. */
+typedef Handle UnitRef;
+
+static constexpr UnitRef no_unit = no_handle;
+
+/**
+ * All units in structure-of-arrays layout. Fields that are touched every tick are kept in
+ * separate contiguous arrays so the simulation can stream over them. Each unit is stored at
+ * a dense index that changes when other units are removed: use UnitRef to keep track of a
+ * particular unit.
+ */
+class Units final {
 public:
-	Unit(Map &map, const Box2<float> &pos, UnitType type, unsigned player);
-	virtual ~Unit() {}
+	// movement. map positions never represent a screen position!
+	std::vector<fixed> x, y, target_x, target_y;
+	std::vector<fixed> movespeed; /**< tiles per tick */
+	std::vector<fixed> goal_x, goal_y; /**< final destination if the unit follows a flow field */
+	std::vector<std::shared_ptr<const FlowField>> flow;
+	std::vector<std::unique_ptr<Route>> route; /**< used instead of a flow field for long single unit paths */
+	std::vector<uint32_t> path; /**< id of path request the unit waits for, zero if none */
+
+	// animation
+	std::vector<UnitDirection> dir; /**< indicates which direction the unit is facing */
+	std::vector<unsigned> image_index;
+	std::vector<Box2<float>> scr;
+	std::vector<int> hotspot_x, hotspot_y;
+
+	std::vector<unsigned> hp, hp_max;
+
+	// combat
+	std::vector<UnitRef> foe; /**< unit that is being attacked or no_unit */
+	std::vector<uint16_t> cooldown; /**< ticks until the next attack */
+
+	// fog of war. both follow from the position and the stats, so they are not saved
+	std::vector<uint32_t> eye; /**< tile from which the unit sees its surroundings */
+	std::vector<uint8_t> sight; /**< radius in tiles of what the unit sees from its eye */
+
+	// rarely changed
+	std::vector<UnitType> type;
+	std::vector<unsigned> anim_index, dir_images, color;
+	std::vector<UnitRef> ref;
+
+	/**
+	 * Hash of the simulation state of each unit except its position. Anything that changes a hashed
+	 * field (see hash) has to call rehash, so the checksum is always up-to-date. Positions change
+	 * nearly every tick, so keeping track of them costs more than adding them up in positions.
+	 */
+	std::vector<uint64_t> digest;
+	uint64_t checksum; /**< sum of all digests */
+private:
+	SlotMap slots; /**< maps UnitRef to dense index */
+public:
+	Units() : x(), y(), target_x(), target_y(), movespeed(), goal_x(), goal_y(), flow(), route(), path(), dir(), image_index(), scr(), hotspot_x(), hotspot_y()
+		, hp(), hp_max(), foe(), cooldown(), eye(), sight(), type(), anim_index(), dir_images(), color(), ref(), digest(), checksum(0), slots(EntityKind::unit) {}
+
+	size_t size() const noexcept { return x.size(); }
+
+	bool valid(UnitRef r) const noexcept {
+		return slots.valid(r);
+	}
+
+	size_t index(UnitRef r) const noexcept {
+		assert(valid(r));
+		return slots.index(r);
+	}
+
+	bool hflip(size_t i) const noexcept {
+		return dir[i] >= UnitDirection::top_right;
+	}
+
+	float depth(size_t i) const noexcept {
+		return scr[i].top + hotspot_y[i];
+	}
+
+	/** Add unit that faces a direction drawn from the units substream of \a rng for its handle. */
+	UnitRef add(Map &map, const Philox &rng, const Vector2<fixed> &pos, UnitType type, unsigned player, const UnitStats &stats);
+	/** Remove unit. The last unit takes its place, so any dense indices are invalidated. */
+	void erase(UnitRef r);
+
+	void imgtick() noexcept;
+	/** Pick next waypoint for units [first, last) that have reached their current one on a map that is \a w tiles wide. */
+	void steer(size_t first, size_t last, unsigned w) noexcept;
+	/** Advance units [first, last) towards their target. See move_scalar for what \a facing contains. */
+	void move(size_t first, size_t last, uint8_t *facing, bool simd) noexcept;
+	/**
+	 * Compute how far units [first, last) are pushed away by their neighbours in \a cells and
+	 * whether they should stop because they have run into group members that have arrived.
+	 */
+	void separate(size_t first, size_t last, const UnitCells &cells, fixed *push_x, fixed *push_y, uint8_t *halt) const noexcept;
+	/** Update facing direction and screen area of unit \a i after it has moved. If \a facing is zero, it has only been pushed. */
+	void moved(size_t i, uint8_t facing, Map &map);
 
-	virtual void imgtick();
-	virtual void tick(World &world) override;
-	virtual void draw(int offx, int offy) const override;
+	/** Whether unit \a i stands still and has got nowhere to go. */
+	bool resting(size_t i) const noexcept;
+
+	/**
+	 * Hash of the destination, pending path, health, foe and owner of unit \a i. Targets, flow fields,
+	 * routes and cooldowns are left out: they follow from the other fields and any difference in them
+	 * shows up in the position or health soon.
+	 */
+	uint64_t hash(size_t i) const noexcept;
+	/** Update digest of unit \a i after any of its hashed fields has changed. */
+	void rehash(size_t i) noexcept;
+	/** Hash of all positions. Each one is weighted by the digest of its unit, so units cannot be swapped unnoticed. */
+	uint64_t positions() const noexcept;
+
+	/** Add all columns to \a w. The columns must not change until the snapshot has been written. */
+	void save(SnapshotWriter &w) const;
+	/** Replace all units by the ones in \a snap. Throws std::runtime_error if the snapshot is inconsistent. */
+	void load(const SnapshotReader &snap, Map &map);
+
+	void draw(size_t i, int offx, int offy) const;
 };
 
-class Villager final : public Unit {
-public:
-	Villager(Map &map, const Box2<float> &pos, unsigned player);
+/** Damage dealt to one unit in one tick. */
+struct DamageEvent final {
+	UnitRef target;
+	unsigned damage;
+};
+
+/** Outcome of the combat pass over one chunk of units. Kept between ticks, so the buffers are reused. */
+struct CombatChunk final {
+	std::vector<DamageEvent> hits; /**< in order of the attackers */
+	std::vector<uint32_t> changed; /**< dense indices of attackers whose hashed state has changed */
 };
 
 /** Container for all particles, entities, etc. */
 class World final {
 public:
 	Map map;
-	LCG &lcg;
+	Philox rng; /**< all randomness in the world is drawn from substreams of this */
 	bool host;
 
 private:
-	std::vector<std::unique_ptr<StaticResource>> static_res;
-	std::vector<std::unique_ptr<Building>> buildings;
-	std::vector<std::unique_ptr<Unit>> units;
+	// the pools have to outlive everything they own
+	Pool<StaticResource> resource_pool;
+	Pool<Building> building_pool;
+	Pool<Tree> tree_pool;
+	std::vector<Pooled<StaticResource>> static_res;
+	std::vector<Pooled<Building>> buildings;
+	SlotMap building_slots, resource_slots; /**< map handles to indices in buildings and static_res */
+	std::unordered_map<uint32_t, Pooled<Tree>> trees; /**< trees that are visible by tile */
+	uint32_t tree_query; /**< number of calls to query_static */
+	std::vector<Box2<float>> tree_scr; /**< screen area of a tree at tile 0,0 by variant, made on demand */
+	uint64_t statics; /**< sum of digests of all buildings, static resources, trees and stat modifiers */
+	PlayerStats stats;
+
+	Occupancy occupancy;
+	FlowCache flows;
+	HpaGraph hpa;
+	std::vector<uint32_t> changed; /**< tiles whose passability has changed */
+
+	PathQueue paths;
+	std::vector<std::unique_ptr<PathRequest>> due;
+	uint32_t now; /**< number of ticks computed so far */
+
+	SpatialGrid<Particle*> static_grid;
+	SpatialGrid<UnitRef> unit_grid;
+
+	bool simd; /**< whether the map is small enough for the vectorized movement kernel */
+	std::vector<uint8_t> facing;
+	UnitCells cells;
+	std::vector<fixed> push_x, push_y;
+	std::vector<uint8_t> halt;
+	std::vector<CombatChunk> combat; /**< one per job of the combat pass */
+	std::vector<UnitRef> dead;
+
+	Fog fog;
+	TimerWheel timers;
+	std::vector<Timer> fired;
+
+	JobPool jobs;
 
 public:
-	World(LCG &lcg, const StartMatch &settings, bool host);
+	Units units;
+
+	/** Create world that runs the simulation on \a threads additional worker threads. */
+	World(const Philox &rng, const StartMatch &settings, bool host, unsigned threads=0);
 
 	void populate(unsigned players);
 	/**
@@ -339,12 +590,93 @@ public:
 	/**
 	 * Compute the next simulation step and use the mp for any events that are generated.
 	 * If the world is created as host, this will also send messages to other clients.
+	 * The outcome does not depend on the number of worker threads.
 	 */
 	void tick();
 
+	UnitRef add_unit(const Vector2<float> &pos, UnitType type, unsigned player);
+	void erase_unit(UnitRef r);
+
+	void add_building(const Box2<float> &pos, BuildingType type, unsigned player);
+
+	/** Apply stat modifier \a m, which also affects all units of its player that exist. Returns false if it is invalid. */
+	bool modify(const StatModifier &m);
+	const PlayerStats &player_stats() const noexcept { return stats; }
+	/** What each player sees and has explored. */
+	const Fog &fog_of_war() const noexcept { return fog; }
+	/** Let \a player explore the whole map, and see all of it if \a lift. */
+	void reveal(unsigned player, bool lift);
+	const std::vector<Pooled<Building>> &all_buildings() const noexcept { return buildings; }
+	/** Building with handle \a h or NULL if it does not exist (anymore). */
+	Building *building(Handle h) const noexcept {
+		return building_slots.valid(h) ? buildings[building_slots.index(h)].get() : NULL;
+	}
+	/** Remove resource that has been depleted from the world. */
+	void deplete(StaticResource *r);
+	/** Take up to \a amount from the tree at tile \a x, \a y and fell it once it is used up. Returns what has been taken. */
+	unsigned harvest(unsigned x, unsigned y, unsigned amount);
+	/** Take up to \a amount from resource \a h into \a dest and remove it once it is used up. Resources must only be gathered this way. */
+	GatherStatus gather(Handle h, Resource &dest, unsigned amount=1);
+
+	/**
+	 * Execute player orders. Orders for units that do not exist or do not belong to the player are ignored.
+	 * Units that are sent to the same destination share a flow field, while single units that go far use HPA*.
+	 * The units stop right away, but only start walking once their path request is due.
+	 */
+	void apply(const std::vector<Order> &orders);
+
+	/**
+	 * All buildings, resources and trees that intersect screen area \a bounds. Trees only have a
+	 * particle while they are visible: it is made when a query returns the tree and freed when
+	 * neither this nor the previous query has returned it. Particles of trees thus remain valid
+	 * until the second next call or until the tree is felled.
+	 */
 	void query_static(std::vector<Particle*> &list, const Box2<float> &bounds);
-	// FIXME change type to Unit*
-	void query_dynamic(std::vector<Particle*> &list, const Box2<float> &bounds);
+	void query_dynamic(std::vector<UnitRef> &list, const Box2<float> &bounds);
+
+	/** Number of ticks computed so far. */
+	uint32_t ticks() const noexcept { return now; }
+	/** Hash of the complete simulation state. Everything but the unit positions is kept up-to-date as it changes. */
+	uint64_t checksum() const noexcept;
+	/** Write all simulation state in a human readable form that can be compared with other peers. */
+	void dump(FILE *f) const;
+
+	/** Write snapshot of the simulation state to \a path and return its size in bytes. Throws std::runtime_error on failure. */
+	size_t save(const char *path) const;
+	/**
+	 * Replace the simulation state by snapshot \a path, which must have been taken of a map with the same
+	 * size. Throws std::runtime_error on failure, in which case the state of the world is undefined.
+	 */
+	void load(const char *path);
+
+	const FlowCache &flow_cache() const noexcept { return flows; }
+	PathQueue &path_queue() noexcept { return paths; }
+private:
+	/** Ask for a path to tile \a goal for all \a refs. If \a single, the path is planned from the position of the only unit. */
+	void request(uint32_t goal, bool single, const std::vector<UnitRef> &refs);
+	/** Hand result of \a r to all units that still wait for it. */
+	void deliver(PathRequest &r);
+	/** Queue a unit in a building as requested by order \a o. */
+	void train(const Order &o);
+	/** Schedule the end of the training of the front of the queue of building \a b. */
+	void produce(Building &b);
+	/** Handle timer \a t, which is due now. */
+	void fire(const Timer &t);
+	/** Refine the route of units that have walked the refined part of their route. */
+	void refine();
+	/** Move unit \a i by the amount it has been pushed, unless it would end up on a blocked tile. Returns whether it has moved. */
+	bool shove(size_t i);
+	/** Closest unit of another player that unit \a i can see within \a los tiles, or no_unit. */
+	UnitRef nearest_enemy(size_t i, unsigned los) const;
+	/**
+	 * Let units [first, last) pick, chase and attack their foes. Only the attackers themselves are
+	 * changed, the damage they deal is added to \a out and applied by fight once all units are done.
+	 */
+	void engage(size_t first, size_t last, CombatChunk &out);
+	/** Resolve all attacks of this tick and remove the units that have been killed. */
+	void fight();
+	/** Mark or release the tiles covered by a static object and fix any paths that are affected by it. */
+	void occupy(const Box2<float> &pos, unsigned size, bool add);
 };
 
 }
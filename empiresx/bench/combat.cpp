@@ -0,0 +1,132 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+/*
+ * Benchmark for the combat system. Two armies of clubmen charge at each other on an empty map
+ * and fight until one of them has been wiped out or nobody finds a foe anymore, which happens
+ * when the last survivors of the losing side stand out of sight. The battle is fought once on
+ * the calling thread only and once with worker threads, which must end the same way. The
+ * results are printed as JSON:
+ *
+ * bench_combat [units per side [threads [max ticks]]]
+ */
+
+#include "../base/world.hpp"
+#include "../base/game.hpp"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace genie;
+using namespace genie::game;
+
+static constexpr unsigned map_size = 64, rank_size = 20;
+/** Number of ticks without any unit fighting after which the battle is over. */
+static constexpr unsigned calm_ticks = 250;
+
+struct Battle final {
+	uint32_t ticks;
+	size_t survivors[2];
+	uint64_t checksum;
+	std::vector<double> times; /**< milliseconds per tick */
+};
+
+static Battle battle(unsigned per_side, unsigned max_ticks, unsigned threads) {
+	StartMatch settings{};
+	settings.map_w = settings.map_h = map_size;
+	settings.seed = 1;
+	settings.slave_count = 2;
+
+	Philox rng(settings.seed);
+	World world(rng, settings, true, threads);
+
+	std::vector<Order> orders;
+
+	// both armies line up in ranks and are sent to the middle of the map
+	for (unsigned side = 0; side < 2; ++side)
+		for (unsigned i = 0; i < per_side; ++i) {
+			float x = 22.0f + i % rank_size, rank = 0.8f * (i / rank_size);
+			UnitRef r = world.add_unit(Vector2<float>(x, side ? map_size - 10 - rank : 10 + rank), UnitType::clubman, side);
+
+			Order o{};
+			o.type = (uint16_t)OrderType::move;
+			o.player = (player_id)side;
+			o.unit = r;
+			o.x = o.y = (int32_t)(map_size / 2) << fixed_bits;
+			orders.emplace_back(o);
+		}
+
+	Battle b{};
+	b.times.reserve(max_ticks);
+	world.apply(orders);
+
+	bool fought = false;
+	unsigned calm = 0;
+
+	do {
+		auto start = std::chrono::steady_clock::now();
+		world.tick();
+		std::chrono::duration<double, std::milli> diff = std::chrono::steady_clock::now() - start;
+		b.times.emplace_back(diff.count());
+
+		b.survivors[0] = b.survivors[1] = 0;
+		for (unsigned c : world.units.color)
+			++b.survivors[c];
+
+		if (std::any_of(world.units.foe.begin(), world.units.foe.end(), [](UnitRef r) { return r != no_unit; })) {
+			fought = true;
+			calm = 0;
+		} else {
+			++calm;
+		}
+	} while (b.survivors[0] && b.survivors[1] && !(fought && calm >= calm_ticks) && world.ticks() < max_ticks);
+
+	b.ticks = world.ticks();
+	b.checksum = world.checksum();
+	return b;
+}
+
+int main(int argc, char **argv) {
+	unsigned per_side = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : 200;
+	unsigned threads = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : std::max(1u, std::thread::hardware_concurrency()) - 1;
+	unsigned max_ticks = argc > 3 ? (unsigned)strtoul(argv[3], NULL, 0) : 20000;
+
+	if (!per_side || per_side > rank_size * 40 || !max_ticks) {
+		fprintf(stderr, "usage: %s [units per side [threads [max ticks]]]\n", argv[0]);
+		return 1;
+	}
+
+	Battle serial = battle(per_side, max_ticks, 0), b = battle(per_side, max_ticks, threads);
+	bool same = serial.ticks == b.ticks && serial.checksum == b.checksum
+		&& serial.survivors[0] == b.survivors[0] && serial.survivors[1] == b.survivors[1];
+
+	double total = 0;
+	for (double t : b.times)
+		total += t;
+
+	std::sort(b.times.begin(), b.times.end());
+
+	printf("{\n");
+	printf("\t\"units_per_side\": %u,\n", per_side);
+	printf("\t\"threads\": %u,\n", threads);
+	printf("\t\"ticks\": %" PRIu32 ",\n", b.ticks);
+	printf("\t\"survivors\": [%zu, %zu],\n", b.survivors[0], b.survivors[1]);
+	printf("\t\"tick_ms_mean\": %.4f,\n", total / b.times.size());
+	printf("\t\"tick_ms_p99\": %.4f,\n", b.times[std::min(b.times.size() - 1, b.times.size() * 99 / 100)]);
+	printf("\t\"tick_ms_max\": %.4f,\n", b.times.back());
+	printf("\t\"checksum\": \"%016" PRIx64 "\",\n", b.checksum);
+	printf("\t\"deterministic\": %s\n", same ? "true" : "false");
+	printf("}\n");
+
+	if (!same) {
+		fprintf(stderr, "battle on %u threads ended differently: %" PRIu32 " ticks, checksum %016" PRIx64 "\n", threads, serial.ticks, serial.checksum);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,132 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+/*
+ * Determinism check for unit movement. Units of a single player, so nobody fights, are
+ * scattered over the map and sent to random spots every few seconds. After all ticks, the
+ * positions and facings of all units are hashed. The match is played once on the calling
+ * thread only and once with worker threads, which must end with the same digest. Builds with
+ * different compilers, optimization levels or instruction sets can be compared by passing
+ * the digest of one to the other:
+ *
+ * bench_determinism [ticks [units [threads [expected digest]]]]
+ */
+
+#include "../base/world.hpp"
+#include "../base/game.hpp"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace genie;
+using namespace genie::game;
+
+static constexpr unsigned map_size = 128;
+/** Number of ticks between new orders for the same unit, which is about every five seconds. */
+static constexpr unsigned order_ticks = 250;
+
+/** FNV-1a over the bytes of \a v. */
+template<typename T> static void digest(uint64_t &h, const T &v) {
+	const unsigned char *p = reinterpret_cast<const unsigned char*>(&v);
+
+	for (size_t i = 0; i < sizeof v; ++i)
+		h = (h ^ p[i]) * 0x100000001b3llu;
+}
+
+struct Match final {
+	uint64_t digest; /**< of positions and facings of all units */
+	uint64_t checksum;
+	size_t units;
+	double ms;
+};
+
+static Match play(unsigned ticks, unsigned count, unsigned threads) {
+	StartMatch settings{};
+	settings.map_w = settings.map_h = map_size;
+	settings.seed = 1;
+	settings.slave_count = 1;
+
+	Philox rng(settings.seed), orders_rng(rng.substream(RandomStream::game, 1));
+	World world(rng, settings, true, threads);
+	world.populate(1);
+
+	for (unsigned i = 0; i < count; ++i) {
+		float x = (float)orders_rng.next(1, map_size - 2), y = (float)orders_rng.next(1, map_size - 2);
+		world.add_unit(Vector2<float>(x, y), i % 2 ? UnitType::clubman : UnitType::villager, 0);
+	}
+
+	std::vector<Order> list;
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned now = 0; now < ticks; ++now) {
+		// each unit gets a new target once every order_ticks, spread over all ticks
+		for (size_t i = now % order_ticks; i < world.units.size(); i += order_ticks) {
+			Order o{};
+			o.type = (uint16_t)OrderType::move;
+			o.player = (player_id)world.units.color[i];
+			o.unit = world.units.ref[i];
+			o.x = (int32_t)orders_rng.next(map_size - 1) << fixed_bits;
+			o.y = (int32_t)orders_rng.next(map_size - 1) << fixed_bits;
+			list.emplace_back(o);
+		}
+
+		world.apply(list);
+		world.tick();
+		list.clear();
+	}
+
+	std::chrono::duration<double, std::milli> diff = std::chrono::steady_clock::now() - start;
+	Match m{0xcbf29ce484222325llu, world.checksum(), world.units.size(), diff.count()};
+
+	for (size_t i = 0; i < world.units.size(); ++i) {
+		digest(m.digest, world.units.ref[i]);
+		digest(m.digest, world.units.x[i]);
+		digest(m.digest, world.units.y[i]);
+		digest(m.digest, world.units.dir[i]);
+	}
+
+	return m;
+}
+
+int main(int argc, char **argv) {
+	unsigned ticks = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : 10000;
+	unsigned count = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 440;
+	unsigned threads = argc > 3 ? (unsigned)strtoul(argv[3], NULL, 0) : std::max(1u, std::thread::hardware_concurrency()) - 1;
+	const char *expected = argc > 4 ? argv[4] : NULL;
+
+	if (!ticks || !count || count > 20000) {
+		fprintf(stderr, "usage: %s [ticks [units [threads [expected digest]]]]\n", argv[0]);
+		return 1;
+	}
+
+	Match serial = play(ticks, count, 0), m = play(ticks, count, threads);
+	bool same = serial.digest == m.digest && serial.checksum == m.checksum;
+	bool match = !expected || strtoull(expected, NULL, 16) == m.digest;
+
+	printf("{\n");
+	printf("\t\"ticks\": %u,\n", ticks);
+	printf("\t\"units\": %zu,\n", m.units);
+	printf("\t\"threads\": %u,\n", threads);
+	printf("\t\"ms\": %.1f,\n", m.ms);
+	printf("\t\"checksum\": \"%016" PRIx64 "\",\n", m.checksum);
+	printf("\t\"digest\": \"%016" PRIx64 "\",\n", m.digest);
+	printf("\t\"deterministic\": %s\n", same && match ? "true" : "false");
+	printf("}\n");
+
+	if (!same) {
+		fprintf(stderr, "match on %u threads ended differently: digest %016" PRIx64 ", checksum %016" PRIx64 "\n", threads, serial.digest, serial.checksum);
+		return 1;
+	}
+
+	if (!match) {
+		fprintf(stderr, "digest differs from %s\n", expected);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,122 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+/*
+ * Microbenchmark for the fog of war. Units of all players roam the map and update what their
+ * player sees whenever they enter another tile. Afterwards it verifies that the incremental
+ * updates yield the same fog as adding all units from scratch.
+ *
+ * bench_fog [units per player [players [map size [ticks]]]]
+ */
+
+#include "../base/fog.hpp"
+#include "../base/math.hpp"
+#include "../base/random.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace genie;
+using namespace genie::game;
+
+/** Lines of sight of a mix of units, from villagers to scouts. */
+static const unsigned sights[] = {4, 4, 4, 7, 10};
+
+/** Number of ticks after which a unit heads another way. */
+static constexpr unsigned turn_ticks = 64;
+
+int main(int argc, char **argv) {
+	unsigned per_player = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : 200;
+	unsigned players = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 8;
+	unsigned size = argc > 3 ? (unsigned)strtoul(argv[3], NULL, 0) : 256;
+	unsigned ticks = argc > 4 ? (unsigned)strtoul(argv[4], NULL, 0) : 2000;
+
+	if (!players || size < 16 || size > UINT16_MAX || !ticks) {
+		fprintf(stderr, "usage: %s [units per player [players [map size [ticks]]]]\n", argv[0]);
+		return 1;
+	}
+
+	size_t n = (size_t)per_player * players;
+	fixed max = (fixed)size * fixed_one - 1;
+	LCG lcg(LCG::ansi_c(1));
+
+	std::vector<fixed> x(n), y(n), dx(n), dy(n);
+	std::vector<unsigned> player(n), sight(n);
+	std::vector<uint32_t> eye(n);
+	Fog fog(size, size);
+	fog.reserve(players);
+
+	for (size_t i = 0; i < n; ++i) {
+		x[i] = (fixed)lcg.next(max);
+		y[i] = (fixed)lcg.next(max);
+		player[i] = (unsigned)(i / per_player);
+		sight[i] = sights[i % (sizeof sights / sizeof sights[0])];
+		eye[i] = (uint32_t)(y[i] >> fixed_bits) * size + (x[i] >> fixed_bits);
+		fog.add(player[i], eye[i] % size, eye[i] / size, sight[i]);
+	}
+
+	std::vector<double> times;
+	times.reserve(ticks);
+	size_t crossed = 0;
+
+	for (unsigned t = 0; t < ticks; ++t) {
+		// walk at the speed of a fast unit and bounce off the edges of the map
+		for (size_t i = 0; i < n; ++i) {
+			if ((t + i) % turn_ticks == 0) {
+				dx[i] = (fixed)lcg.next(fixed_one * 14 / 10) - fixed_one * 7 / 10;
+				dy[i] = (fixed)lcg.next(fixed_one * 14 / 10) - fixed_one * 7 / 10;
+			}
+
+			if (x[i] + dx[i] < 0 || x[i] + dx[i] > max)
+				dx[i] = -dx[i];
+			if (y[i] + dy[i] < 0 || y[i] + dy[i] > max)
+				dy[i] = -dy[i];
+
+			x[i] += dx[i];
+			y[i] += dy[i];
+		}
+
+		auto start = std::chrono::steady_clock::now();
+
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t tile = (uint32_t)(y[i] >> fixed_bits) * size + (x[i] >> fixed_bits);
+			if (tile == eye[i])
+				continue;
+
+			fog.move(player[i], eye[i] % size, eye[i] / size, tile % size, tile / size, sight[i]);
+			eye[i] = tile;
+			++crossed;
+		}
+
+		std::chrono::duration<double, std::milli> diff = std::chrono::steady_clock::now() - start;
+		times.emplace_back(diff.count());
+	}
+
+	Fog ref(size, size);
+	ref.reserve(players);
+
+	for (size_t i = 0; i < n; ++i)
+		ref.add(player[i], eye[i] % size, eye[i] / size, sight[i]);
+
+	for (unsigned p = 0; p < players; ++p)
+		for (unsigned ty = 0; ty < size; ++ty)
+			for (unsigned tx = 0; tx < size; ++tx)
+				if (fog.visible(p, tx, ty) != ref.visible(p, tx, ty) || (fog.visible(p, tx, ty) && !fog.explored(p, tx, ty))) {
+					fprintf(stderr, "fog of player %u differs at %u,%u\n", p, tx, ty);
+					return 1;
+				}
+
+	double total = 0;
+	for (double t : times)
+		total += t;
+
+	std::sort(times.begin(), times.end());
+
+	printf("%zu units, %u players, %ux%u map, %u ticks\n", n, players, size, size, ticks);
+	printf("tile changes: %.1f per tick\n", (double)crossed / ticks);
+	printf("update: %8.4f ms/tick mean, %8.4f ms/tick max\n", total / ticks, times.back());
+	return 0;
+}
@@ -0,0 +1,77 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+/*
+ * Microbenchmark for the batched unit movement kernels. It also verifies that
+ * the vectorized kernel yields exactly the same results as the scalar one.
+ */
+
+#include "../base/move.hpp"
+#include "../base/random.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <chrono>
+#include <vector>
+
+using namespace genie;
+using namespace genie::game;
+
+typedef void (*kernel)(fixed*, fixed*, const fixed*, const fixed*, const fixed*, uint8_t*, size_t);
+
+struct Batch final {
+	std::vector<fixed> x, y, tx, ty, speed;
+	std::vector<uint8_t> facing;
+
+	Batch(size_t n, unsigned map_size, uint64_t seed) : x(n), y(n), tx(n), ty(n), speed(n), facing(n) {
+		LCG lcg(LCG::ansi_c(seed));
+		uint64_t max = (uint64_t)map_size * fixed_one - 1;
+
+		for (size_t i = 0; i < n; ++i) {
+			x[i] = (fixed)(lcg.next(max >> 15) << 15 | lcg.next(0x7fff));
+			y[i] = (fixed)(lcg.next(max >> 15) << 15 | lcg.next(0x7fff));
+			tx[i] = (fixed)(lcg.next(max >> 15) << 15 | lcg.next(0x7fff));
+			ty[i] = (fixed)(lcg.next(max >> 15) << 15 | lcg.next(0x7fff));
+			speed[i] = (fixed)lcg.next(fixed_one / 8, fixed_one);
+		}
+	}
+};
+
+static double run(kernel k, Batch &b, unsigned ticks) {
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < ticks; ++i)
+		k(b.x.data(), b.y.data(), b.tx.data(), b.ty.data(), b.speed.data(), b.facing.data(), b.x.size());
+
+	std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+	return diff.count();
+}
+
+int main(int argc, char **argv) {
+	size_t units = argc > 1 ? strtoul(argv[1], NULL, 0) : 8 * 200;
+	unsigned ticks = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 2000;
+	unsigned map_size = move_simd_max;
+
+	Batch ref(units, map_size, 1), vec(units, map_size, 1);
+
+	// verify first, including units that arrive at their target and stop
+	for (unsigned i = 0; i < ticks; ++i) {
+		move_scalar(ref.x.data(), ref.y.data(), ref.tx.data(), ref.ty.data(), ref.speed.data(), ref.facing.data(), units);
+		move_simd(vec.x.data(), vec.y.data(), vec.tx.data(), vec.ty.data(), vec.speed.data(), vec.facing.data(), units);
+
+		if (ref.x != vec.x || ref.y != vec.y || ref.facing != vec.facing) {
+			fprintf(stderr, "%s kernel differs from scalar kernel at tick %u\n", move_isa, i);
+			return 1;
+		}
+	}
+
+	Batch b1(units, map_size, 2), b2(units, map_size, 2);
+	double t_scalar = run(move_scalar, b1, ticks), t_simd = run(move_simd, b2, ticks);
+	double n = (double)units * ticks;
+
+	printf("%zu units, %u ticks\n", units, ticks);
+	printf("scalar: %8.2f ns/unit\n", t_scalar * 1e9 / n);
+	printf("%-6s: %8.2f ns/unit (%.2fx)\n", move_isa, t_simd * 1e9 / n, t_scalar / t_simd);
+	return 0;
+}
@@ -0,0 +1,131 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+/*
+ * Benchmark for long distance paths. It compares plain grid A* with HPA*, where the
+ * latter is measured both for planning the abstract path only, which is what a unit
+ * waits for, and for refining the complete path. It also verifies that HPA* finds a
+ * path whenever A* does.
+ */
+
+#include "../base/hpa.hpp"
+#include "../base/random.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <chrono>
+#include <vector>
+
+using namespace genie;
+using namespace genie::game;
+
+/** Scatter forests of random size over the map, such that about \a density of it is blocked. */
+static void forests(Occupancy &occ, LCG &lcg, double density) {
+	unsigned w = occ.width(), h = occ.height();
+	std::vector<uint32_t> changed;
+
+	for (size_t blocked = 0; blocked < density * w * h;) {
+		int cx = (int)lcg.next(w - 1), cy = (int)lcg.next(h - 1), r = (int)lcg.next(1, 4);
+
+		for (int y = cy - r; y <= cy + r; ++y)
+			for (int x = cx - r; x <= cx + r; ++x)
+				if ((x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r)
+					occ.update(x, y, 1, 1, true, changed);
+
+		blocked += changed.size();
+		changed.clear();
+	}
+}
+
+static double since(std::chrono::steady_clock::time_point start) {
+	std::chrono::duration<double, std::micro> diff = std::chrono::steady_clock::now() - start;
+	return diff.count();
+}
+
+int main(int argc, char **argv) {
+	unsigned queries = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : 100;
+	double density = argc > 2 ? atof(argv[2]) : 0.2;
+	static const unsigned sizes[] = {48, 96, 144, 192, 255};
+
+	printf("%u queries per map, %.0f%% blocked\n", queries, density * 100);
+	printf("%5s %9s %7s | %10s %10s | %10s %10s | %10s %10s\n", "size", "build us", "nodes",
+		"A* exp", "A* us", "HPA* exp", "HPA* us", "full exp", "full us");
+
+	for (unsigned size : sizes) {
+		LCG lcg(LCG::ansi_c(size));
+		Occupancy occ(size, size);
+		forests(occ, lcg, density);
+
+		HpaGraph hpa(size, size);
+		auto start = std::chrono::steady_clock::now();
+		hpa.build(occ);
+		double t_build = since(start);
+
+		GridSearch search;
+		TileRect all{0, 0, (int)size, (int)size};
+		PathStats s_astar, s_hpa, s_full;
+		double t_astar = 0, t_hpa = 0, t_full = 0;
+		unsigned found = 0;
+		std::vector<uint32_t> path;
+
+		for (unsigned q = 0; q < queries; ++q) {
+			// pick free tiles in opposite corners, so the paths are long
+			uint32_t from, to;
+			do {
+				from = (uint32_t)(lcg.next(size / 4) * size + lcg.next(size / 4));
+			} while (!occ.passable(from % size, from / size));
+			do {
+				to = (uint32_t)((size - 1 - lcg.next(size / 4)) * size + size - 1 - lcg.next(size / 4));
+			} while (!occ.passable(to % size, to / size));
+
+			path.clear();
+			start = std::chrono::steady_clock::now();
+			bool ok = search.find(occ, from, to, all, path, &s_astar);
+			t_astar += since(start);
+
+			Route r;
+			start = std::chrono::steady_clock::now();
+			bool ok_hpa = hpa.find(occ, from, to, r, &s_hpa);
+			t_hpa += since(start);
+
+			if (ok != ok_hpa) {
+				fprintf(stderr, "size %u: A* and HPA* disagree on path from %u to %u\n", size, from, to);
+				return 1;
+			}
+
+			if (!ok)
+				continue;
+
+			++found;
+
+			// walk the path like a unit would
+			start = std::chrono::steady_clock::now();
+
+			for (uint32_t at = from;;) {
+				if (!r.tiles.empty())
+					at = r.tiles.back();
+				r.step = r.tiles.size();
+
+				if (r.done())
+					break;
+
+				if (!hpa.refine(occ, at, r, &s_full)) {
+					fprintf(stderr, "size %u: cannot refine path from %u to %u\n", size, from, to);
+					return 1;
+				}
+			}
+
+			t_full += since(start);
+		}
+
+		if (!found)
+			continue;
+
+		printf("%5u %9.0f %7zu | %10zu %10.1f | %10zu %10.1f | %10zu %10.1f\n", size, t_build, hpa.size(),
+			s_astar.expanded / queries, t_astar / queries,
+			s_hpa.expanded / queries, t_hpa / queries,
+			(s_hpa.expanded + s_full.expanded) / found, (t_hpa + t_full) / found);
+	}
+
+	return 0;
+}
@@ -0,0 +1,158 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+/*
+ * Benchmark for the complete simulation on a synthetic match. Units are scattered over the map and
+ * a part of them is sent in groups to random spots every few seconds, like players would do. The
+ * results are printed as JSON, so they can be collected by scripts:
+ *
+ * bench_simulation [units per player [players [map size [fraction moving [ticks [threads [seed]]]]]]]
+ */
+
+#include "../base/world.hpp"
+#include "../base/game.hpp"
+#include "../base/move.hpp"
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace genie;
+using namespace genie::game;
+
+static std::atomic<size_t> allocs(0);
+
+void *operator new(size_t size) {
+	allocs.fetch_add(1, std::memory_order_relaxed);
+
+	if (void *p = malloc(size ? size : 1))
+		return p;
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+/** Number of ticks between new orders for the same group, which is about every five seconds. */
+static constexpr unsigned order_ticks = 250;
+/** Number of ticks that are not measured, so all groups that move have got their orders. */
+static constexpr unsigned warmup_ticks = order_ticks;
+static constexpr size_t group_size = 20;
+
+/**
+ * Send the groups whose turn it is at tick \a now to random spots. The groups are spread evenly over
+ * order_ticks, so not all path requests arrive at once. Only \a moving of all groups get orders.
+ */
+static void orders(const World &w, Philox &rng, unsigned now, double moving, std::vector<Order> &list) {
+	for (size_t g = now % order_ticks; g * group_size < w.units.size(); g += order_ticks) {
+		if (floor((g + 1) * moving) == floor(g * moving))
+			continue;
+
+		int32_t x = (int32_t)rng.next(w.map.w - 1) << fixed_bits, y = (int32_t)rng.next(w.map.h - 1) << fixed_bits;
+
+		for (size_t i = g * group_size, end = std::min(i + group_size, w.units.size()); i < end; ++i) {
+			Order o{};
+			o.type = (uint16_t)OrderType::move;
+			o.player = (player_id)w.units.color[i];
+			o.unit = w.units.ref[i];
+			o.x = x;
+			o.y = y;
+			list.emplace_back(o);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	unsigned per_player = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : 2000;
+	unsigned players = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 8;
+	unsigned size = argc > 3 ? (unsigned)strtoul(argv[3], NULL, 0) : 256;
+	double moving = argc > 4 ? strtod(argv[4], NULL) : 0.5;
+	unsigned ticks = argc > 5 ? (unsigned)strtoul(argv[5], NULL, 0) : 1000;
+	unsigned threads = argc > 6 ? (unsigned)strtoul(argv[6], NULL, 0) : std::max(1u, std::thread::hardware_concurrency()) - 1;
+	uint32_t seed = argc > 7 ? (uint32_t)strtoul(argv[7], NULL, 0) : 1;
+
+	if (!players || players > UINT8_MAX || size < 16 || size > UINT16_MAX || !ticks || moving < 0 || moving > 1) {
+		fprintf(stderr, "usage: %s [units per player [players [map size [fraction moving [ticks [threads [seed]]]]]]]\n", argv[0]);
+		return 1;
+	}
+
+	StartMatch settings{};
+	settings.map_w = settings.map_h = (uint16_t)size;
+	settings.seed = seed;
+	settings.slave_count = (uint16_t)players;
+
+	Philox rng(seed), bench_rng(rng.substream(RandomStream::game, 1));
+	size_t setup = allocs.load(std::memory_order_relaxed);
+	World world(rng, settings, true, threads);
+	world.populate(players);
+	size_t populated = allocs.load(std::memory_order_relaxed) - setup;
+
+	for (unsigned p = 0; p < players; ++p)
+		for (unsigned i = 0; i < per_player; ++i) {
+			float x = (float)bench_rng.next(1, size - 2), y = (float)bench_rng.next(1, size - 2);
+			world.add_unit(Vector2<float>(x, y), i % 2 ? UnitType::clubman : UnitType::villager, p);
+		}
+
+	std::vector<Order> list;
+	std::vector<double> times;
+	size_t allocated = 0;
+	times.reserve(ticks);
+
+	for (unsigned i = 0; i < warmup_ticks + ticks; ++i) {
+		orders(world, bench_rng, i, moving, list);
+
+		size_t before = allocs.load(std::memory_order_relaxed);
+		auto start = std::chrono::steady_clock::now();
+
+		world.apply(list);
+		world.tick();
+
+		std::chrono::duration<double, std::milli> diff = std::chrono::steady_clock::now() - start;
+
+		if (i >= warmup_ticks) {
+			times.emplace_back(diff.count());
+			allocated += allocs.load(std::memory_order_relaxed) - before;
+		}
+
+		list.clear();
+	}
+
+	double total = 0;
+	for (double t : times)
+		total += t;
+
+	std::sort(times.begin(), times.end());
+
+	printf("{\n");
+	printf("\t\"map\": %u,\n", size);
+	printf("\t\"players\": %u,\n", players);
+	printf("\t\"units\": %zu,\n", world.units.size());
+	printf("\t\"moving\": %g,\n", moving);
+	printf("\t\"ticks\": %u,\n", ticks);
+	printf("\t\"threads\": %u,\n", threads);
+	printf("\t\"seed\": %" PRIu32 ",\n", seed);
+	printf("\t\"simd\": \"%s\",\n", move_isa);
+	printf("\t\"ticks_per_sec\": %.1f,\n", ticks * 1000.0 / total);
+	printf("\t\"tick_ms_mean\": %.4f,\n", total / ticks);
+	printf("\t\"tick_ms_p50\": %.4f,\n", times[times.size() / 2]);
+	printf("\t\"tick_ms_p99\": %.4f,\n", times[std::min(times.size() - 1, times.size() * 99 / 100)]);
+	printf("\t\"tick_ms_max\": %.4f,\n", times.back());
+	printf("\t\"allocs_populate\": %zu,\n", populated);
+	printf("\t\"allocs_per_tick\": %.2f,\n", (double)allocated / ticks);
+	printf("\t\"checksum\": \"%016" PRIx64 "\"\n", world.checksum());
+	printf("}\n");
+	return 0;
+}
@@ -0,0 +1,146 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+/*
+ * Benchmark for saving and loading world snapshots on a crowded 8 player map. It also
+ * verifies the round trip: the loaded world must be identical to the original one and
+ * both must stay in sync when they continue, including any pending path requests and
+ * units that are being trained.
+ */
+
+#include "../base/world.hpp"
+#include "../base/game.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace genie;
+using namespace genie::game;
+
+static double since(std::chrono::steady_clock::time_point start) {
+	std::chrono::duration<double, std::milli> diff = std::chrono::steady_clock::now() - start;
+	return diff.count();
+}
+
+/** Human readable state of \a w, which must be equal for identical worlds. */
+static std::string text(const World &w) {
+	FILE *f = tmpfile();
+	std::string s;
+
+	w.dump(f);
+	rewind(f);
+
+	for (int c; (c = fgetc(f)) != EOF;)
+		s.push_back((char)c);
+
+	fclose(f);
+	return s;
+}
+
+/** Send groups of units all over the map. Every tenth group is a single unit that goes far, so it gets a route. */
+static void orders(World &w, Philox &rng) {
+	std::vector<Order> list;
+
+	for (size_t i = 0; i < w.units.size();) {
+		size_t group = i / 20 % 10 == 9 ? 1 : 20;
+		int32_t x = (int32_t)rng.next(w.map.w - 1) << fixed_bits, y = (int32_t)rng.next(w.map.h - 1) << fixed_bits;
+
+		for (size_t end = std::min(i + group, w.units.size()); i < end; ++i) {
+			Order o{};
+			o.type = (uint16_t)OrderType::move;
+			o.player = (player_id)w.units.color[i];
+			o.unit = w.units.ref[i];
+			o.x = x;
+			o.y = y;
+			list.emplace_back(o);
+		}
+	}
+
+	w.apply(list);
+}
+
+/** Fill the queues of all buildings, so the snapshot has production timers. */
+static void train(World &w) {
+	std::vector<Order> list;
+
+	for (auto &b : w.all_buildings())
+		for (unsigned k = 0; k < production_max; ++k) {
+			Order o{};
+			o.type = (uint16_t)OrderType::train;
+			o.player = (player_id)b->owner();
+			o.unit = b->getid();
+			o.x = (int32_t)(b->type == BuildingType::barracks ? UnitType::clubman : UnitType::villager);
+			list.emplace_back(o);
+		}
+
+	w.apply(list);
+}
+
+int main(int argc, char **argv) {
+	unsigned per_player = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : 2000;
+	unsigned rounds = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 10;
+	const char *path = argc > 3 ? argv[3] : "bench_snapshot.bin";
+	unsigned players = 8;
+
+	StartMatch settings = StartMatch::random(players, players);
+	Philox rng(settings.seed), order_rng(rng.substream(RandomStream::game, 1));
+
+	World world(rng, settings, true), copy(rng, settings, true);
+	world.populate(players);
+	copy.populate(players);
+
+	for (unsigned p = 0; p < players; ++p)
+		for (unsigned i = 0; i < per_player; ++i) {
+			float x = 1 + (float)(i % 64), y = (float)((p + 1) * world.map.h / (players + 1) + i / 64 % 8);
+			world.add_unit(Vector2<float>(x, y), i % 2 ? UnitType::clubman : UnitType::villager, p);
+		}
+
+	// walk for a while, then leave some paths pending
+	orders(world, order_rng);
+	train(world);
+	for (unsigned i = 0; i < 50; ++i)
+		world.tick();
+	orders(world, order_rng);
+	world.tick();
+
+	printf("%ux%u map, %zu units, %zu pending path requests\n", world.map.w, world.map.h, world.units.size(), world.path_queue().stats().depth);
+
+	double t_save = 1e9, t_load = 1e9;
+	size_t bytes = 0;
+
+	for (unsigned r = 0; r < rounds; ++r) {
+		auto start = std::chrono::steady_clock::now();
+		bytes = world.save(path);
+		t_save = std::min(t_save, since(start));
+
+		start = std::chrono::steady_clock::now();
+		copy.load(path);
+		t_load = std::min(t_load, since(start));
+	}
+
+	remove(path);
+
+	if (text(world) != text(copy)) {
+		fprintf(stderr, "loaded world differs from saved world\n");
+		return 1;
+	}
+
+	for (unsigned i = 0; i < 100; ++i) {
+		world.tick();
+		copy.tick();
+
+		if (world.checksum() != copy.checksum()) {
+			fprintf(stderr, "loaded world runs out of sync at tick %u\n", world.ticks());
+			return 1;
+		}
+	}
+
+	double mb = bytes / (1024.0 * 1024.0);
+	printf("snapshot: %.2f MB\n", mb);
+	printf("save: %8.2f ms %8.1f MB/s\n", t_save, mb * 1000 / t_save);
+	printf("load: %8.2f ms %8.1f MB/s\n", t_load, mb * 1000 / t_load);
+	return 0;
+}
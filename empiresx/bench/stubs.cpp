@@ -0,0 +1,31 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+/*
+ * Stand-ins for the parts of the game that the benchmarks do not link with, i.e. anything that
+ * draws or talks to the menus.
+ */
+
+#include "../base/world.hpp"
+#include "../base/game.hpp"
+
+#include <string>
+
+namespace genie {
+
+void check_taunt(const std::string&) {}
+void menu_lobby_stop_game(MenuLobby*) {}
+
+namespace game {
+
+// nothing is drawn, so the dimensions only have to represent some small area
+void img_dim(Box2<float> &dim, int&, int&, unsigned, unsigned) {
+	dim.w = dim.h = 10;
+}
+
+void Particle::draw(int, int, unsigned) const {}
+void Building::draw(int, int) const {}
+void Units::draw(size_t, int, int) const {}
+
+}
+
+}
@@ -0,0 +1,231 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+/*
+ * Microbenchmark for area queries on the terrain. It runs the same kernels on a flat map in
+ * y,x order, which is how tiles used to be stored, and on chunked terrain with the tiles of
+ * each chunk row by row and in Morton order. The kernels are lines of sight, building
+ * footprints, the tiles under the viewport and a 3x3 stencil like that of flow fields, all
+ * at random spots. It also verifies that all layouts yield the same sums, and that changed
+ * tiles survive paging and a snapshot round trip.
+ *
+ * bench_terrain [map size [queries [snapshot path]]]
+ */
+
+#include "../base/terrain.hpp"
+#include "../base/random.hpp"
+#include "../base/snapshot.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace genie;
+using namespace genie::game;
+
+/** Number of flat tiles, see TileId. */
+static constexpr unsigned tile_kinds = 9;
+
+static constexpr int sight = 10, footprint = 4, view_w = 40, view_h = 40, stencil = 32;
+
+/** Tiles in y,x order. */
+struct Flat final {
+	unsigned w, h;
+	std::vector<uint8_t> tiles;
+
+	uint8_t tile(unsigned x, unsigned y) const { return tiles[(size_t)y * w + x]; }
+
+	template<typename F> void each_tile(unsigned x0, unsigned y0, unsigned x1, unsigned y1, F f) const {
+		for (unsigned y = y0; y <= y1; ++y)
+			for (unsigned x = x0; x <= x1; ++x)
+				f(x, y, tiles[(size_t)y * w + x]);
+	}
+};
+
+struct Result final {
+	double ns; /**< per tile */
+	uint64_t sum;
+};
+
+/** Run \a kernel at \a spots and measure time per tile it has looked at. */
+template<typename K> static Result run(const std::vector<uint32_t> &spots, unsigned size, K kernel) {
+	uint64_t sum = 0, tiles = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	for (uint32_t s : spots)
+		tiles += kernel(s % size, s / size, sum);
+
+	std::chrono::duration<double, std::nano> diff = std::chrono::steady_clock::now() - start;
+	return Result{diff.count() / tiles, sum};
+}
+
+template<typename M> static void kernels(const char *name, M &m, unsigned size, const std::vector<uint32_t> &spots, Result *res) {
+	int last = (int)size - 1;
+
+	// disc around a unit
+	res[0] = run(spots, size, [&](unsigned cx, unsigned cy, uint64_t &sum) {
+		unsigned n = 0;
+
+		for (int y = std::max((int)cy - sight, 0); y <= std::min((int)cy + sight, last); ++y)
+			for (int x = std::max((int)cx - sight, 0); x <= std::min((int)cx + sight, last); ++x)
+				if ((x - (int)cx) * (x - (int)cx) + (y - (int)cy) * (y - (int)cy) <= sight * sight) {
+					sum += m.tile(x, y);
+					++n;
+				}
+
+		return n;
+	});
+
+	// can a building be placed here
+	res[1] = run(spots, size, [&](unsigned cx, unsigned cy, uint64_t &sum) {
+		unsigned x0 = std::min(cx, size - footprint), y0 = std::min(cy, size - footprint);
+
+		for (unsigned y = y0; y < y0 + footprint; ++y)
+			for (unsigned x = x0; x < x0 + footprint; ++x)
+				sum += m.tile(x, y);
+
+		return footprint * footprint;
+	});
+
+	// tiles to draw
+	res[2] = run(spots, size, [&](unsigned cx, unsigned cy, uint64_t &sum) {
+		unsigned x0 = std::min(cx, size - view_w), y0 = std::min(cy, size - view_h);
+		m.each_tile(x0, y0, x0 + view_w - 1, y0 + view_h - 1, [&](unsigned, unsigned, uint8_t t) { sum += t; });
+		return view_w * view_h;
+	});
+
+	// neighbours of every tile in an area
+	res[3] = run(spots, size, [&](unsigned cx, unsigned cy, uint64_t &sum) {
+		unsigned x0 = std::min(std::max(cx, 1u), size - stencil - 1), y0 = std::min(std::max(cy, 1u), size - stencil - 1);
+
+		for (unsigned y = y0; y < y0 + stencil; ++y)
+			for (unsigned x = x0; x < x0 + stencil; ++x)
+				for (int dy = -1; dy <= 1; ++dy)
+					for (int dx = -1; dx <= 1; ++dx)
+						sum += m.tile(x + dx, y + dy);
+
+		return stencil * stencil * 9;
+	});
+
+	printf("%-8s %8.3f %8.3f %8.3f %8.3f\n", name, res[0].ns, res[1].ns, res[2].ns, res[3].ns);
+}
+
+/**
+ * Change some tiles of a terrain that may only keep two chunks in memory, walk the whole map
+ * so chunks are paged out and made again, and restore it from a snapshot in the other layout.
+ * All tiles must match \a ref with the same changes. Returns the number of bad tiles.
+ */
+static size_t paging(const Philox &rng, const Flat &ref, const char *path) {
+	unsigned w = ref.w, h = ref.h;
+	Terrain t(rng, w, h, tile_kinds, TileLayout::morton);
+	Flat want{ref};
+	std::vector<uint8_t> heights((size_t)w * h);
+
+	t.limit(2);
+
+	// a road across the map and a hill in every other chunk
+	for (unsigned x = 0; x < w; ++x) {
+		t.set(x, h / 2, tile_kinds, 0);
+		want.tiles[(size_t)(h / 2) * w + x] = tile_kinds;
+	}
+
+	for (unsigned cy = 0; cy < t.chunk_rows(); cy += 2)
+		for (unsigned cx = 0; cx < t.chunk_cols(); cx += 2) {
+			unsigned x = cx << chunk_bits, y = cy << chunk_bits;
+			t.set(x, y, want.tile(x, y), (uint8_t)(1 + cx + cy));
+			heights[(size_t)y * w + x] = (uint8_t)(1 + cx + cy);
+		}
+
+	size_t bad = 0;
+
+	// visit every chunk and its neighbours, which pages out and restores all of them
+	for (unsigned cy = 0; cy < t.chunk_rows(); ++cy)
+		for (unsigned cx = 0; cx < t.chunk_cols(); ++cx)
+			t.neighbours(cx, cy, [&](unsigned nx, unsigned ny) {
+				unsigned x = nx << chunk_bits, y = ny << chunk_bits;
+				bad += t.tile(x, y) != want.tile(x, y) || t.height(x, y) != heights[(size_t)y * w + x];
+			});
+
+	if (t.size() > 2)
+		++bad;
+
+	SnapshotWriter out;
+	t.save(out);
+	out.write(path);
+
+	Terrain copy(rng, w, h, tile_kinds, TileLayout::rows);
+	copy.load(SnapshotReader(path));
+	remove(path);
+
+	for (unsigned y = 0; y < h; ++y)
+		for (unsigned x = 0; x < w; ++x) {
+			size_t i = (size_t)y * w + x;
+			bad += t.tile(x, y) != want.tiles[i] || t.height(x, y) != heights[i];
+			bad += copy.tile(x, y) != want.tiles[i] || copy.height(x, y) != heights[i];
+		}
+
+	return bad;
+}
+
+int main(int argc, char **argv) {
+	unsigned size = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : 1024;
+	unsigned queries = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 20000;
+	const char *path = argc > 3 ? argv[3] : "bench_terrain.bin";
+
+	if (size < 2 * stencil || size > UINT16_MAX || !queries) {
+		fprintf(stderr, "usage: %s [map size [queries [snapshot path]]]\n", argv[0]);
+		return 1;
+	}
+
+	Philox rng(1);
+	Terrain rows(rng, size, size, tile_kinds, TileLayout::rows), morton(rng, size, size, tile_kinds, TileLayout::morton);
+	Flat flat{size, size, std::vector<uint8_t>((size_t)size * size)};
+
+	// make all chunks up front, so generating them is not measured
+	for (unsigned y = 0; y < size; ++y)
+		for (unsigned x = 0; x < size; ++x) {
+			flat.tiles[(size_t)y * size + x] = rows.tile(x, y);
+			morton.tile(x, y);
+		}
+
+	// clustered like units are, with the odd one far away
+	LCG lcg(LCG::ansi_c(1));
+	std::vector<uint32_t> spots(queries);
+	unsigned hx = size / 4, hy = size / 4;
+
+	for (uint32_t &s : spots) {
+		if (lcg.next(7) == 0) {
+			hx = (unsigned)lcg.next(size - 1);
+			hy = (unsigned)lcg.next(size - 1);
+		}
+
+		unsigned x = std::min(hx + (unsigned)lcg.next(31), size - 1), y = std::min(hy + (unsigned)lcg.next(31), size - 1);
+		s = y * size + x;
+	}
+
+	Result res[3][4];
+
+	printf("%ux%u map, %u queries, ns per tile\n", size, size, queries);
+	printf("%-8s %8s %8s %8s %8s\n", "layout", "sight", "build", "view", "stencil");
+	kernels("flat", flat, size, spots, res[0]);
+	kernels("rows", rows, size, spots, res[1]);
+	kernels("morton", morton, size, spots, res[2]);
+
+	for (unsigned k = 0; k < 4; ++k)
+		if (res[0][k].sum != res[1][k].sum || res[0][k].sum != res[2][k].sum) {
+			fprintf(stderr, "layouts differ in kernel %u\n", k);
+			return 1;
+		}
+
+	size_t bad = paging(rng, flat, path);
+	printf("paging and snapshot: %s\n", bad ? "FAILED" : "ok");
+
+	if (bad) {
+		fprintf(stderr, "%zu tiles differ after paging\n", bad);
+		return 1;
+	}
+
+	return 0;
+}
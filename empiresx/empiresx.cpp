@@ -23,6 +23,7 @@
 #include <map>
 #include <algorithm>
 #include <utility>
+#include <thread>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -312,6 +313,7 @@ public:
 	game::Box2<float> bounds;
 
 	std::vector<game::Particle*> particles;
+	std::vector<game::UnitRef> units;
 	unsigned invalidate;
 
 	static constexpr unsigned invalidate_particles = 0x01;
@@ -320,12 +322,12 @@ public:
 	float move_speed = 0.5f; // TODO playtest movement speed factor
 	ConfigScreenMode mode;
 	game::World &world;
-	uint32_t selected = 0;
+	game::Handle selected = game::no_handle;
 
 	Cursor cursor; // TODO move this to game eventually
 
 	Viewport(game::World &world)
-		: bounds(), particles(), invalidate(invalidate_all)
+		: bounds(), particles(), units(), invalidate(invalidate_all)
 		, mode(eng->w->render().mode), world(world), cursor(CursorId::game_default) {}
 
 private:
@@ -336,13 +338,19 @@ private:
 
 		if (invalidate & invalidate_particles) {
 			particles.clear();
+			units.clear();
 			world.query_static(particles, bounds);
-			world.query_dynamic(particles, bounds);
+			world.query_dynamic(units, bounds);
 
 			// maintain z-order by sorting all selected objects such that the upper units are drawn first
 			std::sort(particles.begin(), particles.end(), [](game::Particle *lhs, game::Particle *rhs) {
 				return lhs->scr.top + lhs->hotspot_y < rhs->scr.top + rhs->hotspot_y;
 			});
+
+			game::Units &u = world.units;
+			std::sort(units.begin(), units.end(), [&u](game::UnitRef lhs, game::UnitRef rhs) {
+				return u.depth(u.index(lhs)) < u.depth(u.index(rhs));
+			});
 		}
 
 		invalidate = 0;
@@ -400,21 +408,35 @@ public:
 			{
 				game::Box2<float> area(bounds.left + static_cast<float>(ev.x), bounds.top + static_cast<float>(ev.y));
 				std::vector<game::Particle*> selected;
+				std::vector<game::UnitRef> selected_units;
 
 				world.query_static(selected, area);
-				world.query_dynamic(selected, area);
+				world.query_dynamic(selected_units, area);
+				// trees that are drawn but not under the cursor may lose their particle soon
+				invalidate |= invalidate_particles;
 
 				std::sort(selected.begin(), selected.end(), [](game::Particle *lhs, game::Particle *rhs) {
 					return lhs->scr.top + lhs->hotspot_y > rhs->scr.top + rhs->hotspot_y;
 				});
 
-				this->selected = selected.empty() ? 0 : selected[0]->getid();
+				game::Units &u = world.units;
+				std::sort(selected_units.begin(), selected_units.end(), [&u](game::UnitRef lhs, game::UnitRef rhs) {
+					return u.depth(u.index(lhs)) > u.depth(u.index(rhs));
+				});
+
+				// pick unit if it is in front of the topmost static particle
+				if (!selected_units.empty()) {
+					size_t i = u.index(selected_units[0]);
+
+					if (selected.empty() || u.depth(i) >= selected[0]->scr.top + selected[0]->hotspot_y) {
+						this->selected = selected_units[0];
 
-				if (this->selected) {
-					game::Particle *p = selected[0];
-					game::Villager *v = dynamic_cast<game::Villager*>(p);
+						if (u.type[i] != game::UnitType::villager) {
+							// it is something else, just play placeholder sound for now
+							jukebox.sfx(SfxId::unit_select);
+							return;
+						}
 
-					if (v) {
 						SfxId sfx;
 
 						switch (rand() % 5) {
@@ -428,8 +450,12 @@ public:
 						jukebox.sfx(sfx);
 						return;
 					}
+				}
+
+				this->selected = selected.empty() ? game::no_handle : selected[0]->getid();
 
-					game::Building *b = dynamic_cast<game::Building*>(p);
+				if (!selected.empty()) {
+					game::Building *b = world.building(this->selected);
 
 					if (b) {
 						switch (b->type) {
@@ -456,8 +482,16 @@ public:
 	}
 
 	void paint() {
-		for (auto &x : particles)
-			x->draw(static_cast<int>(-bounds.left), static_cast<int>(-bounds.top));
+		int offx = static_cast<int>(-bounds.left), offy = static_cast<int>(-bounds.top);
+		game::Units &u = world.units;
+
+		// both lists are sorted by depth, so merge them while drawing
+		for (size_t i = 0, j = 0; i < particles.size() || j < units.size();) {
+			if (j == units.size() || (i < particles.size() && particles[i]->scr.top + particles[i]->hotspot_y < u.depth(u.index(units[j]))))
+				particles[i++]->draw(offx, offy);
+			else
+				u.draw(u.index(units[j++]), offx, offy);
+		}
 	}
 };
 
@@ -481,7 +515,7 @@ class MenuGame final : public Menu, public ui::InteractableCallback, ui::InputCa
 public:
 	MenuGame(MenuLobby *lobby, SimpleRender &r, Multiplayer *mp, UIPlayerState *state, bool host, const StartMatch &settings)
 		: Menu(MenuId::selectnav, r, eng->assets->fnt_title, "Game", SDL_Color{0xff, 0xff, 0xff}, true, true)
-		, Game(host ? game::GameMode::multiplayer_host : game::GameMode::multiplayer_client, lobby, mp, settings)
+		, Game(host ? game::GameMode::multiplayer_host : game::GameMode::multiplayer_client, lobby, mp, settings, std::max(1u, std::thread::hardware_concurrency()) - 1)
 		, img(), host(host), started(false)
 		, f_chat(nullptr), key_state(0)
 		, mut()
@@ -490,11 +524,12 @@ public:
 	{
 		cache = &img;
 		world.populate(settings.slave_count);
+		record(game::replay_name(settings).c_str());
 
 		add_field(f_chat = new ui::InputField(0, *this, ui::InputType::text, "", r, eng->assets->fnt_default, SDL_Color{0xff, 0xff, 0xff}, menu_game_field_chat, r.mode, pal, bkg, true));
 
 		if (!host)
-			((MultiplayerClient*)mp)->set_gcb(this, (uint16_t)playerstate->state_now.players.size(), (uint16_t)lcg.next());
+			((MultiplayerClient*)mp)->set_gcb(this, (uint16_t)playerstate->state_now.players.size(), (uint16_t)rng.next());
 		else
 			((MultiplayerHost*)mp)->set_gcb(this);
 
@@ -530,7 +565,12 @@ public:
 			if (!old_started)
 				view.populate();
 
+			uint32_t before = world.ticks();
 			Game::step(ms);
+
+			// units may have moved, died or been trained, so their handles must be looked up again
+			if (world.ticks() != before)
+				view.invalidate |= Viewport::invalidate_particles;
 		}
 
 		update_viewport(ms);
@@ -596,6 +636,25 @@ public:
 
 	void custom_mouseup(SDL_MouseButtonEvent &ev) override {
 		view.mouseup(ev);
+
+		if (ev.button != SDL_BUTTON_RIGHT || game::kind_of(view.selected) != game::EntityKind::unit)
+			return;
+
+		// the unit may have died since it has been selected
+		if (!world.units.valid(view.selected)) {
+			view.selected = game::no_handle;
+			return;
+		}
+
+		float tx, ty;
+		scr_to_tile(tx, ty, view.bounds.left + ev.x, view.bounds.top + ev.y);
+
+		Order o{};
+		o.type = (uint16_t)OrderType::move;
+		o.unit = view.selected;
+		o.x = to_fixed(tx);
+		o.y = to_fixed(ty);
+		issue(o);
 	}
 
 	bool input(unsigned id, ui::InputField &field) override {
@@ -619,18 +678,27 @@ private:
 		auto &rel_bnds = eng->w->render().dim.rel_bnds;
 		auto bnds_left = rel_bnds.x, bnds_right = rel_bnds.x + rel_bnds.w, bnds_top = rel_bnds.y, bnds_bottom = rel_bnds.y + rel_bnds.h;
 
-		for (unsigned ty = 0; ty < world.map.h; ++ty) {
-			for (unsigned tx = 0; tx < world.map.w; ++tx) {
-				int x, y;
-				tile_to_scr(x, y, static_cast<int>(tx), static_cast<int>(ty));
+		// only look at tiles near the screen, so chunks of the terrain that are never seen are never made
+		float cx[4], cy[4];
+		scr_to_tile(cx[0], cy[0], static_cast<float>(bnds_left - left - tw), static_cast<float>(bnds_top - top - th));
+		scr_to_tile(cx[1], cy[1], static_cast<float>(bnds_right - left), static_cast<float>(bnds_top - top - th));
+		scr_to_tile(cx[2], cy[2], static_cast<float>(bnds_left - left - tw), static_cast<float>(bnds_bottom - top));
+		scr_to_tile(cx[3], cy[3], static_cast<float>(bnds_right - left), static_cast<float>(bnds_bottom - top));
 
-				unsigned tile = world.map.tiles[ty * world.map.w + tx];
+		int x0 = std::max(static_cast<int>(*std::min_element(cx, cx + 4)) - 1, 0), x1 = std::min(static_cast<int>(*std::max_element(cx, cx + 4)) + 1, static_cast<int>(world.map.w) - 1);
+		int y0 = std::max(static_cast<int>(*std::min_element(cy, cy + 4)) - 1, 0), y1 = std::min(static_cast<int>(*std::max_element(cy, cy + 4)) + 1, static_cast<int>(world.map.h) - 1);
 
-				// quick and dirty check to see if tile should be drawn
-				if (left + x + tw >= bnds_left && left + x < bnds_right && top + y + th >= bnds_top && top + y < bnds_bottom)
-					desert_tiles.subimage(tile).draw(r, left + x, top + y);
-			}
-		}
+		if (x0 > x1 || y0 > y1)
+			return;
+
+		world.map.terrain.each_tile(x0, y0, x1, y1, [&](unsigned tx, unsigned ty, unsigned tile) {
+			int x, y;
+			tile_to_scr(x, y, static_cast<int>(tx), static_cast<int>(ty));
+
+			// quick and dirty check to see if tile should be drawn
+			if (left + x + tw >= bnds_left && left + x < bnds_right && top + y + th >= bnds_top && top + y < bnds_bottom)
+				desert_tiles.subimage(tile).draw(r, left + x, top + y);
+		});
 	}
 
 	void paint_hud_borders() {
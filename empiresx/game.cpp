@@ -58,6 +58,13 @@ void Particle::draw(int offx, int offy, unsigned index) const {
 #endif
 }
 
+void Units::draw(size_t i, int offx, int offy) const {
+	SimpleRender &r = (SimpleRender&)eng->w->render();
+	Animation &anim = const_cast<Animation&>(cache->get(anim_index[i]));
+	unsigned index = (unsigned)dir[i] * dir_images[i] + image_index[i];
+	anim.subimage(index).draw(r, static_cast<int>(scr[i].left) + offx, static_cast<int>(scr[i].top) + offy, 0, 0, 0, 0, hflip(i));
+}
+
 void Building::draw(int offx, int offy) const {
 	Particle::draw(offx, offy);
 
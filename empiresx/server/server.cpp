@@ -9,7 +9,9 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <inttypes.h>
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <mutex>
@@ -35,6 +37,7 @@ class DedicatedGame;
 // dummy draw. we don't do anything graphical, so this is just a nop.
 void Particle::draw(int, int, unsigned) const {}
 void Building::draw(int, int) const {}
+void Units::draw(size_t, int, int) const {}
 
 void img_dim(Box2<float> &dim, int&, int&, unsigned, unsigned) {
 	// we don't care about its dimensions, just that it represents some small area
@@ -49,8 +52,13 @@ public:
 	MultiplayerHost &cb;
 	std::atomic<bool> running;
 
-	DedicatedGame(const StartMatch &settings, MultiplayerHost &cb) : Game(game::GameMode::multiplayer_host, nullptr, nullptr, settings), t_worker(), cb(cb) {
+	// the simulation worker helps out the pool as well
+	DedicatedGame(const StartMatch &settings, MultiplayerHost &cb)
+		: Game(game::GameMode::multiplayer_host, nullptr, &cb, settings, std::max(1u, std::thread::hardware_concurrency()) - 1)
+		, t_worker(), cb(cb)
+	{
 		world.populate(settings.slave_count);
+		record(replay_name(settings).c_str());
 		cb.set_gcb(this);
 		t_worker = std::thread(worker_loop, std::ref(*this));
 	}
@@ -122,7 +130,33 @@ public:
 
 }
 
+/** Simulate replay \a path without any delay and report how fast that went. */
+static int play(const char *path) {
+	using namespace genie::game;
+
+	try {
+		ReplayStats s = replay(path, std::max(1u, std::thread::hardware_concurrency()) - 1);
+
+		printf("%u ticks, %u turns, %zu orders in %.3f s: %.1f ticks/s\n",
+			s.ticks, s.turns, s.orders, s.seconds, s.seconds > 0 ? s.ticks / s.seconds : 0.0);
+		printf("checksum %016" PRIX64 ", %u recorded checksums verified\n", s.checksum, s.checksums);
+
+		if (s.desync != UINT32_MAX) {
+			fprintf(stderr, "%s: out of sync at tick %u\n", path, s.desync);
+			return 1;
+		}
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
 int main(int argc, char **argv) {
+	if (argc == 3 && (!strcmp(argv[1], "-r") || !strcmp(argv[1], "--replay")))
+		return play(argv[2]);
+
 	if (argc == 2) {
 		port = atoi(argv[1]);
 		if (port < 1 || port > UINT16_MAX) {
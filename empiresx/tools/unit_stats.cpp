@@ -0,0 +1,238 @@
+/* Copyright 2016-2020 the Age of Empires Free Software Remake authors. See LEGAL for legal info */
+
+/*
+ * Build step that turns the unit table of the original game manual into constexpr tables.
+ *
+ * usage: gen_unit_stats unit_stats_aoe.csv unit_stats_aoe.hpp
+ */
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+enum Column {
+	col_name,
+	col_age,
+	col_hp,
+	col_attack,
+	col_attack_type,
+	col_reload,
+	col_melee_armor,
+	col_pierce_armor,
+	col_los,
+	col_range,
+	col_accuracy,
+	col_speed,
+	col_train_time,
+	col_food,
+	col_wood,
+	col_stone,
+	col_gold,
+	col_special,
+	col_max,
+};
+
+static std::string trim(const std::string &s) {
+	size_t begin = s.find_first_not_of(" \t\r"), end = s.find_last_not_of(" \t\r");
+	return begin == std::string::npos ? "" : s.substr(begin, end - begin + 1);
+}
+
+/** Split \a line at every comma that is not quoted. */
+static std::vector<std::string> split(const std::string &line) {
+	std::vector<std::string> fields(1);
+	bool quoted = false;
+
+	for (char c : line) {
+		if (c == '"')
+			quoted = !quoted;
+		else if (c == ',' && !quoted)
+			fields.emplace_back();
+		else
+			fields.back().push_back(c);
+	}
+
+	for (auto &f : fields)
+		f = trim(f);
+
+	return fields;
+}
+
+/** Enumerator for unit \a name, e.g. Short Swordsman becomes short_swordsman. */
+static std::string ident(const std::string &name) {
+	std::string id;
+
+	for (char c : name)
+		if (isalnum((unsigned char)c))
+			id.push_back((char)tolower((unsigned char)c));
+		else if (!id.empty() && id.back() != '_')
+			id.push_back('_');
+
+	while (!id.empty() && id.back() == '_')
+		id.pop_back();
+
+	return id;
+}
+
+static unsigned number(const std::string &s, unsigned line, unsigned max) {
+	char *end;
+	unsigned long v = strtoul(s.c_str(), &end, 10);
+
+	if (s.empty() || *end || v > max) {
+		fprintf(stderr, "line %u: bad number \"%s\"\n", line, s.c_str());
+		exit(1);
+	}
+
+	return (unsigned)v;
+}
+
+static const char *age(const std::string &s, unsigned line) {
+	static const char *const ages[] = {"I", "II", "III", "IV"};
+	static const char *const values[] = {"1", "2", "3", "4"};
+
+	for (unsigned i = 0; i < 4; ++i)
+		if (s == ages[i])
+			return values[i];
+
+	fprintf(stderr, "line %u: bad age \"%s\"\n", line, s.c_str());
+	exit(1);
+}
+
+static const char *attack_type(const std::string &s, unsigned line) {
+	if (s.empty())
+		return "AttackType::none";
+	if (s == "M")
+		return "AttackType::melee";
+	if (s == "P")
+		return "AttackType::pierce";
+
+	fprintf(stderr, "line %u: bad attack type \"%s\"\n", line, s.c_str());
+	exit(1);
+}
+
+static const char *speed(const std::string &s, unsigned line) {
+	if (s == "S")
+		return "SpeedClass::slow";
+	if (s == "M")
+		return "SpeedClass::medium";
+	if (s == "F")
+		return "SpeedClass::fast";
+
+	fprintf(stderr, "line %u: bad speed \"%s\"\n", line, s.c_str());
+	exit(1);
+}
+
+/** Seconds with fraction to milliseconds. */
+static unsigned millis(const std::string &s, unsigned line) {
+	char *end;
+	double v = strtod(s.c_str(), &end);
+
+	if (s.empty() || *end || v < 0 || v > 60) {
+		fprintf(stderr, "line %u: bad time \"%s\"\n", line, s.c_str());
+		exit(1);
+	}
+
+	return (unsigned)lround(v * 1000);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s unit_stats.csv output.hpp\n", argc > 0 ? argv[0] : "gen_unit_stats");
+		return 1;
+	}
+
+	std::ifstream in(argv[1]);
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	std::string line, rows, names, table;
+	std::set<std::string> seen;
+	unsigned lineno = 0, count = 0;
+
+	for (std::getline(in, line), ++lineno; std::getline(in, line);) {
+		++lineno;
+
+		if (trim(line).empty())
+			continue;
+
+		std::vector<std::string> f = split(line);
+		if (f.size() < col_special) {
+			fprintf(stderr, "%s:%u: expected %u columns, got %zu\n", argv[1], lineno, (unsigned)col_special, f.size());
+			return 1;
+		}
+
+		std::string id = ident(f[col_name]);
+		if (id.empty() || !seen.insert(id).second) {
+			fprintf(stderr, "%s:%u: bad or duplicate name \"%s\"\n", argv[1], lineno, f[col_name].c_str());
+			return 1;
+		}
+
+		rows += "\t" + id + ",\n";
+
+		char buf[512];
+		// costs are stored in ResourceType order: wood, food, gold, stone
+		snprintf(buf, sizeof buf, "\t{%u, %u, %u, %u, %u, %u, %u, %u, %u, %s, %s, %s, {%u, %u, %u, %u}, speed_of(%s)}, // %s\n",
+			number(f[col_hp], lineno, UINT16_MAX), number(f[col_attack], lineno, UINT16_MAX),
+			millis(f[col_reload], lineno), number(f[col_train_time], lineno, UINT16_MAX),
+			number(f[col_melee_armor], lineno, UINT8_MAX), number(f[col_pierce_armor], lineno, UINT8_MAX),
+			number(f[col_los], lineno, UINT8_MAX), number(f[col_range], lineno, UINT8_MAX), number(f[col_accuracy], lineno, UINT8_MAX),
+			attack_type(f[col_attack_type], lineno), speed(f[col_speed], lineno), age(f[col_age], lineno),
+			number(f[col_wood], lineno, UINT16_MAX), number(f[col_food], lineno, UINT16_MAX),
+			number(f[col_gold], lineno, UINT16_MAX), number(f[col_stone], lineno, UINT16_MAX),
+			speed(f[col_speed], lineno), f[col_name].c_str());
+
+		table += buf;
+		++count;
+	}
+
+	if (!count) {
+		fprintf(stderr, "%s: no units\n", argv[1]);
+		return 1;
+	}
+
+	FILE *out = fopen(argv[2], "w");
+	if (!out) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	fprintf(out,
+		"/* Generated by gen_unit_stats from unit_stats_aoe.csv. Do not edit. */\n"
+		"\n"
+		"#pragma once\n"
+		"\n"
+		"namespace genie {\n"
+		"\n"
+		"namespace game {\n"
+		"\n"
+		"/** Rows of unit_stats_aoe. */\n"
+		"enum class UnitRow {\n"
+		"%s"
+		"};\n"
+		"\n"
+		"static constexpr unsigned unit_row_count = %u;\n"
+		"\n"
+		"/** Base stats of all units from the original game manual. */\n"
+		"static constexpr UnitStats unit_stats_aoe[] = {\n"
+		"%s"
+		"};\n"
+		"\n"
+		"}\n"
+		"\n"
+		"}\n",
+		rows.c_str(), count, table.c_str());
+
+	if (fclose(out)) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	return 0;
+}